@@ -0,0 +1,71 @@
+/**
+ * collectd - inc/wt_aggregate.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_AGGREGATE_H
+#define WT_AGGREGATE_H 1
+
+#include <stdint.h>
+
+/* Aggregation windows
+ *
+ * The points of a series are folded into windows aligned on multiples of the
+ * window length, so that all the series with the same window are aligned. A
+ * window is emitted as a single point, timestamped with its start, when the
+ * first point of a later window arrives or when the caller decides it is
+ * over. Times are in cdtime_t units.
+ */
+
+#define WT_AGGREGATE_AVG 0
+#define WT_AGGREGATE_MIN 1
+#define WT_AGGREGATE_MAX 2
+#define WT_AGGREGATE_SUM 3
+#define WT_AGGREGATE_LAST 4
+#define WT_AGGREGATE_COUNT 5
+
+struct wt_aggregate {
+  // start of the current window, meaningless while count is 0
+  uint64_t start;
+  uint64_t count;
+  double sum;
+  double min;
+  double max;
+  double last;
+};
+
+/* Returns the WT_AGGREGATE_* function of name, or -1 */
+int wt_aggregate_parse_function(const char *name);
+
+/* Add a point to its window
+ * If the point starts a new window while the current one holds points, the
+ * current window is emitted: returns 1 and sets time and value. Returns 0
+ * otherwise. Points older than the current window are folded into it.
+ */
+int wt_aggregate_add(struct wt_aggregate *agg, int function, uint64_t window,
+                     uint64_t point_time, double point_value, uint64_t *time,
+                     double *value);
+
+/* Emit the current window if it holds points: returns 1 and sets time and
+ * value, the window being emptied. Returns 0 otherwise.
+ */
+int wt_aggregate_take(struct wt_aggregate *agg, int function, uint64_t *time,
+                      double *value);
+
+#endif /* WT_AGGREGATE_H */
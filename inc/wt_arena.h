@@ -0,0 +1,53 @@
+/**
+ * collectd - inc/wt_arena.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_ARENA_H
+#define WT_ARENA_H 1
+
+#include <stddef.h>
+
+/* Bump allocator for short-lived strings
+ * Allocations are carved from chunks and all released at once by
+ * wt_arena_reset(). Once reset, an arena that needed several chunks gets a
+ * single one of their total size, so an arena reused for each value list
+ * stops allocating once it has reached its working size.
+ */
+
+struct wt_arena_chunk;
+
+struct wt_arena {
+  // most recent first
+  struct wt_arena_chunk *head;
+  // size of the next chunk, 0 for the default
+  size_t chunk_size;
+};
+
+#define WT_ARENA_INIT                                                          \
+  { .head = NULL, .chunk_size = 0 }
+
+/* Returns NULL on allocation failure */
+void *wt_arena_alloc(struct wt_arena *arena, size_t size);
+char *wt_arena_strdup(struct wt_arena *arena, const char *str);
+
+void wt_arena_reset(struct wt_arena *arena);
+void wt_arena_free(struct wt_arena *arena);
+
+#endif /* WT_ARENA_H */
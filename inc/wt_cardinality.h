@@ -0,0 +1,53 @@
+/**
+ * collectd - inc/wt_cardinality.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_CARDINALITY_H
+#define WT_CARDINALITY_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Distinct series counter with a limit
+ *
+ * The hashes of the first limit series are kept in an exact set: these are
+ * the admitted series. Every series, admitted or not, is also counted in a
+ * HyperLogLog sketch, which estimates how many distinct series were seen
+ * past the limit in a few kilobytes. The counter is safe to use from several
+ * threads.
+ */
+
+struct wt_cardinality;
+
+/* Create a counter admitting at most limit series, which must be positive */
+struct wt_cardinality *wt_cardinality_create(size_t limit);
+void wt_cardinality_destroy(struct wt_cardinality *card);
+
+/* Count the series of hash, which must be well mixed
+ * Returns 0 if the series is admitted, -EDQUOT if it is new and the limit is
+ * reached, -ENOMEM on allocation failure.
+ */
+int wt_cardinality_admit(struct wt_cardinality *card, uint64_t hash);
+
+/* Number of distinct series seen: exact until the limit is reached, then
+ * estimated */
+uint64_t wt_cardinality_estimate(struct wt_cardinality *card);
+
+#endif /* WT_CARDINALITY_H */
@@ -0,0 +1,78 @@
+/**
+ * collectd - inc/wt_compress.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_COMPRESS_H
+#define WT_COMPRESS_H 1
+
+#include <stddef.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "wt_strbuf.h"
+
+/* Request body compression
+ * The zlib stream is allocated once and reset between bodies.
+ */
+
+#define WT_COMPRESS_NONE 0
+#define WT_COMPRESS_GZIP 1
+#define WT_COMPRESS_DEFLATE 2
+
+struct wt_compress {
+  int type;
+  int level;
+#ifdef HAVE_ZLIB
+  z_stream stream;
+  _Bool initialized;
+  // wt_compress_read() reached the end of the stream
+  _Bool finished;
+#endif
+};
+
+/* Parse a Compression option value, returns -1 if unknown or unsupported */
+int wt_compress_parse_type(const char *name);
+
+/* Value of the Content-Encoding header, NULL if no compression */
+const char *wt_compress_encoding(int type);
+
+int wt_compress_init(struct wt_compress *c, int type, int level);
+
+/* Compress data into out (reset first) */
+int wt_compress(struct wt_compress *c, const char *data, size_t len,
+                struct wt_strbuf *out);
+
+/* Compress data into out as it is read, size bytes at most
+ * consumed is the part of data compressed by the previous calls, 0 for a new
+ * body once wt_compress_rewind() has been called. Sets out_len to the number
+ * of bytes written, which is 0 once the whole stream has been read.
+ */
+int wt_compress_read(struct wt_compress *c, const char *data, size_t len,
+                     size_t *consumed, char *out, size_t size,
+                     size_t *out_len);
+
+/* Start a new stream for wt_compress_read() */
+void wt_compress_rewind(struct wt_compress *c);
+
+void wt_compress_free(struct wt_compress *c);
+
+#endif /* WT_COMPRESS_H */
@@ -0,0 +1,68 @@
+/**
+ * collectd - inc/wt_details.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_DETAILS_H
+#define WT_DETAILS_H 1
+
+#include <stddef.h>
+
+/* Responses of POSTs to /api/put?details
+ * When some points of a batch fail, the TSD answers 400 with the list of the
+ * failed datapoints and their error. The datapoints are matched back to the
+ * points of the batch by metric, tags and timestamp.
+ */
+
+#define WT_POINT_OK 0
+#define WT_POINT_RETRY 1
+#define WT_POINT_INVALID 2
+
+/* Called for each point rejected as invalid */
+typedef void (*wt_details_invalid_cb)(void *ctx, const char *metric,
+                                      const char *error);
+
+/* Flag the points of a batch listed in the errors of a details response
+ * The batch body is a JSON array of points, point i starting at offsets[i].
+ * status must have room for points entries. Errors are flagged WT_POINT_RETRY
+ * if the TSD may accept the point later and WT_POINT_INVALID otherwise.
+ * Returns the number of errors matched to a point, -1 if response is not a
+ * details response.
+ */
+int wt_details_parse(const char *response, const char *body, size_t body_len,
+                     const size_t *offsets, int points, int *status,
+                     wt_details_invalid_cb invalid, void *ctx);
+
+/* Find the offsets of the points of a batch body, for the batches read back
+ * from the spool, which only keep their body
+ * offsets must have room for points entries.
+ * Returns the number of points found, -1 if body is not a JSON array of at
+ * most points objects.
+ */
+int wt_details_offsets(const char *body, size_t body_len, size_t *offsets,
+                       int points);
+
+/* Copy the metric of point i of a batch body into buf
+ * Returns 0 on success, -1 if the point cannot be parsed.
+ */
+int wt_details_point_metric(const char *body, size_t body_len,
+                            const size_t *offsets, int points, int i,
+                            char *buf, size_t size);
+
+#endif /* WT_DETAILS_H */
@@ -0,0 +1,52 @@
+/**
+ * collectd - inc/wt_hash.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_HASH_H
+#define WT_HASH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WT_HASH_INIT UINT64_C(14695981039346656037)
+
+/* 64 bits FNV-1a, chainable by passing the previous result as seed */
+static inline uint64_t wt_hash(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *ptr = data;
+  uint64_t hash = seed;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= ptr[i];
+    hash *= UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+/* Final mix (from MurmurHash3), spreads FNV output over all bits */
+static inline uint64_t wt_hash_mix(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xff51afd7ed558ccd);
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+  hash ^= hash >> 33;
+  return hash;
+}
+
+#endif /* WT_HASH_H */
@@ -0,0 +1,54 @@
+/**
+ * collectd - inc/wt_hosttag.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_HOSTTAG_H
+#define WT_HOSTTAG_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* JsonHostTag cache
+ *
+ * Maps a Hostname to the tags parsed from it, or to the fact that it is not
+ * a json object, so that each distinct Hostname is only parsed once.
+ * The cache holds a bounded number of hosts, the least recently used one is
+ * evicted when it is full.
+ */
+
+struct wt_hosttag_cache;
+
+typedef int (*wt_hosttag_add_cb)(void *ctx, const char *key,
+                                 const char *value);
+
+struct wt_hosttag_cache *wt_hosttag_cache_create(size_t max_entries);
+void wt_hosttag_cache_destroy(struct wt_hosttag_cache *cache);
+
+/* Call add for each tag of the json object host
+ * Returns -1 if host is not a json object, the result of the first failed
+ * add call otherwise. cache may be NULL, host is then parsed every time.
+ */
+int wt_hosttag_cache_get(struct wt_hosttag_cache *cache, const char *host,
+                         wt_hosttag_add_cb add, void *ctx);
+
+void wt_hosttag_cache_stats(struct wt_hosttag_cache *cache, uint64_t *hits,
+                            uint64_t *misses, size_t *entries);
+
+#endif /* WT_HOSTTAG_H */
@@ -0,0 +1,49 @@
+/**
+ * collectd - inc/wt_intern.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_INTERN_H
+#define WT_INTERN_H 1
+
+#include <stddef.h>
+
+/* Shared string table
+ *
+ * Strings repeated across many series, such as the rendered tag set of the
+ * series of a host, are stored once and reference counted. The table is
+ * safe to use from several threads.
+ */
+
+struct wt_intern;
+
+struct wt_intern *wt_intern_create(void);
+/* All strings must have been released */
+void wt_intern_destroy(struct wt_intern *table);
+
+/* Return the shared, NUL terminated copy of the len bytes at data, taking a
+ * reference on it. Returns NULL on allocation failure.
+ */
+const char *wt_intern_get(struct wt_intern *table, const char *data,
+                          size_t len);
+
+/* Drop a reference taken by wt_intern_get(), NULL is ignored */
+void wt_intern_put(struct wt_intern *table, const char *str);
+
+#endif /* WT_INTERN_H */
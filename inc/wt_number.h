@@ -0,0 +1,47 @@
+/**
+ * collectd - inc/wt_number.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_NUMBER_H
+#define WT_NUMBER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number formatting for data points
+ *
+ * The formatters write the text of a number and its terminating nul to buf,
+ * which must hold WT_NUMBER_SIZE bytes, and return its length. The output is
+ * both a valid JSON number and a value the telnet interface of the TSD takes.
+ */
+
+#define WT_NUMBER_SIZE 32
+
+size_t wt_number_format_uint(char *buf, uint64_t value);
+
+size_t wt_number_format_int(char *buf, int64_t value);
+
+/* Shortest text that reads back as the same double
+ * Returns 0, buf being empty, if value is NaN or infinite: JSON has no
+ * representation for them.
+ */
+size_t wt_number_format_double(char *buf, double value);
+
+#endif /* WT_NUMBER_H */
@@ -0,0 +1,67 @@
+/**
+ * collectd - inc/wt_ring.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_RING_H
+#define WT_RING_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Consistent hash ring
+ *
+ * Each endpoint is placed at WT_RING_REPLICAS pseudo random points of a
+ * 64 bits ring. A series goes to the first endpoint found clockwise from its
+ * hash, so adding or removing an endpoint only moves the series of its
+ * neighbours.
+ */
+
+#ifndef WT_RING_REPLICAS
+#define WT_RING_REPLICAS 160
+#endif
+
+struct wt_ring_point {
+  uint64_t hash;
+  int endpoint;
+};
+
+struct wt_ring {
+  struct wt_ring_point *points;
+  size_t points_num;
+  int endpoints_num;
+};
+
+/* Build the ring of endpoints_num endpoints identified by names */
+int wt_ring_init(struct wt_ring *ring, char *const *names, int endpoints_num);
+void wt_ring_free(struct wt_ring *ring);
+
+/* Endpoint of hash, skipping endpoints for which up[endpoint] is false.
+ * up may be NULL. If no endpoint is up, the first candidate is returned.
+ */
+int wt_ring_lookup(const struct wt_ring *ring, uint64_t hash,
+                   const _Bool *up);
+
+/* First endpoint up found clockwise from the first point of endpoint on the
+ * ring, or endpoint itself if it is up or no other endpoint is.
+ */
+int wt_ring_successor(const struct wt_ring *ring, int endpoint,
+                      const _Bool *up);
+
+#endif /* WT_RING_H */
@@ -0,0 +1,95 @@
+/**
+ * collectd - inc/wt_rules.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_RULES_H
+#define WT_RULES_H 1
+
+#include <regex.h>
+
+/* Tagging rules of a Node
+ *
+ * A rule applies to the value lists whose plugin, and type if given, match
+ * its patterns, and sets the same prefix, metric and tag mappings as the
+ * tsdb_* meta data. Rules matching a plugin by name are looked up by hash,
+ * the others are tried in order after them.
+ */
+
+/* Tag keys of a rule, in the order of the tsdb_tag_* meta data */
+#define WT_RULE_TAG_PLUGIN 0
+#define WT_RULE_TAG_PLUGININSTANCE 1
+#define WT_RULE_TAG_TYPE 2
+#define WT_RULE_TAG_TYPEINSTANCE 3
+#define WT_RULE_TAG_DSNAME 4
+#define WT_RULE_TAGS 5
+
+/* A name, or an extended regular expression if given as "/regex/" */
+struct wt_rule_pattern {
+  char *name;
+  _Bool is_regex;
+  regex_t regex;
+};
+
+struct wt_rule_tag {
+  char *key;
+  char *value;
+};
+
+struct wt_rule {
+  struct wt_rule_pattern plugin;
+  // NULL name to match any type
+  struct wt_rule_pattern type;
+  // NULL if not set, like a missing tsdb_prefix or tsdb_id
+  char *prefix;
+  char *id;
+  // like tsdb_tag_*: NULL if not set, "" to drop the part from the metric
+  char *tag[WT_RULE_TAGS];
+  // like tsdb_tag_add_*
+  struct wt_rule_tag *add;
+  int add_num;
+
+  struct wt_rule *next;
+};
+
+struct wt_rules;
+
+struct wt_rule *wt_rule_create(void);
+void wt_rule_free(struct wt_rule *rule);
+
+/* Set a pattern of a rule
+ * Returns -EINVAL if the regular expression does not compile, -ENOMEM on
+ * allocation failure.
+ */
+int wt_rule_pattern_set(struct wt_rule_pattern *pattern, const char *str);
+
+/* Add a tag to a rule, replacing the value of an existing key */
+int wt_rule_add_tag(struct wt_rule *rule, const char *key, const char *value);
+
+struct wt_rules *wt_rules_create(void);
+void wt_rules_destroy(struct wt_rules *rules);
+
+/* Append a rule, which is then owned by rules */
+void wt_rules_add(struct wt_rules *rules, struct wt_rule *rule);
+
+/* First rule matching plugin and type, NULL if none */
+const struct wt_rule *wt_rules_match(const struct wt_rules *rules,
+                                     const char *plugin, const char *type);
+
+#endif /* WT_RULES_H */
@@ -0,0 +1,138 @@
+/**
+ * collectd - inc/wt_series.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_SERIES_H
+#define WT_SERIES_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wt_aggregate.h"
+
+/* Series identity cache
+ *
+ * Maps the identity of a series (host, plugin, plugin instance, type, type
+ * instance, ds name and a fingerprint of its tsdb_* meta data) to its
+ * pre-rendered metric name and tags, so that formatting a point costs a hash
+ * lookup instead of re-reading the meta data.
+ *
+ * The table is split in shards, each with its own lock and LRU list.
+ * Entries are only valid while their shard is locked: wt_series_cache_get()
+ * and wt_series_cache_insert() return with the shard locked, and
+ * wt_series_cache_release() must be called once the caller is done with the
+ * entry.
+ *
+ * The ends of the rendered points, which hold the tags, are interned: the
+ * series of a host mostly share a few tag sets.
+ */
+
+struct wt_series {
+  uint64_t hash;
+  // identity, see wt_series_key()
+  char *key;
+  size_t key_len;
+  // rendered beginning of a data point, up to the timestamp
+  char *head;
+  size_t head_len;
+  // rendered end of a data point, after the value, shared by the series
+  // with the same tags
+  const char *tail;
+  size_t tail_len;
+  // hash of the metric and tags, used to pick the endpoint of the series
+  uint64_t route;
+  // aggregation rule of the series, -1 if its points are sent as they are
+  int aggregate;
+  // how the series limit and MaxTags changed the series, see WT_LIMITED_*
+  // in write_opentsdb.c
+  int limited;
+  // window being aggregated and identifier hash of the series for flushes
+  struct wt_aggregate agg;
+  uint64_t ident;
+  // last value sent and its time, if sent is set, for deduplication
+  _Bool sent;
+  double sent_value;
+  uint64_t sent_time;
+  // last raw value of a counter, derive or absolute data source and its
+  // time, if rate_set is set, for LocalRates
+  _Bool rate_set;
+  uint64_t rate_value;
+  uint64_t rate_time;
+
+  struct wt_series *hash_next;
+  struct wt_series *lru_prev;
+  struct wt_series *lru_next;
+};
+
+struct wt_series_cache;
+
+/* Create a cache holding at most max_entries series
+ * evict, if not NULL, is called with ctx on each series evicted to make room
+ * for a new one, with its shard locked, before the series is freed. It must
+ * not call the other functions of the cache.
+ */
+struct wt_series_cache *
+wt_series_cache_create(size_t max_entries,
+                       void (*evict)(struct wt_series *series, void *ctx),
+                       void *ctx);
+void wt_series_cache_destroy(struct wt_series_cache *cache);
+
+/* Build the identity key of a series in buffer
+ * Returns the key length, or 0 if it does not fit.
+ */
+size_t wt_series_key(char *buffer, size_t buffer_size, const char *host,
+                     const char *plugin, const char *plugin_instance,
+                     const char *type, const char *type_instance,
+                     const char *ds_name, uint64_t fingerprint);
+
+/* Lock the shard of hash and look key up
+ * Returns NULL on miss, the shard stays locked in both cases.
+ */
+struct wt_series *wt_series_cache_get(struct wt_series_cache *cache,
+                                      const char *key, size_t key_len,
+                                      uint64_t hash);
+
+/* Lock the shard of hash and insert a series, evicting the least recently
+ * used one if the shard is full. If the key was inserted in the meantime,
+ * the existing entry is returned. Returns NULL (shard locked) on allocation
+ * failure.
+ */
+struct wt_series *wt_series_cache_insert(struct wt_series_cache *cache,
+                                         const char *key, size_t key_len,
+                                         uint64_t hash, const char *head,
+                                         size_t head_len, const char *tail,
+                                         size_t tail_len);
+
+/* Call fn on each series, with its shard locked
+ * fn must not call the other functions of the cache.
+ */
+void wt_series_cache_foreach(struct wt_series_cache *cache,
+                             void (*fn)(struct wt_series *series, void *ctx),
+                             void *ctx);
+
+/* Unlock the shard of hash */
+void wt_series_cache_release(struct wt_series_cache *cache, uint64_t hash);
+
+/* Hit and miss counters, summed over all shards */
+void wt_series_cache_stats(struct wt_series_cache *cache, uint64_t *hits,
+                           uint64_t *misses, size_t *entries);
+
+#endif /* WT_SERIES_H */
@@ -0,0 +1,82 @@
+/**
+ * collectd - inc/wt_spool.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_SPOOL_H
+#define WT_SPOOL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wt_strbuf.h"
+
+/* On-disk spool of batches that could not be POSTed
+ * Batches are appended to segment files named <sequence>.spool in the spool
+ * directory. Each record is a header holding a CRC32 of the record followed by
+ * the JSON body. Segments are read back oldest first and removed once fully
+ * replayed. When the spool exceeds its maximum size, the oldest segments are
+ * dropped.
+ *
+ * The read position is not persisted: after a restart, the records of the
+ * oldest segment that were already replayed are sent again. OpenTSDB
+ * overwrites a data point with the same value, so this only costs bandwidth.
+ *
+ * All the functions are thread safe.
+ */
+
+struct wt_spool;
+
+struct wt_spool_stats {
+  uint64_t size;
+  int segments;
+  // bytes of segments dropped because the spool was full
+  uint64_t dropped_bytes;
+  // records skipped because they failed the checksum or were truncated
+  uint64_t corrupted;
+};
+
+/* Open the spool in dir, creating the directory if needed
+ * Segments left by a previous run are replayed, new records go to a new
+ * segment. Returns NULL and sets errno on failure.
+ */
+struct wt_spool *wt_spool_open(const char *dir, uint64_t max_size,
+                               uint64_t segment_size);
+
+void wt_spool_close(struct wt_spool *spool);
+
+/* Append a batch, returns 0 on success or a negative errno value */
+int wt_spool_append(struct wt_spool *spool, const char *data, size_t len,
+                    int points, int endpoint);
+
+/* Read the oldest record into body (reset first)
+ * Returns 0 if a record was read, 1 if the spool is empty or a negative errno
+ * value. The record stays in the spool until wt_spool_consume() is called.
+ */
+int wt_spool_peek(struct wt_spool *spool, struct wt_strbuf *body, int *points,
+                  int *endpoint);
+
+/* Remove the record returned by the last wt_spool_peek() */
+void wt_spool_consume(struct wt_spool *spool);
+
+_Bool wt_spool_empty(struct wt_spool *spool);
+
+void wt_spool_stats(struct wt_spool *spool, struct wt_spool_stats *stats);
+
+#endif /* WT_SPOOL_H */
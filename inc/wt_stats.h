@@ -0,0 +1,82 @@
+/**
+ * collectd - inc/wt_stats.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_STATS_H
+#define WT_STATS_H 1
+
+#include <stdint.h>
+
+/* Internal counters of a Node
+ * Counters are updated with relaxed atomic additions from any thread, with
+ * or without the locks of the Node, and read the same way.
+ */
+
+#define WT_STAT_POINTS_QUEUED 0
+#define WT_STAT_POINTS_FILTERED 1
+#define WT_STAT_POINTS_SENT 2
+#define WT_STAT_POINTS_RETRIED 3
+#define WT_STAT_POINTS_SPOOLED 4
+#define WT_STAT_POINTS_REPLAYED 5
+#define WT_STAT_POINTS_INVALID 6
+#define WT_STAT_POINTS_DROPPED 7
+#define WT_STAT_POINTS_OVER_LIMIT 8
+#define WT_STAT_POINTS_COLLAPSED 9
+#define WT_STAT_POINTS_TRIMMED 10
+#define WT_STAT_BATCHES_SENT 11
+#define WT_STAT_BATCHES_FAILED 12
+#define WT_STAT_BYTES_UNCOMPRESSED 13
+#define WT_STAT_BYTES_SENT 14
+#define WT_STAT_LOCK_WAITS 15
+#define WT_STAT_LOCK_WAIT_US 16
+#define WT_STAT_LATENCY_US 17
+#define WT_STAT_MAX 18
+
+/* Upper bounds of the latency histogram buckets in milliseconds, the last
+ * bucket has none */
+#define WT_STAT_LATENCY_BOUNDS                                                 \
+  { 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 }
+#define WT_STAT_LATENCY_BUCKETS 12
+
+struct wt_stats {
+  uint64_t counter[WT_STAT_MAX];
+  uint64_t latency[WT_STAT_LATENCY_BUCKETS];
+};
+
+static inline void wt_stats_add(struct wt_stats *stats, int id, uint64_t n) {
+  __atomic_fetch_add(&stats->counter[id], n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t wt_stats_get(struct wt_stats *stats, int id) {
+  return __atomic_load_n(&stats->counter[id], __ATOMIC_RELAXED);
+}
+
+/* Name of counter id, as dispatched */
+const char *wt_stats_name(int id);
+
+/* Count a request that took us microseconds */
+void wt_stats_latency(struct wt_stats *stats, uint64_t us);
+
+/* Number of requests in the latency buckets up to bucket, the bound of
+ * bucket being written to bound (0 for the last one) */
+uint64_t wt_stats_latency_le(struct wt_stats *stats, int bucket,
+                             uint64_t *bound);
+
+#endif /* WT_STATS_H */
@@ -0,0 +1,54 @@
+/**
+ * collectd - inc/wt_strbuf.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_STRBUF_H
+#define WT_STRBUF_H 1
+
+#include <stddef.h>
+
+/* Growable byte buffer
+ * Memory is kept across wt_strbuf_reset() calls, so a buffer reused for each
+ * batch stops allocating once it has reached its working size.
+ * data is always NUL terminated once something has been appended.
+ */
+struct wt_strbuf {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+#define WT_STRBUF_INIT                                                         \
+  { .data = NULL, .len = 0, .size = 0 }
+
+/* Make room for at least len more bytes (plus the terminating NUL) */
+int wt_strbuf_reserve(struct wt_strbuf *buf, size_t len);
+
+int wt_strbuf_append(struct wt_strbuf *buf, const char *data, size_t len);
+int wt_strbuf_append_str(struct wt_strbuf *buf, const char *str);
+int wt_strbuf_append_char(struct wt_strbuf *buf, char c);
+
+/* Append str as a quoted and escaped JSON string */
+int wt_strbuf_append_json_string(struct wt_strbuf *buf, const char *str);
+
+void wt_strbuf_reset(struct wt_strbuf *buf);
+void wt_strbuf_free(struct wt_strbuf *buf);
+
+#endif /* WT_STRBUF_H */
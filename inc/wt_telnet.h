@@ -0,0 +1,79 @@
+/**
+ * collectd - inc/wt_telnet.h
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#ifndef WT_TELNET_H
+#define WT_TELNET_H 1
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* Connection to the telnet style interface of a TSD
+ * Data points are written as "put" lines on a long-lived TCP connection. The
+ * TSD does not acknowledge them, it only answers with an error line when a
+ * point is rejected.
+ *
+ * The socket is non-blocking, writes wait at most timeout milliseconds for
+ * the TSD to read. Any failure closes the connection, the next write opens a
+ * new one. A connection is only used by one thread at a time.
+ */
+
+struct wt_telnet {
+  char *host;
+  char *port;
+  // -1 while disconnected
+  int fd;
+  // line being received from the TSD
+  char partial[256];
+  size_t partial_len;
+};
+
+/* Parse an address of the form [tcp://]host[:port], IPv6 addresses being
+ * enclosed in brackets. Returns 0 or a negative errno value.
+ */
+int wt_telnet_init(struct wt_telnet *conn, const char *address,
+                   const char *default_port);
+
+void wt_telnet_free(struct wt_telnet *conn);
+
+/* Connect if not connected yet
+ * Returns 0 or a negative errno value (EAI_* errors are reported as
+ * -EHOSTUNREACH).
+ */
+int wt_telnet_connect(struct wt_telnet *conn, int timeout);
+
+void wt_telnet_close(struct wt_telnet *conn);
+
+/* Write all the buffers of iov, connecting first if needed
+ * The buffers are gathered into as few system calls as possible. iov is
+ * modified. Returns 0 or a negative errno value, in which case an unknown
+ * part of the data was written and the connection is closed.
+ */
+int wt_telnet_writev(struct wt_telnet *conn, struct iovec *iov, int iovcnt,
+                     int timeout);
+
+/* Read what the TSD sent without waiting
+ * The last complete line read, if any, is copied to line. Returns the number
+ * of lines read, or a negative errno value if the TSD closed the connection
+ * (-EPIPE) or it failed, in which case it is closed.
+ */
+int wt_telnet_drain(struct wt_telnet *conn, char *line, size_t line_size);
+
+#endif /* WT_TELNET_H */
@@ -126,11 +126,25 @@
  *   </Rule>
  * </Chain>
  *
+ * The same tagging can be declared in the Node with <Rule> blocks, matched
+ * once per series instead of once per value, the meta data overriding them:
+ *
+ *   <Node>
+ *     <Rule "cpu">
+ *       TagPluginInstance "cpu"
+ *       TagType ""
+ *       Prefix "sys."
+ *     </Rule>
+ *     <Rule "/^(df|disk)$/">
+ *       Prefix "sys."
+ *     </Rule>
+ *   </Node>
+ *
  * IMPORTANT WARNING
  * -----------------
  * OpenTSDB allows no more than 8 tags.
  * Collectd admins should be aware of this when defining filter rules and host
- * tags.
+ * tags. The tags past MaxTags (8 by default) are dropped, see wt_tags_trim().
  *
  */
 
@@ -139,6 +153,7 @@
  * - write ->  wt_write
  * - flush -> wt_flush
  * - complex_config -> wt_config;
+ * - init -> wt_init (starts one sender thread per Node)
  */
 
 #include <fcntl.h>
@@ -149,11 +164,14 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <inttypes.h>
 #include <curl/curl.h>
-#include <json-c/json.h>
 #include <netdb.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <regex.h>
 
 #define COLLECTD_USERAGENT "collectd"
 #define HAVE__BOOL 1
@@ -165,24 +183,171 @@
 #include <plugin.h>
 #include <utils_cache.h>
 
-#ifndef GAUGE_FORMAT
-#define GAUGE_FORMAT "%.15g"
-#endif
+#include "wt_aggregate.h"
+#include "wt_arena.h"
+#include "wt_cardinality.h"
+#include "wt_compress.h"
+#include "wt_details.h"
+#include "wt_hash.h"
+#include "wt_hosttag.h"
+#include "wt_number.h"
+#include "wt_ring.h"
+#include "wt_rules.h"
+#include "wt_series.h"
+#include "wt_spool.h"
+#include "wt_stats.h"
+#include "wt_strbuf.h"
+#include "wt_telnet.h"
 
 #ifndef WT_DEFAULT_NODE
 #define WT_DEFAULT_NODE "http://localhost:4242"
 #endif
 
+#ifndef WT_DEFAULT_TELNET_NODE
+#define WT_DEFAULT_TELNET_NODE "localhost:4242"
+#endif
+
+#ifndef WT_DEFAULT_TELNET_PORT
+#define WT_DEFAULT_TELNET_PORT "4242"
+#endif
+
 #ifndef WT_DEFAULT_ESCAPE
 #define WT_DEFAULT_ESCAPE '.'
 #endif
 
+/* Seconds a point may wait in a batch before the batch is sent */
+#ifndef WT_DEFAULT_MAX_BUFFER_AGE
+#define WT_DEFAULT_MAX_BUFFER_AGE 10
+#endif
+
+/* Number of full batches waiting for the sender thread
+ * Must absorb the burst of values collectd writes at each interval */
+#ifndef WT_DEFAULT_SEND_QUEUE_SIZE
+#define WT_DEFAULT_SEND_QUEUE_SIZE 64
+#endif
+
+/* Number of series whose rendered name and tags are kept */
+#ifndef WT_DEFAULT_SERIES_CACHE_SIZE
+#define WT_DEFAULT_SERIES_CACHE_SIZE 16384
+#endif
+
+/* Number of distinct JsonHostTag Hostnames whose parsed tags are kept */
+#ifndef WT_DEFAULT_HOST_TAG_CACHE_SIZE
+#define WT_DEFAULT_HOST_TAG_CACHE_SIZE 4096
+#endif
+
+/* Consecutive failed POSTs before an endpoint is taken out of the ring */
+#ifndef WT_DEFAULT_ENDPOINT_FAILURES
+#define WT_DEFAULT_ENDPOINT_FAILURES 3
+#endif
+
+/* Seconds before an endpoint taken out of the ring is tried again */
+#ifndef WT_DEFAULT_ENDPOINT_RETRY_INTERVAL
+#define WT_DEFAULT_ENDPOINT_RETRY_INTERVAL 30
+#endif
+
+/* Number of concurrent POSTs per Node */
+#ifndef WT_DEFAULT_MAX_IN_FLIGHT
+#define WT_DEFAULT_MAX_IN_FLIGHT 4
+#endif
+
+/* Failed batches kept in memory for another attempt */
+#ifndef WT_DEFAULT_RETRY_QUEUE_SIZE
+#define WT_DEFAULT_RETRY_QUEUE_SIZE 16
+#endif
+
+/* Attempts of a failed batch before it is spooled or dropped */
+#ifndef WT_DEFAULT_MAX_RETRIES
+#define WT_DEFAULT_MAX_RETRIES 5
+#endif
+
+/* Backoff before the first retry of a batch and maximum backoff, in seconds */
+#ifndef WT_DEFAULT_RETRY_DELAY
+#define WT_DEFAULT_RETRY_DELAY 1
+#endif
+
+#ifndef WT_DEFAULT_RETRY_MAX_DELAY
+#define WT_DEFAULT_RETRY_MAX_DELAY 60
+#endif
+
+/* Seconds of an aggregation window when Window is not given */
+#ifndef WT_DEFAULT_AGGREGATE_WINDOW
+#define WT_DEFAULT_AGGREGATE_WINDOW 10
+#endif
+
+/* Seconds after which an unchanged value is sent again with Deduplicate */
+#ifndef WT_DEFAULT_HEARTBEAT
+#define WT_DEFAULT_HEARTBEAT 600
+#endif
+
+/* Tags of a data point past which the last ones are dropped, the default
+ * tsd.storage.max_tags of the TSD */
+#ifndef WT_DEFAULT_MAX_TAGS
+#define WT_DEFAULT_MAX_TAGS 8
+#endif
+
+/* Metrics whose invalid points are counted separately between two logs */
+#ifndef WT_INVALID_METRICS_MAX
+#define WT_INVALID_METRICS_MAX 32
+#endif
+
+/* Largest response body kept, details of bigger responses are ignored */
+#ifndef WT_RESPONSE_MAX_SIZE
+#define WT_RESPONSE_MAX_SIZE (1024 * 1024)
+#endif
+
+/* Maximum size of the spool in megabytes */
+#ifndef WT_DEFAULT_SPOOL_MAX_SIZE
+#define WT_DEFAULT_SPOOL_MAX_SIZE 1024
+#endif
+
+/* Points per second replayed from the spool */
+#ifndef WT_DEFAULT_SPOOL_REPLAY_RATE
+#define WT_DEFAULT_SPOOL_REPLAY_RATE 5000
+#endif
+
+/* Size of a spool segment file in bytes */
+#ifndef WT_SPOOL_SEGMENT_SIZE
+#define WT_SPOOL_SEGMENT_SIZE (16 * 1024 * 1024)
+#endif
+
+/* curl_multi_poll() and curl_multi_wakeup() appeared in libcurl 7.68.0
+ * Older versions poll with curl_multi_wait() and a short timeout instead.
+ */
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define WT_HAVE_CURL_MULTI_POLL 1
+#endif
+
 /* Ethernet - (IPv6 + TCP) = 1500 - (40 + 32) = 1428 */
 #ifndef WT_SEND_BUF_SIZE
 #define WT_SEND_BUF_SIZE 1428
 #endif
 
-/* Meta data definitions about tsdb tags */
+/* Protocols a Node sends data points with
+ * HTTP POSTs JSON arrays to /api/put, TELNET streams "put" lines over a TCP
+ * connection to the telnet style interface of the TSD.
+ */
+#define WT_PROTOCOL_HTTP 0
+#define WT_PROTOCOL_TELNET 1
+
+/* Units of the timestamps of the data points, see TimestampPrecision */
+#define WT_PRECISION_SECONDS 0
+#define WT_PRECISION_MILLISECONDS 1
+
+/* What happens to the new series past a SeriesLimit, see SeriesLimitPolicy */
+#define WT_LIMIT_POLICY_DROP 0
+#define WT_LIMIT_POLICY_COLLAPSE 1
+
+/* Value replacing the plugin instance, or else the type instance, of a
+ * collapsed series */
+#define WT_LIMIT_COLLAPSED_INSTANCE "other"
+
+/* How a series was changed by the cardinality guard (wt_series.limited) */
+#define WT_LIMITED_DROPPED 0x1
+#define WT_LIMITED_COLLAPSED 0x2
+#define WT_LIMITED_TRIMMED 0x4
+
+/* Meta data definitions about tsdb tags, in the order of WT_RULE_TAG_* */
 #define TSDB_TAG_PLUGIN 0
 #define TSDB_TAG_PLUGININSTANCE 1
 #define TSDB_TAG_TYPE 2
@@ -191,18 +356,259 @@
 static const char *meta_tag_metric_id[] = {
     "tsdb_tag_plugin", "tsdb_tag_pluginInstance", "tsdb_tag_type",
     "tsdb_tag_typeInstance", "tsdb_tag_dsname"};
+#define TSDB_META_PREFIX "tsdb_"
+
+/* A batch of data points, serialized as the JSON array POSTed to /api/put or
+ * as consecutive "put" lines for the telnet protocol.
+ * Batches are recycled through wt_callback.free_batches so that their body
+ * buffer is allocated once and reused.
+ */
+struct wt_batch {
+  struct wt_strbuf body;
+  // number of points in body
+  int points;
+  // offset, time, identifier hash and ring route of each point in body, to
+  // split the batch when some points fail, are flushed or move to another
+  // endpoint
+  size_t *offsets;
+  cdtime_t *times;
+  uint64_t *idents;
+  uint64_t *routes;
+  int offsets_size;
+  // index of the endpoint the points were routed to
+  int endpoint;
+  // time the first point was added, for max_buffer_age
+  cdtime_t created;
+  // failed POSTs of the batch and time of its next attempt
+  int attempts;
+  cdtime_t retry_at;
+  // points are telnet lines, without separator nor enclosing brackets
+  _Bool lines;
+  struct wt_batch *next;
+};
+
+/* Circuit breaker states of an endpoint
+ * An endpoint opens after endpoint_failures_max consecutive failed POSTs: it
+ * leaves the ring and nothing is POSTed to it for endpoint_retry_interval
+ * seconds. It is then half open: a single POST is let through, which closes
+ * the endpoint if it succeeds or opens it again if it fails.
+ */
+#define WT_BREAKER_CLOSED 0
+#define WT_BREAKER_OPEN 1
+#define WT_BREAKER_HALF_OPEN 2
+
+/* One TSD of a Node
+ * Series are spread over the endpoints of a Node by consistent hashing.
+ */
+struct wt_endpoint {
+  char *url;
+
+  // only used by the sender thread
+  int connect_failed_log_count;
+  time_t last_error_log;
+  // telnet protocol: connection and error lines sent back by the TSD
+  struct wt_telnet telnet;
+  int rejected_log_count;
+  char rejected[128];
+
+  // circuit breaker, see WT_BREAKER_*
+  int state;
+  // consecutive failed POSTs
+  int failures;
+  // end of the cool-down of an open endpoint
+  time_t down_until;
+  // set while the single POST of a half open endpoint is in flight
+  _Bool probing;
+};
+
+/* Tags of a data point
+ * Keys and values are NUL terminated strings stored in one reusable buffer
+ * and referenced by offset. Adding an existing key replaces its value.
+ */
+struct wt_tag {
+  size_t key;
+  size_t value;
+};
+
+struct wt_tags {
+  struct wt_tag *tag;
+  int num;
+  int size;
+  // number of tags from the host and the identifier, the others come from
+  // AddTag and tsdb_tag_add_* and are the first dropped by wt_tags_trim()
+  int fixed;
+  struct wt_strbuf storage;
+};
+
+/* The tsdb_* meta data of a value list
+ * Read at most once per value list by wt_meta_read(), as the meta data API
+ * copies every key and string it returns: up front if the value list has
+ * meta data and the series cache is enabled, to fingerprint it, else when a
+ * series of the value list is not in the series cache. The copies are carved
+ * from an arena that is reset by the next read.
+ */
+struct wt_meta_entry {
+  const char *key;
+  // NULL if the value could not be read, see status
+  const char *value;
+  // result of meta_data_get_string()
+  int status;
+};
+
+struct wt_meta {
+  struct wt_meta_entry *entry;
+  int num;
+  int size;
+  // whether the entries are those of the current value list
+  _Bool valid;
+  struct wt_arena arena;
+};
+
+/* Buffers of the write path
+ * Each writing thread gets its own set, see wt_scratch_get(), so that they
+ * are allocated once and reused for every value list.
+ */
+struct wt_scratch {
+  struct wt_tags tags;
+  struct wt_meta meta;
+  struct wt_strbuf point;
+  struct wt_strbuf tail;
+};
+
+/* A POST in flight
+ * Each slot owns an easy handle attached to the multi handle of the Node while
+ * a batch is being sent. Connections are kept alive in the multi handle cache
+ * and reused by the next request to the same endpoint.
+ */
+struct wt_request {
+  CURL *curl;
+  char curl_errbuf[CURL_ERROR_SIZE];
+  // batch being POSTed, NULL if the slot is free
+  struct wt_batch *batch;
+  // compressed body of the batch
+  struct wt_strbuf compressed;
+  // StreamBody: body deflated as curl reads it, see wt_read_body()
+  struct wt_compress stream;
+  const struct wt_strbuf *body;
+  size_t body_offset;
+  uint64_t body_sent;
+  // response body, parsed when some points of the batch failed
+  struct wt_strbuf response;
+  long http_code;
+  // set by the sender thread once the request is attached or completed
+  _Bool started;
+  cdtime_t started_at;
+  _Bool done;
+  // 0 if the TSD answered, even if it rejected some points
+  int status;
+  // new batches with the points of the batch to POST again
+  struct wt_batch *split;
+};
+
+/* A flush waiting for the sender thread
+ * Points older than before (all if 0) of the series whose identifier hashes
+ * to ident (all if !by_ident) are sent.
+ */
+struct wt_flush_request {
+  cdtime_t before;
+  uint64_t ident;
+  _Bool by_ident;
+  struct wt_flush_request *next;
+};
+
+/* An <Aggregate> block: the points of the metrics matching regex are sent
+ * as one point per window
+ */
+struct wt_aggregate_rule {
+  regex_t regex;
+  // see WT_AGGREGATE_*
+  int function;
+  cdtime_t window;
+};
+
+/* Rate, aggregation and deduplication of a data point, see
+ * wt_append_series() */
+struct wt_point_filter {
+  // the point
+  cdtime_t time;
+  double value;
+  // set with LocalRates for a counter, derive or absolute data source: value
+  // is the rate of raw, computed by wt_series_filter()
+  _Bool rate;
+  int type;
+  value_t raw;
+  double min;
+  // set if the point went into an aggregation window instead of being sent
+  _Bool absorbed;
+  // set if a window is over, its aggregate is sent instead of the point
+  _Bool emit;
+  cdtime_t emit_time;
+  double emit_value;
+  int function;
+  // set if the point or aggregate repeats the last one sent
+  _Bool suppressed;
+};
+
+/* Limit on the distinct series of the metrics starting with prefix, the
+ * empty prefix matching all metrics. The longest matching prefix applies.
+ */
+struct wt_series_limit {
+  char *prefix;
+  size_t prefix_len;
+  size_t max;
+  struct wt_cardinality *series;
+  // set once the limit was reached and logged
+  _Bool reached;
+};
+
+/* Open batches of a write thread
+ * Each thread writing to a Node fills its own batch per endpoint, and hands
+ * the full ones over to the sender thread through wt_callback.handoff, so
+ * that the write threads only share send_lock once per batch. lock is only
+ * contended when the sender thread takes the open batches for a flush, for
+ * max_buffer_age or on shutdown, see wt_writers_collect().
+ * Writers are kept until the Node is freed.
+ */
+struct wt_writer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  // batch being filled for each endpoint
+  struct wt_batch **batches;
+  // copy of endpoints_up, refreshed when the thread gets an empty batch
+  _Bool *up;
+  struct wt_writer *next;
+};
+
+/* Points rejected as invalid by the TSD, counted per metric between logs */
+struct wt_invalid_metric {
+  char metric[256];
+  char error[128];
+  uint64_t points;
+};
 
 /*
  * Private variables
  */
 struct wt_callback {
 
-  char *node;
+  // see WT_PROTOCOL_*
+  int protocol;
+  // see WT_PRECISION_*
+  int precision;
+  // <Node "name">, NULL if not given
+  char *name;
+
+  // TSDs of the Node and the ring spreading series over them
+  struct wt_endpoint *endpoints;
+  int endpoints_num;
+  struct wt_ring ring;
+  // closed endpoints, which are in the ring, protected by send_lock
+  _Bool *endpoints_up;
+  int endpoint_failures_max;
+  int endpoint_retry_interval;
 
   // Curl Parameters
-  CURL *curl;
   struct curl_slist *headers;
-  char curl_errbuf[CURL_ERROR_SIZE];
   int timeout;
   char *cacert;
   char *capath;
@@ -214,7 +620,39 @@ struct wt_callback {
   _Bool verify_host;
   _Bool log_http_error;
 
+  // Request body compression, only used by the sender thread
+  int compression;
+  int compression_level;
+  struct wt_compress compress;
+  // compress while uploading instead of before, see wt_read_body()
+  _Bool stream_body;
+
+  // Concurrent POSTs, only used by the sender thread
+  CURLM *multi;
+  struct wt_request *requests;
+  int max_in_flight;
+  _Bool http2;
+
+  // Batches that failed to be POSTed, NULL if disabled
+  // The spool is filled by the sender thread and drained by the replayer
+  // thread, which has its own curl handle and compression stream.
+  struct wt_spool *spool;
+  char *spool_dir;
+  int spool_max_size;
+  int spool_replay_rate;
+  struct wt_request replay;
+  struct wt_compress replay_compress;
+  // telnet protocol: connections of the replayer thread, one per endpoint
+  struct wt_telnet *replay_telnet;
+  // signaled when the replayer thread must stop
+  pthread_cond_t replay_cond;
+  pthread_t replayer_thread;
+  _Bool replayer_running;
+
   _Bool store_rates;
+  // StoreRates computes the rates from the previous values kept in the
+  // series cache, rather than with the value cache of collectd
+  _Bool local_rates;
   _Bool always_append_ds;
 
   // set to true if host contains a json structure with tags
@@ -222,486 +660,3393 @@ struct wt_callback {
   // set to true to set tag fqdn to host if host is not a parsable json structure
   // only useful if json_host_tag is set to true
   _Bool auto_fqdn_failback;
-  // Maximum number of metrics in buffer
+  // Parsed json Hostnames, NULL if disabled
+  struct wt_hosttag_cache *host_tag_cache;
+  int host_tag_cache_size;
+  // Rendered metric names and tags, NULL if disabled
+  struct wt_series_cache *series_cache;
+  int series_cache_size;
+  // Aggregation rules, the first one matching a metric applies. The state of
+  // the windows is kept in the series cache.
+  struct wt_aggregate_rule *aggregates;
+  int aggregates_num;
+  // Tagging rules, NULL if none. The tsdb_* meta data overrides them.
+  struct wt_rules *rules;
+  // Cardinality guard: limits on the distinct series, checked when a series
+  // is rendered, what happens to the new ones past a limit, and the number
+  // of tags kept (0 for all)
+  struct wt_series_limit *limits;
+  int limits_num;
+  int limit_policy;
+  int max_tags;
+  // Points repeating the last one sent for their series are not sent, unless
+  // heartbeat passed since then. Also kept in the series cache.
+  _Bool deduplicate;
+  cdtime_t heartbeat;
+  double deadband;
+  double deadband_relative;
+
+  // A batch is sent when it holds buffer_metric_max points, when its body
+  // reaches buffer_bytes or when its first point is max_buffer_age old
   int buffer_metric_max;
-  // the Json buffer
-  json_object *json_buffer;
-  // number of metrics in buffer
-  int buffer_metric_size;
+  int buffer_bytes;
+  cdtime_t max_buffer_age;
+
+  // Write threads of the Node, prepended atomically and never removed
+  struct wt_writer *writers;
+  // Full batches handed over by the write threads (lock-free LIFO), moved
+  // to the send queue by the sender thread
+  struct wt_batch *handoff;
+  // Next time the sender thread takes the aged open batches of the writers,
+  // 0 if there is no max_buffer_age. Only used by the sender thread.
+  cdtime_t collect_at;
 
-  // mutex used for emptying/happending in the buffer
+  // Full batches waiting to be POSTed by the sender thread (FIFO)
+  struct wt_batch *send_queue_head;
+  struct wt_batch *send_queue_tail;
+  int send_queue_max;
+  int send_queue_len;
+  // Flushes waiting for the sender thread (FIFO)
+  struct wt_flush_request *flush_head;
+  struct wt_flush_request *flush_tail;
+  // Failed batches waiting for their next attempt (FIFO)
+  struct wt_batch *retry_head;
+  struct wt_batch *retry_tail;
+  int retry_len;
+  int retry_queue_max;
+  int max_retries;
+  cdtime_t retry_delay;
+  cdtime_t retry_delay_max;
+  unsigned int retry_seed;
+  // points of the batches given up, only used by the sender thread
+  uint64_t given_up_points;
+  time_t last_give_up_log;
+  // points rejected as invalid, only used by the sender thread
+  struct wt_invalid_metric invalid_metrics[WT_INVALID_METRICS_MAX];
+  int invalid_metrics_num;
+  uint64_t invalid_other_points;
+  time_t last_invalid_log;
+  // Sent batches kept for reuse
+  struct wt_batch *free_batches;
+  // number of points dropped because the send queue was full
+  uint64_t dropped_points;
+  time_t last_drop_log;
+
+  // mutex used for emptying/happending in the buffer and the send queue
   pthread_mutex_t send_lock;
+  // signaled when a batch is queued or when the sender must stop
+  pthread_cond_t send_cond;
+  pthread_t sender_thread;
+  _Bool sender_running;
+  _Bool sender_shutdown;
+  // set while the sender thread waits on its transfers rather than send_cond
+  _Bool sender_polling;
 
-  int connect_failed_log_count;
-  time_t last_error_log;
+  // Internal counters, dispatched by wt_read if report_stats is set
+  struct wt_stats stats;
+  _Bool report_stats;
+  char stats_instance[DATA_MAX_NAME_LEN];
+
+  // next Node in wt_callbacks
+  struct wt_callback *next;
 };
 
+/* List of configured Nodes, used to start sender threads in wt_init */
+static struct wt_callback *wt_callbacks = NULL;
+static pthread_mutex_t wt_callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void wt_callback_free(void *data);
-int wt_config_curl(struct wt_callback *cb);
-static int wt_write_nolock(struct wt_callback *cb);
+int wt_config_curl(struct wt_callback *cb, struct wt_request *req);
+static void wt_aggregate_sweep(struct wt_callback *cb, cdtime_t now,
+                               _Bool force);
 
-// Discard return from libcurl
+// Keep the response from libcurl, for the details of failed points
 size_t writefunc(void *ptr, size_t size, size_t nmemb, void *s)
 {
+  struct wt_strbuf *response = s;
+
+  if (response->len + size * nmemb <= WT_RESPONSE_MAX_SIZE)
+    wt_strbuf_append(response, ptr, size * nmemb);
   return size*nmemb;
 }
 
-/* Reset the metric buffer
+/* StreamBody: let curl read the compressed body of a request as it is
+ * deflated, through chunked transfer encoding, instead of compressing the
+ * whole batch into req->compressed first.
  */
-static void wt_reset_buffer(struct wt_callback *cb) {
-  json_object_put(cb->json_buffer);
-  cb->json_buffer = json_object_new_array();
-  cb->buffer_metric_size = 0;
+static size_t wt_read_body(char *buffer, size_t size, size_t nitems,
+                           void *userdata) {
+  struct wt_request *req = userdata;
+  size_t len;
+
+  if (wt_compress_read(&req->stream, req->body->data, req->body->len,
+                       &req->body_offset, buffer, size * nitems, &len) != 0)
+    return CURL_READFUNC_ABORT;
+  req->body_sent += len;
+  return len;
 }
 
-static int wt_flush(cdtime_t timeout,
-                    const char *identifier __attribute__((unused)),
-                    user_data_t *user_data) {
-  struct wt_callback *cb;
-  int status;
+// The body is deflated again when curl needs to send it again
+static int wt_seek_body(void *userdata, curl_off_t offset, int origin) {
+  struct wt_request *req = userdata;
 
-  cb = user_data->data;
+  if (origin != SEEK_SET || offset != 0)
+    return CURL_SEEKFUNC_CANTSEEK;
+  wt_compress_rewind(&req->stream);
+  req->body_offset = 0;
+  req->body_sent = 0;
+  return CURL_SEEKFUNC_OK;
+}
 
-  pthread_mutex_lock(&cb->send_lock);
-  status = wt_write_nolock(cb);
-  wt_reset_buffer(cb);
-  pthread_mutex_unlock(&cb->send_lock);
+/* Get an empty batch, reusing a sent one if possible
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static struct wt_batch *wt_batch_get_nolock(struct wt_callback *cb) {
+  struct wt_batch *batch = cb->free_batches;
 
-  return status;
+  if (batch != NULL) {
+    cb->free_batches = batch->next;
+    batch->next = NULL;
+    return batch;
+  }
+
+  batch = calloc(1, sizeof(*batch));
+  if (batch == NULL)
+    ERROR("write_opentsdb plugin: calloc failed.");
+  else
+    batch->lines = (cb->protocol == WT_PROTOCOL_TELNET);
+  return batch;
 }
 
-int wh_log_http_error(struct wt_callback *cb, int status) {
-  int ret = 0;
-  long http_code = 0;
+/* Give a sent or dropped batch back for reuse
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static void wt_batch_put_nolock(struct wt_callback *cb,
+                                struct wt_batch *batch) {
+  wt_strbuf_reset(&batch->body);
+  batch->points = 0;
+  batch->attempts = 0;
+  batch->next = cb->free_batches;
+  cb->free_batches = batch;
+}
 
-  curl_easy_getinfo(cb->curl, CURLINFO_RESPONSE_CODE, &http_code);
+/* Same as wt_batch_put_nolock(), from outside cb->send_lock
+ * NULL is ignored.
+ */
+static void wt_batch_put(struct wt_callback *cb, struct wt_batch *batch) {
+  if (batch == NULL)
+    return;
+  pthread_mutex_lock(&cb->send_lock);
+  wt_batch_put_nolock(cb, batch);
+  pthread_mutex_unlock(&cb->send_lock);
+}
 
-  if ((http_code != 204 && http_code != 0) || status != CURLE_OK){
-    time_t ct = time(NULL);
-    ret = 1;
-    cb->connect_failed_log_count++;
-    if(ct - cb->last_error_log > 30){
-        if(http_code != 204 && http_code != 0)
-          ERROR("write_opentsdb plugin: HTTP Error code: %lu", http_code);
-        if(status != CURLE_OK){
-          ERROR("write_opentsdb plugin: curl_easy_perform failed with "
-                "status %i: %s",
-                status, cb->curl_errbuf);
-        }
-        ERROR("write_opentsdb plugin: %d OpenTSDB http POST errors since last log",
-              cb->connect_failed_log_count);
-        cb->connect_failed_log_count = 0;
-        cb->last_error_log = ct;
-    }
+static void wt_batch_free(struct wt_batch *batch) {
+  while (batch != NULL) {
+    struct wt_batch *next = batch->next;
+    wt_strbuf_free(&batch->body);
+    free(batch->offsets);
+    free(batch->times);
+    free(batch->idents);
+    free(batch->routes);
+    free(batch);
+    batch = next;
   }
-  return ret;
 }
 
-/* OpenTSDB writer
- * Must be called wrapped around locks (use cb->send_lock for that)
- */
-static int wt_write_nolock(struct wt_callback *cb){
-  const char *data = json_object_to_json_string(cb->json_buffer);
+static int wt_batch_append(struct wt_batch *batch, const char *point,
+                           size_t len, cdtime_t time, uint64_t ident,
+                           uint64_t route) {
+  struct wt_strbuf *buf = &batch->body;
 
-  //for primitive debugging
-  //printf("%s\n", data);
+  if (batch->points == batch->offsets_size) {
+    int size = batch->offsets_size ? batch->offsets_size * 2 : 32;
+    size_t *offsets = realloc(batch->offsets, size * sizeof(*offsets));
+    cdtime_t *times = realloc(batch->times, size * sizeof(*times));
+    uint64_t *idents = realloc(batch->idents, size * sizeof(*idents));
+    uint64_t *routes = realloc(batch->routes, size * sizeof(*routes));
 
-  int status = 0;
-  curl_easy_setopt(cb->curl, CURLOPT_POSTFIELDS, data);
-  status = curl_easy_perform(cb->curl);
+    if (offsets != NULL)
+      batch->offsets = offsets;
+    if (times != NULL)
+      batch->times = times;
+    if (idents != NULL)
+      batch->idents = idents;
+    if (routes != NULL)
+      batch->routes = routes;
+    if (offsets == NULL || times == NULL || idents == NULL || routes == NULL)
+      return -ENOMEM;
+    batch->offsets_size = size;
+  }
 
-  status = wh_log_http_error(cb, status);
+  if (wt_strbuf_reserve(buf, len + 1) != 0)
+    return -ENOMEM;
 
+  if (!batch->lines)
+    wt_strbuf_append_char(buf, (batch->points == 0) ? '[' : ',');
+  batch->offsets[batch->points] = buf->len;
+  batch->times[batch->points] = time;
+  batch->idents[batch->points] = ident;
+  batch->routes[batch->points] = route;
+  wt_strbuf_append(buf, point, len);
+  batch->points++;
   return 0;
-  //return status;
 }
 
-static int wt_format_values(char *ret, size_t ret_len, int ds_num,
-                            const data_set_t *ds, const value_list_t *vl,
-                            _Bool store_rates) {
-  size_t offset = 0;
-  int status;
-  gauge_t *rates = NULL;
+/* Length of point i of a batch, without its separator
+ * Points are JSON objects, a batch ending with ']' is closed. Telnet lines
+ * have no separator.
+ */
+static size_t wt_batch_point_len(const struct wt_batch *batch, int i) {
+  size_t end;
 
-  assert(0 == strcmp(ds->type, vl->type));
+  if (i + 1 < batch->points)
+    end = batch->offsets[i + 1] - (batch->lines ? 0 : 1);
+  else
+    end = batch->body.len;
 
-  memset(ret, 0, ret_len);
+  if (!batch->lines && i + 1 == batch->points &&
+      batch->body.data[end - 1] == ']')
+    end--;
+  return end - batch->offsets[i];
+}
 
-#define BUFFER_ADD(...)                                                        \
-  do {                                                                         \
-    status = ssnprintf(ret + offset, ret_len - offset, __VA_ARGS__);           \
-    if (status < 1) {                                                          \
-      sfree(rates);                                                            \
-      return -1;                                                               \
-    } else if (((size_t)status) >= (ret_len - offset)) {                       \
-      sfree(rates);                                                            \
-      return -1;                                                               \
-    } else                                                                     \
-      offset += ((size_t)status);                                              \
-  } while (0)
+/* Copy point i of src at the end of dst */
+static int wt_batch_copy_point(struct wt_batch *dst,
+                               const struct wt_batch *src, int i) {
+  return wt_batch_append(dst, src->body.data + src->offsets[i],
+                         wt_batch_point_len(src, i), src->times[i],
+                         src->idents[i], src->routes[i]);
+}
 
-  if (ds->ds[ds_num].type == DS_TYPE_GAUGE)
-    BUFFER_ADD(GAUGE_FORMAT, vl->values[ds_num].gauge);
-  else if (store_rates) {
-    if (rates == NULL)
-      rates = uc_get_rate(ds, vl);
-    if (rates == NULL) {
-      WARNING("format_values: "
-              "uc_get_rate failed.");
-      return -1;
+/* Wake the sender thread up, whether it waits on send_cond or on its
+ * transfers
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static void wt_sender_wake_nolock(struct wt_callback *cb) {
+  pthread_cond_signal(&cb->send_cond);
+#ifdef WT_HAVE_CURL_MULTI_POLL
+  if (cb->sender_polling)
+    curl_multi_wakeup(cb->multi);
+#endif
+}
+
+/* Drop the oldest queued batch if the send queue is full: the write path
+ * never waits for the TSD.
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static void wt_send_queue_trim_nolock(struct wt_callback *cb) {
+  if (cb->send_queue_len >= cb->send_queue_max &&
+      cb->send_queue_head != NULL) {
+    struct wt_batch *oldest = cb->send_queue_head;
+    time_t ct = time(NULL);
+
+    cb->send_queue_head = oldest->next;
+    if (cb->send_queue_head == NULL)
+      cb->send_queue_tail = NULL;
+    cb->send_queue_len--;
+    cb->dropped_points += oldest->points;
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_DROPPED, oldest->points);
+    wt_batch_put_nolock(cb, oldest);
+
+    if (ct - cb->last_drop_log > 30) {
+      ERROR("write_opentsdb plugin: send queue full, %" PRIu64
+            " points dropped since last log",
+            cb->dropped_points);
+      cb->dropped_points = 0;
+      cb->last_drop_log = ct;
     }
-    BUFFER_ADD(GAUGE_FORMAT, rates[ds_num]);
-  } else if (ds->ds[ds_num].type == DS_TYPE_COUNTER)
-    BUFFER_ADD("%llu", vl->values[ds_num].counter);
-  else if (ds->ds[ds_num].type == DS_TYPE_DERIVE)
-    BUFFER_ADD("%" PRIi64, vl->values[ds_num].derive);
-  else if (ds->ds[ds_num].type == DS_TYPE_ABSOLUTE)
-    BUFFER_ADD("%" PRIu64, vl->values[ds_num].absolute);
-  else {
-    ERROR("format_values plugin: Unknown data source type: %i",
-          ds->ds[ds_num].type);
-    sfree(rates);
-    return -1;
   }
+}
 
-#undef BUFFER_ADD
+/* Queue a full batch to be POSTed, dropping the oldest one if the send queue
+ * is full
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static void wt_enqueue_nolock(struct wt_callback *cb, struct wt_batch *batch) {
+  wt_send_queue_trim_nolock(cb);
 
-  sfree(rates);
-  return 0;
+  batch->next = NULL;
+  if (cb->send_queue_tail == NULL)
+    cb->send_queue_head = batch;
+  else
+    cb->send_queue_tail->next = batch;
+  cb->send_queue_tail = batch;
+  cb->send_queue_len++;
 }
 
-static int wt_add_tag(json_object *tags_array, const char *key, const char *value){
-  json_object *tag_value = json_object_new_string(value);
-  json_object_object_add(tags_array, key, tag_value);
-  return 0;
-}
+/* Hand a batch over to the sender thread, without holding send_lock
+ * Batches are pushed on a lock-free stack, which the sender thread empties
+ * at once, see wt_handoff_take_nolock(). The push finding the stack empty
+ * wakes the sender thread up.
+ */
+static void wt_handoff(struct wt_callback *cb, struct wt_batch *batch) {
+  struct wt_batch *head = __atomic_load_n(&cb->handoff, __ATOMIC_RELAXED);
 
-static int wt_format_tags(json_object *dp, const value_list_t *vl,
-                          const struct wt_callback *cb, const char *ds_name) {
-  int status;
-  char *temp = NULL;
-  char **meta_toc;
-  const char *host = vl->host;
-  int i, n;
-  json_object *tags_array = NULL;
+  do {
+    batch->next = head;
+  } while (!__atomic_compare_exchange_n(&cb->handoff, &head, batch, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-  if(cb->json_host_tag){
-    tags_array = json_tokener_parse(host);
-    if((tags_array == NULL) && cb->auto_fqdn_failback){
-      DEBUG("Failed to parse json host '%s', fallback to simple fqdn tag", host);
-      tags_array = json_object_new_object();
-      wt_add_tag(tags_array, "fqdn", host);
-    } else if((tags_array == NULL)) {
-      ERROR("Failed to parse json host '%s'", host);
-      return 1;
-    }
-  } else {
-    tags_array = json_object_new_object();
-    wt_add_tag(tags_array, "fqdn", host);
+  if (head == NULL) {
+    pthread_mutex_lock(&cb->send_lock);
+    wt_sender_wake_nolock(cb);
+    pthread_mutex_unlock(&cb->send_lock);
   }
-#define TSDB_META_TAG_ADD_PREFIX "tsdb_tag_add_"
+}
 
-#define TSDB_META_DATA_GET_STRING(tag)                                         \
-  do {                                                                         \
-    temp = NULL;                                                               \
-    status = meta_data_get_string(vl->meta, tag, &temp);                       \
-    if (status == -ENOENT) {                                                   \
-      temp = NULL;                                                             \
-      /* defaults to empty string */                                           \
-    } else if (status < 0) {                                                   \
-      sfree(temp);                                                             \
-      return status;                                                           \
-    }                                                                          \
-  } while (0)
+/* Move the batches handed over to the send queue, oldest first
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static void wt_handoff_take_nolock(struct wt_callback *cb) {
+  struct wt_batch *batch =
+      __atomic_exchange_n(&cb->handoff, NULL, __ATOMIC_ACQUIRE);
+  struct wt_batch *fifo = NULL;
 
+  while (batch != NULL) {
+    struct wt_batch *next = batch->next;
+    batch->next = fifo;
+    fifo = batch;
+    batch = next;
+  }
+  while (fifo != NULL) {
+    struct wt_batch *next = fifo->next;
+    wt_enqueue_nolock(cb, fifo);
+    fifo = next;
+  }
+}
 
-  if (vl->meta) {
-    TSDB_META_DATA_GET_STRING(meta_tag_metric_id[TSDB_TAG_PLUGIN]);
-    if (temp) {
-      if(strlen(temp) != 0)
-        wt_add_tag(tags_array, temp, vl->plugin);
-      sfree(temp);
-    }
+/* Close the open batch of a writer and hand it over to the sender thread
+ * Must be called with the lock of the writer held
+ */
+static void wt_writer_hand_over(struct wt_callback *cb,
+                                struct wt_batch **slot) {
+  struct wt_batch *batch = *slot;
 
-    TSDB_META_DATA_GET_STRING(meta_tag_metric_id[TSDB_TAG_PLUGININSTANCE]);
-    if (temp) {
-      if(strlen(temp) != 0)
-        wt_add_tag(tags_array, temp, vl->plugin_instance);
-      sfree(temp);
-    }
+  *slot = NULL;
+  if (batch == NULL)
+    return;
+  if (batch->points > 0 &&
+      (batch->lines || wt_strbuf_append_char(&batch->body, ']') == 0)) {
+    wt_handoff(cb, batch);
+    return;
+  }
 
-    TSDB_META_DATA_GET_STRING(meta_tag_metric_id[TSDB_TAG_TYPE]);
-    if (temp) {
-      if(strlen(temp) != 0)
-        wt_add_tag(tags_array, temp, vl->type);
-      sfree(temp);
-    }
+  if (batch->points > 0) {
+    ERROR("write_opentsdb plugin: failed to close batch, %d points dropped",
+          batch->points);
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_DROPPED, batch->points);
+  }
+  wt_batch_put(cb, batch);
+}
 
-    TSDB_META_DATA_GET_STRING(meta_tag_metric_id[TSDB_TAG_TYPEINSTANCE]);
-    if (temp) {
-      if(strlen(temp) != 0)
-        wt_add_tag(tags_array, temp, vl->type_instance);
-      sfree(temp);
-    }
+/* Writer of the calling thread, created on its first write to the Node */
+static struct wt_writer *wt_writer_get(struct wt_callback *cb) {
+  pthread_t self = pthread_self();
+  struct wt_writer *w = __atomic_load_n(&cb->writers, __ATOMIC_ACQUIRE);
+  struct wt_writer *head;
 
-    if (ds_name) {
-      TSDB_META_DATA_GET_STRING(meta_tag_metric_id[TSDB_TAG_DSNAME]);
-      if (temp) {
-        if(strlen(temp) != 0)
-          wt_add_tag(tags_array, temp, ds_name);
-        sfree(temp);
-      }
-    }
+  for (; w != NULL; w = w->next) {
+    if (pthread_equal(w->thread, self))
+      return w;
+  }
 
-    n = meta_data_toc(vl->meta, &meta_toc);
-    for (i = 0; i < n; i++) {
-      if (strncmp(meta_toc[i], TSDB_META_TAG_ADD_PREFIX,
-                  sizeof(TSDB_META_TAG_ADD_PREFIX) - 1)) {
-        free(meta_toc[i]);
-        continue;
-      }
-      if ('\0' == meta_toc[i][sizeof(TSDB_META_TAG_ADD_PREFIX) - 1]) {
-        ERROR("write_opentsdb plugin: meta_data tag '%s' is unknown (host=%s, "
-              "plugin=%s, type=%s)",
-              temp, vl->host, vl->plugin, vl->type);
-        free(meta_toc[i]);
-        continue;
-      }
+  w = calloc(1, sizeof(*w));
+  if (w == NULL)
+    return NULL;
+  w->batches = calloc(cb->endpoints_num, sizeof(*w->batches));
+  w->up = calloc(cb->endpoints_num, sizeof(*w->up));
+  if (w->batches == NULL || w->up == NULL) {
+    sfree(w->batches);
+    sfree(w->up);
+    sfree(w);
+    return NULL;
+  }
+  w->thread = self;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_mutex_lock(&cb->send_lock);
+  memcpy(w->up, cb->endpoints_up, cb->endpoints_num * sizeof(*w->up));
+  pthread_mutex_unlock(&cb->send_lock);
 
-      TSDB_META_DATA_GET_STRING(meta_toc[i]);
-      if (temp && temp[0]) {
-        int n;
-        char *key = meta_toc[i] + sizeof(TSDB_META_TAG_ADD_PREFIX) - 1;
-        wt_add_tag(tags_array, key, temp);
-      }
-      if (temp)
-        sfree(temp);
-      free(meta_toc[i]);
-    }
-    if (meta_toc)
-      free(meta_toc);
+  head = __atomic_load_n(&cb->writers, __ATOMIC_RELAXED);
+  do {
+    w->next = head;
+  } while (!__atomic_compare_exchange_n(&cb->writers, &head, w, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return w;
+}
 
+static void wt_writers_free(struct wt_callback *cb) {
+  while (cb->writers != NULL) {
+    struct wt_writer *w = cb->writers;
+
+    cb->writers = w->next;
+    for (int i = 0; i < cb->endpoints_num; i++)
+      wt_batch_free(w->batches[i]);
+    sfree(w->batches);
+    sfree(w->up);
+    pthread_mutex_destroy(&w->lock);
+    sfree(w);
   }
+}
 
-#undef TSDB_META_DATA_GET_STRING
-  json_object_object_add(dp, "tags", tags_array);
+/* Whether a batch holding len bytes is full
+ * An empty batch always takes a point, however large.
+ */
+static _Bool wt_batch_full(const struct wt_callback *cb,
+                           const struct wt_batch *batch, size_t len) {
+  if (batch->points == 0)
+    return 0;
+  if (cb->buffer_metric_max > 0 && batch->points >= cb->buffer_metric_max)
+    return 1;
+  // with the closing ']'
+  if (!batch->lines)
+    len++;
+  return cb->buffer_bytes > 0 && len > (size_t)cb->buffer_bytes;
+}
 
-  return 0;
+/* Put the endpoints whose cool-down is over back in the ring and let a single
+ * POST through to them, the first batch routed there. A failed probe takes
+ * the endpoint out of the ring again, see wt_endpoint_result_nolock().
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static void wt_endpoints_check_nolock(struct wt_callback *cb, time_t now) {
+  for (int i = 0; i < cb->endpoints_num; i++) {
+    struct wt_endpoint *ep = &cb->endpoints[i];
+
+    if (ep->state == WT_BREAKER_OPEN && now >= ep->down_until) {
+      INFO("write_opentsdb plugin: retrying endpoint %s", ep->url);
+      ep->state = WT_BREAKER_HALF_OPEN;
+      ep->probing = 0;
+      // routed to again, or no batch would ever probe it
+      cb->endpoints_up[i] = 1;
+    }
+  }
 }
 
-static int wt_format_name(char *ret, int ret_len, const value_list_t *vl,
-                          const struct wt_callback *cb, const char *ds_name) {
+/* Whether a POST to an endpoint may be attempted now
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static _Bool wt_endpoint_allow_nolock(struct wt_callback *cb, int idx) {
+  struct wt_endpoint *ep = &cb->endpoints[idx];
+
+  switch (ep->state) {
+  case WT_BREAKER_CLOSED:
+    return 1;
+  case WT_BREAKER_HALF_OPEN:
+    if (ep->probing)
+      return 0;
+    ep->probing = 1;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Record the result of a POST to an endpoint
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static void wt_endpoint_result_nolock(struct wt_callback *cb, int idx,
+                                      _Bool failed) {
+  struct wt_endpoint *ep = &cb->endpoints[idx];
+
+  if (!failed) {
+    if (ep->state != WT_BREAKER_CLOSED)
+      INFO("write_opentsdb plugin: endpoint %s is back", ep->url);
+    ep->state = WT_BREAKER_CLOSED;
+    ep->failures = 0;
+    ep->probing = 0;
+    cb->endpoints_up[idx] = 1;
+    return;
+  }
+
+  ep->failures++;
+  if (ep->state == WT_BREAKER_HALF_OPEN ||
+      ep->failures >= cb->endpoint_failures_max) {
+    if (ep->state == WT_BREAKER_CLOSED)
+      ERROR("write_opentsdb plugin: endpoint %s failed %d times in a row, "
+            "not trying it for %d seconds",
+            ep->url, ep->failures, cb->endpoint_retry_interval);
+    ep->state = WT_BREAKER_OPEN;
+    ep->probing = 0;
+    ep->down_until = time(NULL) + cb->endpoint_retry_interval;
+    cb->endpoints_up[idx] = 0;
+  }
+}
+
+/* Copy the points of batch the ring routes to idx at the end of moved, and
+ * the others at the end of rest, then close both
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static int wt_batch_split_route_nolock(struct wt_callback *cb,
+                                       const struct wt_batch *batch, int idx,
+                                       struct wt_batch *moved,
+                                       struct wt_batch *rest) {
+  for (int i = 0; i < batch->points; i++) {
+    struct wt_batch *dst = rest;
+
+    if (wt_ring_lookup(&cb->ring, batch->routes[i], cb->endpoints_up) == idx)
+      dst = moved;
+    if (wt_batch_copy_point(dst, batch, i) != 0)
+      return -ENOMEM;
+  }
+  if (!batch->lines && (wt_strbuf_append_char(&moved->body, ']') != 0 ||
+                        wt_strbuf_append_char(&rest->body, ']') != 0))
+    return -ENOMEM;
+  return 0;
+}
+
+/* Point the batch to the endpoint its points are POSTed to: the one they were
+ * routed to, or if it went down in the meantime the one the ring gives their
+ * series now, where new points of the series go too.
+ * The series of a down endpoint are spread over several successors, so the
+ * points routed like the first one are moved to a new batch and the others
+ * are put back at the head of the send queue, to be re-routed in turn.
+ * Batches read back from the spool have no routes and go to the ring
+ * successor of their endpoint.
+ * Returns the batch to POST, the given one or a part of it.
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static struct wt_batch *wt_batch_reroute_nolock(struct wt_callback *cb,
+                                                struct wt_batch *batch) {
+  struct wt_batch *moved;
+  struct wt_batch *rest;
+  int idx;
+  int i;
+
+  if (cb->endpoints_up[batch->endpoint])
+    return batch;
+  if (batch->routes == NULL || batch->points == 0) {
+    batch->endpoint =
+        wt_ring_successor(&cb->ring, batch->endpoint, cb->endpoints_up);
+    return batch;
+  }
+
+  idx = wt_ring_lookup(&cb->ring, batch->routes[0], cb->endpoints_up);
+  for (i = 1; i < batch->points; i++)
+    if (wt_ring_lookup(&cb->ring, batch->routes[i], cb->endpoints_up) != idx)
+      break;
+  if (i == batch->points) {
+    batch->endpoint = idx;
+    return batch;
+  }
+
+  moved = wt_batch_get_nolock(cb);
+  rest = wt_batch_get_nolock(cb);
+  if (moved == NULL || rest == NULL ||
+      wt_batch_split_route_nolock(cb, batch, idx, moved, rest) != 0) {
+    // the series of the first point at least go where their new points go
+    if (moved != NULL)
+      wt_batch_put_nolock(cb, moved);
+    if (rest != NULL)
+      wt_batch_put_nolock(cb, rest);
+    batch->endpoint = idx;
+    return batch;
+  }
+
+  moved->endpoint = idx;
+  rest->endpoint = batch->endpoint;
+  moved->created = rest->created = batch->created;
+  moved->attempts = rest->attempts = batch->attempts;
+
+  // counts against SendQueueSize like the queued batches
+  wt_send_queue_trim_nolock(cb);
+  rest->next = cb->send_queue_head;
+  cb->send_queue_head = rest;
+  if (cb->send_queue_tail == NULL)
+    cb->send_queue_tail = rest;
+  cb->send_queue_len++;
+  wt_batch_put_nolock(cb, batch);
+  return moved;
+}
+
+/* Backoff before the next attempt of a batch: retry_delay doubled on each
+ * failed attempt up to retry_delay_max, with a random jitter between half and
+ * all of it so that batches failed together are not retried together.
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static cdtime_t wt_retry_delay_nolock(struct wt_callback *cb, int attempts) {
+  cdtime_t delay = cb->retry_delay;
+
+  for (int i = 1; i < attempts && delay < cb->retry_delay_max; i++)
+    delay *= 2;
+  if (delay > cb->retry_delay_max)
+    delay = cb->retry_delay_max;
+
+  return delay / 2 +
+         (cdtime_t)((double)(delay / 2) * rand_r(&cb->retry_seed) / RAND_MAX);
+}
+
+/* Queue a batch for another attempt at retry_at
+ * Returns the batch to give up on, if any: the batch itself when it ran out
+ * of attempts, or the oldest retried batch when the retry queue is full.
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static struct wt_batch *wt_retry_nolock(struct wt_callback *cb,
+                                        struct wt_batch *batch,
+                                        cdtime_t retry_at) {
+  struct wt_batch *given_up = NULL;
+
+  if (batch->attempts > cb->max_retries || cb->retry_queue_max < 1 ||
+      cb->sender_shutdown)
+    return batch;
+
+  if (cb->retry_len == cb->retry_queue_max) {
+    given_up = cb->retry_head;
+    cb->retry_head = given_up->next;
+    if (cb->retry_head == NULL)
+      cb->retry_tail = NULL;
+    cb->retry_len--;
+    given_up->next = NULL;
+  }
+
+  batch->retry_at = retry_at;
+  batch->next = NULL;
+  if (cb->retry_tail == NULL)
+    cb->retry_head = batch;
+  else
+    cb->retry_tail->next = batch;
+  cb->retry_tail = batch;
+  cb->retry_len++;
+
+  return given_up;
+}
+
+/* Next batch to POST: a retried batch whose backoff is over, then the oldest
+ * queued batch.
+ * Must be called wrapped around locks (use cb->send_lock for that)
+ */
+static struct wt_batch *wt_next_batch_nolock(struct wt_callback *cb,
+                                             cdtime_t now) {
+  struct wt_batch *prev = NULL;
+  struct wt_batch *batch;
+
+  for (batch = cb->retry_head; batch != NULL; prev = batch, batch = batch->next) {
+    if (batch->retry_at > now)
+      continue;
+
+    if (prev == NULL)
+      cb->retry_head = batch->next;
+    else
+      prev->next = batch->next;
+    if (cb->retry_tail == batch)
+      cb->retry_tail = prev;
+    cb->retry_len--;
+    batch->next = NULL;
+    return batch;
+  }
+
+  batch = cb->send_queue_head;
+  if (batch == NULL)
+    return NULL;
+  cb->send_queue_head = batch->next;
+  if (cb->send_queue_head == NULL)
+    cb->send_queue_tail = NULL;
+  cb->send_queue_len--;
+  batch->next = NULL;
+  return batch;
+}
+
+static void wt_batch_push(struct wt_batch **list, struct wt_batch *batch) {
+  if (batch == NULL)
+    return;
+  batch->next = *list;
+  *list = batch;
+}
+
+/* Hash of the identifier of a value list, as given to flush callbacks */
+static uint64_t wt_identifier_hash(const char *host, const char *plugin,
+                                   const char *plugin_instance,
+                                   const char *type,
+                                   const char *type_instance) {
+  const char *parts[] = {host, plugin, plugin_instance, type, type_instance};
+  uint64_t hash = WT_HASH_INIT;
+
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(parts); i++)
+    hash = wt_hash(parts[i], strlen(parts[i]) + 1, hash);
+  return hash;
+}
+
+/* Parse a "host/plugin[-instance]/type[-instance]" identifier into its hash
+ */
+static int wt_identifier_parse_hash(const char *identifier, uint64_t *hash) {
+  char buf[6 * DATA_MAX_NAME_LEN];
+  char *plugin_instance = "";
+  char *type_instance = "";
+  char *plugin;
+  char *type;
+  char *ptr;
+
+  sstrncpy(buf, identifier, sizeof(buf));
+
+  plugin = strchr(buf, '/');
+  if (plugin == NULL)
+    return -1;
+  *plugin++ = '\0';
+  type = strchr(plugin, '/');
+  if (type == NULL)
+    return -1;
+  *type++ = '\0';
+
+  ptr = strchr(plugin, '-');
+  if (ptr != NULL) {
+    *ptr = '\0';
+    plugin_instance = ptr + 1;
+  }
+  ptr = strchr(type, '-');
+  if (ptr != NULL) {
+    *ptr = '\0';
+    type_instance = ptr + 1;
+  }
+
+  *hash = wt_identifier_hash(buf, plugin, plugin_instance, type, type_instance);
+  return 0;
+}
+
+static _Bool wt_flush_match(const struct wt_flush_request *flush,
+                            const struct wt_batch *batch, int i) {
+  if (flush->before != 0 && batch->times[i] > flush->before)
+    return 0;
+  return !flush->by_ident || batch->idents[i] == flush->ident;
+}
+
+/* Hand the points of an open batch selected by a flush over to the sender
+ * thread. The other points stay in the open batch.
+ * Must be called with the lock of the writer of the batch held
+ */
+static void wt_flush_batch(struct wt_callback *cb, struct wt_batch **slot,
+                           const struct wt_flush_request *flush) {
+  struct wt_batch *batch = *slot;
+  struct wt_batch *flushed;
+  struct wt_batch *kept;
+  int matches = 0;
+
+  if (batch == NULL || batch->points == 0)
+    return;
+
+  for (int i = 0; i < batch->points; i++)
+    matches += wt_flush_match(flush, batch, i);
+  if (matches == 0)
+    return;
+  if (matches == batch->points) {
+    wt_writer_hand_over(cb, slot);
+    return;
+  }
+
+  pthread_mutex_lock(&cb->send_lock);
+  flushed = wt_batch_get_nolock(cb);
+  kept = wt_batch_get_nolock(cb);
+  pthread_mutex_unlock(&cb->send_lock);
+  if (flushed == NULL || kept == NULL) {
+    wt_batch_put(cb, flushed);
+    wt_batch_put(cb, kept);
+    return;
+  }
+  flushed->endpoint = kept->endpoint = batch->endpoint;
+  flushed->created = kept->created = batch->created;
+
+  for (int i = 0; i < batch->points; i++) {
+    struct wt_batch *dst = wt_flush_match(flush, batch, i) ? flushed : kept;
+
+    if (wt_batch_copy_point(dst, batch, i) != 0) {
+      // keep the batch as it is, flush is best effort
+      wt_batch_put(cb, flushed);
+      wt_batch_put(cb, kept);
+      return;
+    }
+  }
+
+  *slot = flushed;
+  wt_writer_hand_over(cb, slot);
+  *slot = kept;
+  wt_batch_put(cb, batch);
+}
+
+/* Take the open batches of the write threads: all of them if all is set,
+ * else those older than max_buffer_age and the points selected by flushes.
+ * Returns the time the oldest remaining batch is due, 0 if there is none.
+ * Called without holding cb->send_lock
+ */
+static cdtime_t wt_writers_collect(struct wt_callback *cb,
+                                   const struct wt_flush_request *flushes,
+                                   cdtime_t now, _Bool all) {
+  struct wt_writer *w = __atomic_load_n(&cb->writers, __ATOMIC_ACQUIRE);
+  cdtime_t next = 0;
+
+  for (; w != NULL; w = w->next) {
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < cb->endpoints_num; i++) {
+      struct wt_batch **slot = &w->batches[i];
+      cdtime_t due;
+
+      if (*slot == NULL || (*slot)->points == 0)
+        continue;
+      due = (*slot)->created + cb->max_buffer_age;
+      if (all || (cb->max_buffer_age > 0 && due <= now)) {
+        wt_writer_hand_over(cb, slot);
+        continue;
+      }
+
+      for (const struct wt_flush_request *flush = flushes;
+           flush != NULL && *slot != NULL; flush = flush->next)
+        wt_flush_batch(cb, slot, flush);
+
+      if (cb->max_buffer_age > 0 && *slot != NULL && (*slot)->points > 0 &&
+          (next == 0 || (*slot)->created + cb->max_buffer_age < next))
+        next = (*slot)->created + cb->max_buffer_age;
+    }
+    pthread_mutex_unlock(&w->lock);
+  }
+  return next;
+}
+
+/* Flush callback
+ * Only records the flush, the sender thread sends the selected points so
+ * that the caller does not wait for the TSD.
+ */
+static int wt_flush(cdtime_t timeout, const char *identifier,
+                    user_data_t *user_data) {
+  struct wt_callback *cb;
+  struct wt_flush_request *flush;
+
+  cb = user_data->data;
+
+  flush = calloc(1, sizeof(*flush));
+  if (flush == NULL) {
+    ERROR("write_opentsdb plugin: calloc failed.");
+    return -1;
+  }
+  if (timeout > 0)
+    flush->before = cdtime() - timeout;
+  if (identifier != NULL) {
+    if (wt_identifier_parse_hash(identifier, &flush->ident) != 0) {
+      ERROR("write_opentsdb plugin: invalid flush identifier: %s",
+            identifier);
+      sfree(flush);
+      return -1;
+    }
+    flush->by_ident = 1;
+  }
+
+  pthread_mutex_lock(&cb->send_lock);
+  if (cb->flush_tail == NULL)
+    cb->flush_head = flush;
+  else
+    cb->flush_tail->next = flush;
+  cb->flush_tail = flush;
+  wt_sender_wake_nolock(cb);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  return 0;
+}
+
+int wh_log_http_error(struct wt_endpoint *ep, struct wt_request *req,
+                      int status) {
+  int ret = 0;
+  long http_code = 0;
+
+  curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+  if ((http_code != 200 && http_code != 204 && http_code != 0) ||
+      status != CURLE_OK){
+    time_t ct = time(NULL);
+    ret = 1;
+    ep->connect_failed_log_count++;
+    if(ct - ep->last_error_log > 30){
+        if(http_code != 200 && http_code != 204 && http_code != 0)
+          ERROR("write_opentsdb plugin: %s: HTTP Error code: %lu", ep->url,
+                http_code);
+        if(status != CURLE_OK){
+          ERROR("write_opentsdb plugin: %s: curl request failed with "
+                "status %i: %s",
+                ep->url, status, req->curl_errbuf);
+        }
+        ERROR("write_opentsdb plugin: %s: %d OpenTSDB http POST errors since "
+              "last log",
+              ep->url, ep->connect_failed_log_count);
+        ep->connect_failed_log_count = 0;
+        ep->last_error_log = ct;
+    }
+  }
+  return ret;
+}
+
+/* OpenTSDB writer: attach the POST of a batch to the multi handle
+ * Only called from the sender thread, which owns the curl handles
+ */
+static int wt_request_start(struct wt_callback *cb, struct wt_request *req) {
+  //for primitive debugging
+  //printf("%s\n", req->batch->body.data);
+
+  struct wt_endpoint *ep = &cb->endpoints[req->batch->endpoint];
+  const struct wt_strbuf *body = &req->batch->body;
+  CURLMcode mstatus;
+
+  if (cb->stream_body) {
+    // the bytes sent are counted once curl has read them all
+    wt_seek_body(req, 0, SEEK_SET);
+    req->body = body;
+  } else if (cb->compression != WT_COMPRESS_NONE) {
+    if (wt_compress(&cb->compress, req->batch->body.data,
+                    req->batch->body.len, &req->compressed) != 0) {
+      ERROR("write_opentsdb plugin: failed to compress batch, %d points "
+            "dropped",
+            req->batch->points);
+      return -1;
+    }
+    body = &req->compressed;
+  }
+
+  req->curl_errbuf[0] = '\0';
+  req->http_code = 0;
+  wt_strbuf_reset(&req->response);
+  curl_easy_setopt(req->curl, CURLOPT_URL, ep->url);
+  if (!cb->stream_body) {
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, (long)body->len);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, body->data);
+    wt_stats_add(&cb->stats, WT_STAT_BYTES_SENT, body->len);
+  }
+  req->started_at = cdtime();
+  wt_stats_add(&cb->stats, WT_STAT_BYTES_UNCOMPRESSED, req->batch->body.len);
+
+  mstatus = curl_multi_add_handle(cb->multi, req->curl);
+  if (mstatus != CURLM_OK) {
+    ERROR("write_opentsdb plugin: curl_multi_add_handle failed: %s",
+          curl_multi_strerror(mstatus));
+    return -1;
+  }
+  return 0;
+}
+
+/* Mark the requests whose transfer is over as done
+ * Returns the number of requests completed.
+ */
+static int wt_requests_collect(struct wt_callback *cb) {
+  CURLMsg *msg;
+  int msgs_left;
+  int done = 0;
+
+  while ((msg = curl_multi_info_read(cb->multi, &msgs_left)) != NULL) {
+    struct wt_request *req = NULL;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+    curl_multi_remove_handle(cb->multi, msg->easy_handle);
+    if (req == NULL)
+      continue;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &req->http_code);
+    if (cb->stream_body)
+      wt_stats_add(&cb->stats, WT_STAT_BYTES_SENT, req->body_sent);
+    wt_stats_latency(&cb->stats, CDTIME_T_TO_US(cdtime() - req->started_at));
+    // the TSD is fine, the points are sorted out by wt_requests_split()
+    if (msg->data.result == CURLE_OK &&
+        (req->http_code == 400 || req->http_code == 413))
+      req->status = 0;
+    else
+      req->status = wh_log_http_error(&cb->endpoints[req->batch->endpoint],
+                                      req, msg->data.result);
+    req->done = 1;
+    done++;
+  }
+  return done;
+}
+
+/* Start the new requests and let curl move the transfers forward, waiting
+ * at most one second for one of them to complete.
+ * Only called from the sender thread, without holding cb->send_lock
+ */
+static void wt_requests_run(struct wt_callback *cb) {
+  int running = 0;
+  int done = 0;
+
+  for (int i = 0; i < cb->max_in_flight; i++) {
+    struct wt_request *req = &cb->requests[i];
+
+    if (req->batch == NULL || req->started)
+      continue;
+    req->started = 1;
+    if (wt_request_start(cb, req) != 0) {
+      req->status = -1;
+      req->done = 1;
+      done++;
+    }
+  }
+
+  curl_multi_perform(cb->multi, &running);
+  done += wt_requests_collect(cb);
+  if (done > 0)
+    return;
+
+#ifdef WT_HAVE_CURL_MULTI_POLL
+  // woken up early by curl_multi_wakeup() when a batch is queued
+  curl_multi_poll(cb->multi, NULL, 0, 1000, NULL);
+#else
+  curl_multi_wait(cb->multi, NULL, 0, 100, NULL);
+#endif
+
+  curl_multi_perform(cb->multi, &running);
+  wt_requests_collect(cb);
+}
+
+/* Log the failed writes and the error lines of a telnet connection, at most
+ * every 30 seconds
+ * Only called from the sender thread
+ */
+static void wt_telnet_log_error(struct wt_endpoint *ep, int status) {
+  time_t ct = time(NULL);
+
+  if (status != 0)
+    ep->connect_failed_log_count++;
+  if (ct - ep->last_error_log <= 30 ||
+      (ep->connect_failed_log_count == 0 && ep->rejected_log_count == 0))
+    return;
+
+  if (status != 0)
+    ERROR("write_opentsdb plugin: %s: telnet write failed: %s", ep->url,
+          strerror(-status));
+  if (ep->connect_failed_log_count > 0)
+    ERROR("write_opentsdb plugin: %s: %d OpenTSDB telnet write errors since "
+          "last log",
+          ep->url, ep->connect_failed_log_count);
+  if (ep->rejected_log_count > 0)
+    ERROR("write_opentsdb plugin: %s: %d points rejected by the TSD since "
+          "last log, last error: %s",
+          ep->url, ep->rejected_log_count, ep->rejected);
+  ep->connect_failed_log_count = 0;
+  ep->rejected_log_count = 0;
+  ep->last_error_log = ct;
+}
+
+/* Telnet protocol: write the new requests to the connections of their
+ * endpoints, all the batches of an endpoint with a single writev().
+ * The TSD does not acknowledge the lines: a batch is sent once written, and
+ * the error lines the TSD answers with are only counted.
+ * Only called from the sender thread, without holding cb->send_lock
+ */
+static void wt_telnet_requests_run(struct wt_callback *cb) {
+  for (int e = 0; e < cb->endpoints_num; e++) {
+    struct wt_endpoint *ep = &cb->endpoints[e];
+    struct iovec iov[cb->max_in_flight];
+    char line[sizeof(ep->rejected)];
+    cdtime_t start;
+    int iovcnt = 0;
+    int status;
+
+    for (int i = 0; i < cb->max_in_flight; i++) {
+      struct wt_request *req = &cb->requests[i];
+
+      if (req->batch == NULL || req->started || req->batch->endpoint != e)
+        continue;
+      iov[iovcnt].iov_base = req->batch->body.data;
+      iov[iovcnt].iov_len = req->batch->body.len;
+      iovcnt++;
+    }
+    if (iovcnt == 0)
+      continue;
+
+    // also notices a connection the TSD closed, before writing to it
+    status = wt_telnet_drain(&ep->telnet, line, sizeof(line));
+    if (status > 0) {
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_INVALID, status);
+      ep->rejected_log_count += status;
+      sstrncpy(ep->rejected, line, sizeof(ep->rejected));
+    }
+
+    start = cdtime();
+    status = wt_telnet_writev(&ep->telnet, iov, iovcnt, cb->timeout);
+    wt_stats_latency(&cb->stats, CDTIME_T_TO_US(cdtime() - start));
+    for (int i = 0; i < cb->max_in_flight; i++) {
+      struct wt_request *req = &cb->requests[i];
+
+      if (req->batch == NULL || req->started || req->batch->endpoint != e)
+        continue;
+      wt_stats_add(&cb->stats, WT_STAT_BYTES_UNCOMPRESSED,
+                   req->batch->body.len);
+      wt_stats_add(&cb->stats, WT_STAT_BYTES_SENT, req->batch->body.len);
+      req->started = 1;
+      req->done = 1;
+      req->status = (status != 0);
+    }
+    wt_telnet_log_error(ep, status);
+  }
+}
+
+/* Count a point rejected as invalid
+ * Only called from the sender thread
+ */
+static void wt_invalid_add(void *ctx, const char *metric, const char *error) {
+  struct wt_callback *cb = ctx;
+  struct wt_invalid_metric *im = NULL;
+
+  if (metric == NULL)
+    metric = "";
+
+  for (int i = 0; i < cb->invalid_metrics_num; i++) {
+    if (strcmp(cb->invalid_metrics[i].metric, metric) == 0) {
+      im = &cb->invalid_metrics[i];
+      break;
+    }
+  }
+  if (im == NULL) {
+    if (cb->invalid_metrics_num == WT_INVALID_METRICS_MAX) {
+      cb->invalid_other_points++;
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_INVALID, 1);
+      return;
+    }
+    im = &cb->invalid_metrics[cb->invalid_metrics_num++];
+    sstrncpy(im->metric, metric, sizeof(im->metric));
+    im->points = 0;
+  }
+  sstrncpy(im->error, error, sizeof(im->error));
+  im->points++;
+  wt_stats_add(&cb->stats, WT_STAT_POINTS_INVALID, 1);
+}
+
+static void wt_invalid_log(struct wt_callback *cb) {
+  time_t ct = time(NULL);
+
+  if (cb->invalid_metrics_num == 0 || ct - cb->last_invalid_log <= 30)
+    return;
+
+  for (int i = 0; i < cb->invalid_metrics_num; i++) {
+    struct wt_invalid_metric *im = &cb->invalid_metrics[i];
+
+    ERROR("write_opentsdb plugin: %" PRIu64 " invalid points of metric %s "
+          "dropped since last log: %s",
+          im->points, im->metric, im->error);
+  }
+  if (cb->invalid_other_points > 0)
+    ERROR("write_opentsdb plugin: %" PRIu64 " invalid points of other metrics "
+          "dropped since last log",
+          cb->invalid_other_points);
+
+  cb->invalid_metrics_num = 0;
+  cb->invalid_other_points = 0;
+  cb->last_invalid_log = ct;
+}
+
+/* New batch with the points of batch selected by keep, or the points from
+ * first to last if keep is NULL
+ */
+static struct wt_batch *wt_batch_extract(const struct wt_batch *batch,
+                                         const int *keep, int first,
+                                         int last) {
+  struct wt_batch *part = calloc(1, sizeof(*part));
+
+  if (part == NULL)
+    return NULL;
+  part->endpoint = batch->endpoint;
+  part->attempts = batch->attempts;
+  part->lines = batch->lines;
+
+  for (int i = first; i <= last; i++) {
+    if (keep != NULL && keep[i] != WT_POINT_RETRY)
+      continue;
+    if (wt_batch_copy_point(part, batch, i) != 0) {
+      wt_batch_free(part);
+      return NULL;
+    }
+  }
+  if (part->points == 0 ||
+      (!part->lines && wt_strbuf_append_char(&part->body, ']') != 0)) {
+    wt_batch_free(part);
+    return NULL;
+  }
+  return part;
+}
+
+/* Sort out the points of a batch the TSD answered 400 or 413 to
+ * With the details of a 400, the points rejected as invalid are dropped and
+ * the points that may succeed later are put in a new batch, retried after a
+ * backoff. Without details, the batch is bisected until the points the TSD
+ * rejects are isolated and dropped.
+ * Only called from the sender thread, without holding cb->send_lock
+ */
+static void wt_request_split(struct wt_callback *cb, struct wt_request *req) {
+  struct wt_batch *batch = req->batch;
+  int matched = -1;
+  int *status;
+
+  status = calloc(batch->points, sizeof(*status));
+  if (status == NULL) {
+    ERROR("write_opentsdb plugin: calloc failed.");
+    return;
+  }
+
+  if (req->http_code == 400)
+    matched = wt_details_parse(req->response.data, batch->body.data,
+                               batch->body.len, batch->offsets, batch->points,
+                               status, wt_invalid_add, cb);
+
+  if (matched > 0) {
+    struct wt_batch *retry;
+
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_SENT, batch->points - matched);
+    retry = wt_batch_extract(batch, status, 0, batch->points - 1);
+    if (retry != NULL) {
+      retry->attempts++;
+      retry->next = req->split;
+      req->split = retry;
+    }
+  } else if (batch->points == 1) {
+    char metric[256] = "";
+
+    wt_details_point_metric(batch->body.data, batch->body.len,
+                            batch->offsets, batch->points, 0, metric,
+                            sizeof(metric));
+    wt_invalid_add(cb, metric,
+                   (req->http_code == 413) ? "point too large"
+                                           : "rejected by the TSD");
+  } else {
+    int half = batch->points / 2;
+    struct wt_batch *first = wt_batch_extract(batch, NULL, 0, half - 1);
+    struct wt_batch *second =
+        wt_batch_extract(batch, NULL, half, batch->points - 1);
+
+    if (first == NULL || second == NULL) {
+      ERROR("write_opentsdb plugin: failed to split batch, %d points dropped",
+            batch->points);
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_DROPPED, batch->points);
+      wt_batch_free(first);
+      wt_batch_free(second);
+    } else {
+      first->next = second;
+      second->next = req->split;
+      req->split = first;
+    }
+  }
+
+  sfree(status);
+}
+
+static void wt_requests_split(struct wt_callback *cb) {
+  for (int i = 0; i < cb->max_in_flight; i++) {
+    struct wt_request *req = &cb->requests[i];
+
+    if (req->batch != NULL && req->done && req->status == 0 &&
+        (req->http_code == 400 || req->http_code == 413))
+      wt_request_split(cb, req);
+  }
+  wt_invalid_log(cb);
+}
+
+/* Write the batches given up on to the spool, or drop them
+ * Only called from the sender thread, without holding cb->send_lock
+ */
+static void wt_batches_give_up(struct wt_callback *cb,
+                               struct wt_batch *batches) {
+  time_t ct;
+
+  for (struct wt_batch *batch = batches; batch != NULL; batch = batch->next) {
+    if (cb->spool != NULL) {
+      int status = wt_spool_append(cb->spool, batch->body.data,
+                                   batch->body.len, batch->points,
+                                   batch->endpoint);
+      if (status == 0) {
+        wt_stats_add(&cb->stats, WT_STAT_POINTS_SPOOLED, batch->points);
+        continue;
+      }
+      ERROR("write_opentsdb plugin: failed to spool batch: %s",
+            strerror(-status));
+    }
+    cb->given_up_points += batch->points;
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_DROPPED, batch->points);
+  }
+
+  ct = time(NULL);
+  if (cb->given_up_points > 0 && ct - cb->last_give_up_log > 30) {
+    ERROR("write_opentsdb plugin: %" PRIu64 " points dropped after failed "
+          "POSTs since last log",
+          cb->given_up_points);
+    cb->given_up_points = 0;
+    cb->last_give_up_log = ct;
+  }
+}
+
+/* Telnet protocol: write a batch read back from the spool
+ * Returns 0 on success and -1 if it must be tried again later.
+ * Only called from the replayer thread, without holding cb->send_lock
+ */
+static int wt_replay_telnet(struct wt_callback *cb,
+                            const struct wt_batch *batch) {
+  struct wt_endpoint *ep = &cb->endpoints[batch->endpoint];
+  struct wt_telnet *conn = &cb->replay_telnet[batch->endpoint];
+  struct iovec iov = {.iov_base = batch->body.data,
+                      .iov_len = batch->body.len};
+  char line[128];
+  int status;
+
+  // the error lines are only counted for live points
+  wt_telnet_drain(conn, line, sizeof(line));
+  status = wt_telnet_writev(conn, &iov, 1, cb->timeout);
+  if (status != 0) {
+    ERROR("write_opentsdb plugin: %s: spool replay failed: %s", ep->url,
+          strerror(-status));
+    return -1;
+  }
+  return 0;
+}
+
+/* Count a spooled point rejected as invalid, see wt_replay_details()
+ * The table of invalid metrics belongs to the sender thread, so the replayed
+ * points are only counted.
+ */
+static void wt_replay_invalid(void *ctx, const char *metric,
+                              const char *error) {
+  int *invalid = ctx;
+
+  (void)metric;
+  (void)error;
+  (*invalid)++;
+}
+
+/* Sort out the points of a spooled batch the TSD answered 400 to, as
+ * wt_request_split() does for live batches: the points rejected as invalid
+ * are dropped and those that may succeed later are spooled again.
+ * Returns 0 if the batch was sorted out, 1 if the response has no details.
+ * Only called from the replayer thread, without holding cb->send_lock
+ */
+static int wt_replay_details(struct wt_callback *cb,
+                             const struct wt_batch *batch) {
+  const char *body = batch->body.data;
+  size_t body_len = batch->body.len;
+  struct wt_strbuf retry = WT_STRBUF_INIT;
+  size_t *offsets;
+  int *status;
+  int retry_points = 0;
+  int invalid = 0;
+  int matched = -1;
+
+  offsets = calloc(batch->points, sizeof(*offsets));
+  status = calloc(batch->points, sizeof(*status));
+  if (offsets != NULL && status != NULL &&
+      wt_details_offsets(body, body_len, offsets, batch->points) ==
+          batch->points)
+    matched = wt_details_parse(cb->replay.response.data, body, body_len,
+                               offsets, batch->points, status,
+                               wt_replay_invalid, &invalid);
+  if (matched <= 0) {
+    sfree(offsets);
+    sfree(status);
+    return 1;
+  }
+
+  for (int i = 0; i < batch->points; i++) {
+    // points are separated by ',' and the last one is followed by ']'
+    size_t end = (i + 1 < batch->points) ? offsets[i + 1] - 1 : body_len - 1;
+
+    if (status[i] != WT_POINT_RETRY)
+      continue;
+    if (wt_strbuf_append_char(&retry, (retry_points == 0) ? '[' : ',') != 0 ||
+        wt_strbuf_append(&retry, body + offsets[i], end - offsets[i]) != 0)
+      break;
+    retry_points++;
+  }
+
+  wt_stats_add(&cb->stats, WT_STAT_POINTS_REPLAYED, batch->points - matched);
+  wt_stats_add(&cb->stats, WT_STAT_POINTS_INVALID, invalid);
+  if (invalid > 0)
+    ERROR("write_opentsdb plugin: %d spooled points rejected as invalid, "
+          "dropped",
+          invalid);
+  if (matched > invalid) {
+    int spooled = -ENOMEM;
+
+    if (retry_points == matched - invalid &&
+        wt_strbuf_append_char(&retry, ']') == 0)
+      spooled = wt_spool_append(cb->spool, retry.data, retry.len,
+                                retry_points, batch->endpoint);
+    if (spooled == 0) {
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_SPOOLED, retry_points);
+    } else {
+      ERROR("write_opentsdb plugin: failed to spool %d failed points again: "
+            "%s",
+            matched - invalid, strerror(-spooled));
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_DROPPED, matched - invalid);
+    }
+  }
+
+  wt_strbuf_free(&retry);
+  sfree(offsets);
+  sfree(status);
+  return 0;
+}
+
+/* POST a batch read back from the spool
+ * Returns 0 on success, 1 if the TSD rejected the batch, 2 if it rejected
+ * some points, sorted out by wt_replay_details(), and -1 if it must be tried
+ * again later.
+ * Only called from the replayer thread, without holding cb->send_lock
+ */
+static int wt_replay_batch(struct wt_callback *cb,
+                           const struct wt_batch *batch) {
+  struct wt_endpoint *ep = &cb->endpoints[batch->endpoint];
+  struct wt_request *req = &cb->replay;
+  const struct wt_strbuf *body = &batch->body;
+  long http_code = 0;
+  int status;
+
+  if (cb->protocol == WT_PROTOCOL_TELNET)
+    return wt_replay_telnet(cb, batch);
+
+  if (cb->stream_body) {
+    wt_seek_body(req, 0, SEEK_SET);
+    req->body = body;
+  } else if (cb->compression != WT_COMPRESS_NONE) {
+    if (wt_compress(&cb->replay_compress, batch->body.data, batch->body.len,
+                    &req->compressed) != 0) {
+      ERROR("write_opentsdb plugin: failed to compress spooled batch.");
+      return -1;
+    }
+    body = &req->compressed;
+  }
+
+  req->curl_errbuf[0] = '\0';
+  wt_strbuf_reset(&req->response);
+  curl_easy_setopt(req->curl, CURLOPT_URL, ep->url);
+  if (!cb->stream_body) {
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, (long)body->len);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, body->data);
+  }
+  status = curl_easy_perform(req->curl);
+  curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+  if (status != CURLE_OK) {
+    ERROR("write_opentsdb plugin: %s: spool replay failed with status %i: %s",
+          ep->url, status, req->curl_errbuf);
+    return -1;
+  }
+  if (http_code == 200 || http_code == 204 || http_code == 0)
+    return 0;
+  if (http_code == 400 && wt_replay_details(cb, batch) == 0)
+    return 2;
+
+  ERROR("write_opentsdb plugin: %s: spool replay got HTTP Error code: %lu",
+        ep->url, http_code);
+  // the TSD will not accept this batch any better later
+  if (http_code >= 400 && http_code < 500 && http_code != 408 &&
+      http_code != 429)
+    return 1;
+  return -1;
+}
+
+/* Replayer thread: POSTs spooled batches back once their endpoint accepts
+ * POSTs again, at most spool_replay_rate points per second. Records stay in
+ * the spool until they are sent.
+ */
+static void *wt_replayer_thread(void *arg) {
+  struct wt_callback *cb = arg;
+  struct wt_batch batch = {.body = WT_STRBUF_INIT};
+  cdtime_t next_replay = 0;
+
+  batch.lines = (cb->protocol == WT_PROTOCOL_TELNET);
+
+  pthread_mutex_lock(&cb->send_lock);
+  while (!cb->sender_shutdown) {
+    cdtime_t now = cdtime();
+    int status;
+
+    if (now < next_replay || wt_spool_empty(cb->spool)) {
+      cdtime_t wait_until = now + TIME_T_TO_CDTIME_T(1);
+      struct timespec until;
+
+      if (next_replay > now && next_replay < wait_until)
+        wait_until = next_replay;
+      until = CDTIME_T_TO_TIMESPEC(wait_until);
+      pthread_cond_timedwait(&cb->replay_cond, &cb->send_lock, &until);
+      continue;
+    }
+
+    pthread_mutex_unlock(&cb->send_lock);
+    status = wt_spool_peek(cb->spool, &batch.body, &batch.points,
+                           &batch.endpoint);
+    pthread_mutex_lock(&cb->send_lock);
+
+    if (status != 0) {
+      if (status < 0) {
+        ERROR("write_opentsdb plugin: failed to read spool %s: %s",
+              cb->spool_dir, strerror(-status));
+        next_replay = now + TIME_T_TO_CDTIME_T(cb->endpoint_retry_interval);
+      }
+      continue;
+    }
+
+    if (batch.endpoint < 0 || batch.endpoint >= cb->endpoints_num)
+      batch.endpoint = 0;
+    wt_batch_reroute_nolock(cb, &batch);
+    // wait for the endpoint to accept live POSTs first
+    if (cb->endpoints[batch.endpoint].state != WT_BREAKER_CLOSED) {
+      next_replay = now + TIME_T_TO_CDTIME_T(1);
+      continue;
+    }
+
+    pthread_mutex_unlock(&cb->send_lock);
+    status = wt_replay_batch(cb, &batch);
+    if (status >= 0)
+      wt_spool_consume(cb->spool);
+    if (status == 0)
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_REPLAYED, batch.points);
+    else if (status == 1)
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_DROPPED, batch.points);
+    if (status == 1)
+      ERROR("write_opentsdb plugin: %d spooled points rejected, dropped",
+            batch.points);
+    pthread_mutex_lock(&cb->send_lock);
+
+    if (status < 0) {
+      next_replay = now + TIME_T_TO_CDTIME_T(cb->endpoint_retry_interval);
+      continue;
+    }
+    next_replay =
+        now + DOUBLE_TO_CDTIME_T((double)batch.points / cb->spool_replay_rate);
+  }
+  pthread_mutex_unlock(&cb->send_lock);
+
+  wt_strbuf_free(&batch.body);
+  return NULL;
+}
+
+/* Sender thread: POSTs queued batches until shutdown, then drains the queue
+ * Up to max_in_flight batches are sent concurrently. Failed batches are
+ * retried with a backoff, then spooled or dropped.
+ */
+static void *wt_sender_thread(void *arg) {
+  struct wt_callback *cb = arg;
+  struct wt_batch *given_up = NULL;
+  cdtime_t next_sweep = 0;
+  int in_flight = 0;
+
+  pthread_mutex_lock(&cb->send_lock);
+  while (1) {
+    cdtime_t now = cdtime();
+    struct wt_batch *batch;
+    int slot = 0;
+
+    // aggregation windows of the series that stopped reporting
+    if (cb->aggregates_num > 0 && now >= next_sweep &&
+        !cb->sender_shutdown) {
+      pthread_mutex_unlock(&cb->send_lock);
+      wt_aggregate_sweep(cb, now, 0);
+      pthread_mutex_lock(&cb->send_lock);
+      next_sweep = now + TIME_T_TO_CDTIME_T(1);
+    }
+
+    // open batches of the write threads, flushed or too old
+    if (cb->flush_head != NULL ||
+        (cb->max_buffer_age > 0 && now >= cb->collect_at)) {
+      struct wt_flush_request *flushes = cb->flush_head;
+      cdtime_t next;
+
+      cb->flush_head = NULL;
+      cb->flush_tail = NULL;
+      pthread_mutex_unlock(&cb->send_lock);
+      next = wt_writers_collect(cb, flushes, now, 0);
+      while (flushes != NULL) {
+        struct wt_flush_request *flush = flushes;
+        flushes = flush->next;
+        sfree(flush);
+      }
+      pthread_mutex_lock(&cb->send_lock);
+      // batches opened from now on are not due before now + max_buffer_age
+      cb->collect_at = (next != 0) ? next : now + cb->max_buffer_age;
+    }
+
+    wt_endpoints_check_nolock(cb, CDTIME_T_TO_TIME_T(now));
+    wt_handoff_take_nolock(cb);
+
+    // retried batches are not waited for on shutdown
+    if (cb->sender_shutdown && cb->retry_head != NULL) {
+      while ((batch = cb->retry_head) != NULL) {
+        cb->retry_head = batch->next;
+        wt_batch_push(&given_up, batch);
+      }
+      cb->retry_tail = NULL;
+      cb->retry_len = 0;
+    }
+
+    while (in_flight < cb->max_in_flight &&
+           (batch = wt_next_batch_nolock(cb, now)) != NULL) {
+      struct wt_request *req;
+
+      batch = wt_batch_reroute_nolock(cb, batch);
+      if (!wt_endpoint_allow_nolock(cb, batch->endpoint)) {
+        struct wt_endpoint *ep = &cb->endpoints[batch->endpoint];
+        cdtime_t retry_at = now + TIME_T_TO_CDTIME_T(1);
+
+        // held back by the circuit breaker, this is not a failed attempt
+        if (ep->state == WT_BREAKER_OPEN)
+          retry_at = TIME_T_TO_CDTIME_T(ep->down_until);
+        wt_batch_push(&given_up, wt_retry_nolock(cb, batch, retry_at));
+        continue;
+      }
+
+      while (cb->requests[slot].batch != NULL)
+        slot++;
+      req = &cb->requests[slot];
+      req->batch = batch;
+      req->started = 0;
+      req->done = 0;
+      in_flight++;
+    }
+
+    if (in_flight == 0 && given_up == NULL) {
+      cdtime_t wait_until = now + TIME_T_TO_CDTIME_T(1);
+      struct timespec until;
+
+      if (cb->sender_shutdown)
+        break;
+      for (batch = cb->retry_head; batch != NULL; batch = batch->next)
+        if (batch->retry_at < wait_until)
+          wait_until = batch->retry_at;
+      if (cb->max_buffer_age > 0 && cb->collect_at < wait_until)
+        wait_until = cb->collect_at;
+      if (cb->aggregates_num > 0 && next_sweep < wait_until)
+        wait_until = next_sweep;
+      until = CDTIME_T_TO_TIMESPEC(wait_until);
+      pthread_cond_timedwait(&cb->send_cond, &cb->send_lock, &until);
+      continue;
+    }
+
+    // The POSTs are done without holding the lock
+    cb->sender_polling = (in_flight > 0 && cb->multi != NULL);
+    pthread_mutex_unlock(&cb->send_lock);
+    if (given_up != NULL)
+      wt_batches_give_up(cb, given_up);
+    if (in_flight > 0 && cb->protocol == WT_PROTOCOL_TELNET) {
+      wt_telnet_requests_run(cb);
+    } else if (in_flight > 0) {
+      wt_requests_run(cb);
+      wt_requests_split(cb);
+    }
+    pthread_mutex_lock(&cb->send_lock);
+    cb->sender_polling = 0;
+
+    while (given_up != NULL) {
+      batch = given_up;
+      given_up = batch->next;
+      wt_batch_put_nolock(cb, batch);
+    }
+
+    now = cdtime();
+    for (int i = 0; i < cb->max_in_flight; i++) {
+      struct wt_request *req = &cb->requests[i];
+
+      batch = req->batch;
+      if (batch == NULL || !req->done)
+        continue;
+      req->batch = NULL;
+      in_flight--;
+
+      wt_endpoint_result_nolock(cb, batch->endpoint, req->status != 0);
+      wt_stats_add(&cb->stats,
+                   (req->status == 0) ? WT_STAT_BATCHES_SENT
+                                      : WT_STAT_BATCHES_FAILED,
+                   1);
+      if (req->status == 0) {
+        // the points of a 400 or 413 are counted by wt_request_split()
+        if (req->http_code != 400 && req->http_code != 413)
+          wt_stats_add(&cb->stats, WT_STAT_POINTS_SENT, batch->points);
+        while (req->split != NULL) {
+          struct wt_batch *part = req->split;
+          int points = part->points;
+          // halves of a bisected batch are sent right away
+          _Bool retried = (part->attempts > batch->attempts);
+          cdtime_t retry_at =
+              retried ? now + wt_retry_delay_nolock(cb, part->attempts) : now;
+          struct wt_batch *dropped;
+
+          req->split = part->next;
+          dropped = wt_retry_nolock(cb, part, retry_at);
+          if (retried && dropped != part)
+            wt_stats_add(&cb->stats, WT_STAT_POINTS_RETRIED, points);
+          wt_batch_push(&given_up, dropped);
+        }
+        wt_batch_put_nolock(cb, batch);
+        continue;
+      }
+      batch->attempts++;
+      {
+        int points = batch->points;
+        struct wt_batch *dropped = wt_retry_nolock(
+            cb, batch, now + wt_retry_delay_nolock(cb, batch->attempts));
+
+        if (dropped != batch)
+          wt_stats_add(&cb->stats, WT_STAT_POINTS_RETRIED, points);
+        wt_batch_push(&given_up, dropped);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cb->send_lock);
+
+  return NULL;
+}
+
+/* Format the value of data source ds_num into ret, which must hold
+ * WT_NUMBER_SIZE bytes, and set number to it.
+ * If rates is not NULL, the rate of a non-gauge data source is taken from
+ * rates[ds_num] instead, see wt_get_rates().
+ * Returns -EDOM if the value is not finite, as JSON cannot carry it.
+ */
+static int wt_format_values(char *ret, double *number, int ds_num,
+                            const data_set_t *ds, const value_list_t *vl,
+                            const gauge_t *rates) {
+  int type = ds->ds[ds_num].type;
+
+  assert(0 == strcmp(ds->type, vl->type));
+
+  if (type == DS_TYPE_GAUGE || rates != NULL) {
+    if (type == DS_TYPE_GAUGE)
+      *number = vl->values[ds_num].gauge;
+    else
+      *number = rates[ds_num];
+    if (wt_number_format_double(ret, *number) == 0)
+      return -EDOM;
+  } else if (type == DS_TYPE_COUNTER) {
+    wt_number_format_uint(ret, vl->values[ds_num].counter);
+    *number = (double)vl->values[ds_num].counter;
+  } else if (type == DS_TYPE_DERIVE) {
+    wt_number_format_int(ret, vl->values[ds_num].derive);
+    *number = (double)vl->values[ds_num].derive;
+  } else if (type == DS_TYPE_ABSOLUTE) {
+    wt_number_format_uint(ret, vl->values[ds_num].absolute);
+    *number = (double)vl->values[ds_num].absolute;
+  } else {
+    ERROR("format_values plugin: Unknown data source type: %i", type);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Rates of the data sources of a value list for StoreRates, read from the
+ * value cache of collectd once for all its data sources: the cache is
+ * locked and the array allocated on each call. NULL if there is no rate to
+ * read, or on failure with *status set.
+ */
+static gauge_t *wt_get_rates(const data_set_t *ds, const value_list_t *vl,
+                             const struct wt_callback *cb, int *status) {
+  gauge_t *rates;
+  size_t i;
+
+  *status = 0;
+  if (!cb->store_rates || cb->local_rates)
+    return NULL;
+  for (i = 0; i < ds->ds_num; i++) {
+    if (ds->ds[i].type != DS_TYPE_GAUGE)
+      break;
+  }
+  if (i == ds->ds_num)
+    return NULL;
+
+  rates = uc_get_rate(ds, vl);
+  if (rates == NULL) {
+    WARNING("format_values: "
+            "uc_get_rate failed.");
+    *status = -1;
+  }
+  return rates;
+}
+
+static void wt_tags_reset(struct wt_tags *tags) {
+  tags->num = 0;
+  tags->fixed = 0;
+  wt_strbuf_reset(&tags->storage);
+}
+
+static void wt_tags_free(struct wt_tags *tags) {
+  sfree(tags->tag);
+  tags->num = 0;
+  tags->size = 0;
+  wt_strbuf_free(&tags->storage);
+}
+
+static int wt_add_tag(struct wt_tags *tags, const char *key, const char *value){
+  int idx;
+  size_t offset;
+
+  for (idx = 0; idx < tags->num; idx++) {
+    if (strcmp(tags->storage.data + tags->tag[idx].key, key) == 0)
+      break;
+  }
+
+  if (idx == tags->num) {
+    if (tags->num == tags->size) {
+      int size = (tags->size == 0) ? 8 : 2 * tags->size;
+      struct wt_tag *tmp = realloc(tags->tag, size * sizeof(*tmp));
+      if (tmp == NULL)
+        return -ENOMEM;
+      tags->tag = tmp;
+      tags->size = size;
+    }
+    offset = tags->storage.len;
+    if (wt_strbuf_append(&tags->storage, key, strlen(key) + 1) != 0)
+      return -ENOMEM;
+    tags->tag[idx].key = offset;
+    tags->num++;
+  }
+
+  offset = tags->storage.len;
+  if (wt_strbuf_append(&tags->storage, value, strlen(value) + 1) != 0)
+    return -ENOMEM;
+  tags->tag[idx].value = offset;
+
+  return 0;
+}
+
+static int wt_add_host_tag(void *tags, const char *key, const char *value) {
+  return wt_add_tag(tags, key, value);
+}
+
+static void wt_meta_free(struct wt_meta *meta) {
+  sfree(meta->entry);
+  meta->num = 0;
+  meta->size = 0;
+  wt_arena_free(&meta->arena);
+}
+
+static int wt_meta_add(struct wt_meta *meta, meta_data_t *md,
+                       const char *key) {
+  struct wt_meta_entry *entry;
+  char *value = NULL;
+
+  if (meta->num == meta->size) {
+    int size = (meta->size == 0) ? 16 : 2 * meta->size;
+    struct wt_meta_entry *tmp = realloc(meta->entry, size * sizeof(*tmp));
+    if (tmp == NULL)
+      return -ENOMEM;
+    meta->entry = tmp;
+    meta->size = size;
+  }
+
+  entry = &meta->entry[meta->num];
+  entry->key = wt_arena_strdup(&meta->arena, key);
+  if (entry->key == NULL)
+    return -ENOMEM;
+  entry->value = NULL;
+  entry->status = meta_data_get_string(md, key, &value);
+  if (entry->status == 0 && value != NULL) {
+    entry->value = wt_arena_strdup(&meta->arena, value);
+    if (entry->value == NULL) {
+      sfree(value);
+      return -ENOMEM;
+    }
+  }
+  sfree(value);
+  meta->num++;
+
+  return 0;
+}
+
+/* Copy the tsdb_* meta data of md, which may be NULL, to meta
+ * The keys keep the order of meta_data_toc().
+ */
+static int wt_meta_read(struct wt_meta *meta, meta_data_t *md) {
+  char **meta_toc = NULL;
+  int status = 0;
+  int n;
+
+  meta->num = 0;
+  meta->valid = 0;
+  wt_arena_reset(&meta->arena);
+  if (md == NULL) {
+    meta->valid = 1;
+    return 0;
+  }
+
+  n = meta_data_toc(md, &meta_toc);
+  if (n < 0)
+    return n;
+  for (int i = 0; i < n; i++) {
+    if (status == 0 &&
+        strncmp(meta_toc[i], TSDB_META_PREFIX, sizeof(TSDB_META_PREFIX) - 1) ==
+            0)
+      status = wt_meta_add(meta, md, meta_toc[i]);
+    free(meta_toc[i]);
+  }
+  if (meta_toc)
+    free(meta_toc);
+
+  meta->valid = (status == 0);
+  return status;
+}
+
+static const struct wt_meta_entry *wt_meta_find(const struct wt_meta *meta,
+                                                const char *key) {
+  for (int i = 0; i < meta->num; i++) {
+    if (strcmp(meta->entry[i].key, key) == 0)
+      return &meta->entry[i];
+  }
+  return NULL;
+}
+
+/* Like meta_data_get_string(), but value is not a copy */
+static int wt_meta_get(const struct wt_meta *meta, const char *key,
+                       const char **value) {
+  const struct wt_meta_entry *entry = wt_meta_find(meta, key);
+
+  *value = NULL;
+  if (entry == NULL)
+    return -ENOENT;
+  *value = entry->value;
+  return entry->status;
+}
+
+static int wt_format_tags(struct wt_tags *tags, const value_list_t *vl,
+                          const struct wt_meta *meta,
+                          const struct wt_rule *rule,
+                          const struct wt_callback *cb, const char *ds_name) {
+  int status;
+  const char *temp = NULL;
+  const char *host = vl->host;
+  int i;
+
+  wt_tags_reset(tags);
+
+  if(cb->json_host_tag){
+    status = wt_hosttag_cache_get(cb->host_tag_cache, host, wt_add_host_tag,
+                                  tags);
+    if((status == -1) && cb->auto_fqdn_failback){
+      DEBUG("Failed to parse json host '%s', fallback to simple fqdn tag", host);
+      wt_add_tag(tags, "fqdn", host);
+    } else if (status == -1) {
+      ERROR("Failed to parse json host '%s'", host);
+      return 1;
+    }
+  } else {
+    wt_add_tag(tags, "fqdn", host);
+  }
+  tags->fixed = tags->num;
+#define TSDB_META_TAG_ADD_PREFIX "tsdb_tag_add_"
+
+#define TSDB_META_DATA_GET_STRING(idx)                                         \
+  do {                                                                         \
+    status = wt_meta_get(meta, meta_tag_metric_id[idx], &temp);                \
+    if (status == -ENOENT) {                                                   \
+      /* defaults to the rule, or empty string */                              \
+      temp = (rule != NULL) ? rule->tag[idx] : NULL;                           \
+    } else if (status < 0) {                                                   \
+      return status;                                                           \
+    }                                                                          \
+  } while (0)
+
+
+  if (meta->num > 0 || rule != NULL) {
+    TSDB_META_DATA_GET_STRING(TSDB_TAG_PLUGIN);
+    if (temp) {
+      if(strlen(temp) != 0)
+        wt_add_tag(tags, temp, vl->plugin);
+    }
+
+    TSDB_META_DATA_GET_STRING(TSDB_TAG_PLUGININSTANCE);
+    if (temp) {
+      if(strlen(temp) != 0)
+        wt_add_tag(tags, temp, vl->plugin_instance);
+    }
+
+    TSDB_META_DATA_GET_STRING(TSDB_TAG_TYPE);
+    if (temp) {
+      if(strlen(temp) != 0)
+        wt_add_tag(tags, temp, vl->type);
+    }
+
+    TSDB_META_DATA_GET_STRING(TSDB_TAG_TYPEINSTANCE);
+    if (temp) {
+      if(strlen(temp) != 0)
+        wt_add_tag(tags, temp, vl->type_instance);
+    }
+
+    if (ds_name) {
+      TSDB_META_DATA_GET_STRING(TSDB_TAG_DSNAME);
+      if (temp) {
+        if(strlen(temp) != 0)
+          wt_add_tag(tags, temp, ds_name);
+      }
+    }
+
+    tags->fixed = tags->num;
+    // the meta data replaces the values of the tags added by the rule
+    for (i = 0; rule != NULL && i < rule->add_num; i++) {
+      if (rule->add[i].value[0])
+        wt_add_tag(tags, rule->add[i].key, rule->add[i].value);
+    }
+
+    for (i = 0; i < meta->num; i++) {
+      const struct wt_meta_entry *entry = &meta->entry[i];
+
+      if (strncmp(entry->key, TSDB_META_TAG_ADD_PREFIX,
+                  sizeof(TSDB_META_TAG_ADD_PREFIX) - 1))
+        continue;
+      if ('\0' == entry->key[sizeof(TSDB_META_TAG_ADD_PREFIX) - 1]) {
+        ERROR("write_opentsdb plugin: meta_data tag '%s' is unknown (host=%s, "
+              "plugin=%s, type=%s)",
+              entry->key, vl->host, vl->plugin, vl->type);
+        continue;
+      }
+
+      if (entry->status < 0 && entry->status != -ENOENT)
+        return entry->status;
+      if (entry->value && entry->value[0]) {
+        const char *key = entry->key + sizeof(TSDB_META_TAG_ADD_PREFIX) - 1;
+        wt_add_tag(tags, key, entry->value);
+      }
+    }
+  }
+
+#undef TSDB_META_DATA_GET_STRING
+
+  return 0;
+}
+
+/* Keep the first max tags: those of the host, then those of the identifier,
+ * then the added ones by key order, so that the same tags are kept whatever
+ * the order of the meta data.
+ */
+static void wt_tags_trim(struct wt_tags *tags, int max) {
+  const char *data = tags->storage.data;
+
+  // insertion sort, there are a handful of tags
+  for (int i = tags->fixed + 1; i < tags->num; i++) {
+    struct wt_tag tag = tags->tag[i];
+    int j = i;
+
+    while (j > tags->fixed &&
+           strcmp(data + tags->tag[j - 1].key, data + tag.key) > 0) {
+      tags->tag[j] = tags->tag[j - 1];
+      j--;
+    }
+    tags->tag[j] = tag;
+  }
+  if (tags->num > max)
+    tags->num = max;
+}
+
+/* Append a word of a telnet line, whitespace would split it */
+static int wt_strbuf_append_word(struct wt_strbuf *buf, const char *str) {
+  size_t start = buf->len;
+
+  if (wt_strbuf_append_str(buf, str) != 0)
+    return -ENOMEM;
+  for (size_t i = start; i < buf->len; i++) {
+    if (isspace((unsigned char)buf->data[i]))
+      buf->data[i] = '_';
+  }
+  return 0;
+}
+
+/* Render the parts of a data point around its timestamp and value
+ * HTTP:   {"metric":"<metric>","timestamp":  and  ,"tags":{...}}
+ * telnet: put <metric>   and   tagk=tagv ...\n
+ * The beginning is appended to buf, the end to tail. Keeping the tags in the
+ * end lets the series with the same tags share it in the series cache.
+ */
+static int wt_render_series(struct wt_strbuf *buf, struct wt_strbuf *tail,
+                            int protocol, const char *metric,
+                            const struct wt_tags *tags) {
+  int status = 0;
+
+  if (protocol == WT_PROTOCOL_TELNET) {
+    status |= wt_strbuf_append_str(buf, "put ");
+    status |= wt_strbuf_append_word(buf, metric);
+    status |= wt_strbuf_append_char(buf, ' ');
+    for (int i = 0; i < tags->num; i++) {
+      status |= wt_strbuf_append_char(tail, ' ');
+      status |= wt_strbuf_append_word(
+          tail, tags->storage.data + tags->tag[i].key);
+      status |= wt_strbuf_append_char(tail, '=');
+      status |= wt_strbuf_append_word(
+          tail, tags->storage.data + tags->tag[i].value);
+    }
+    status |= wt_strbuf_append_char(tail, '\n');
+    return (status != 0) ? -ENOMEM : 0;
+  }
+
+  status |= wt_strbuf_append_str(buf, "{\"metric\":");
+  status |= wt_strbuf_append_json_string(buf, metric);
+  status |= wt_strbuf_append_str(buf, ",\"timestamp\":");
+  status |= wt_strbuf_append_str(tail, ",\"tags\":{");
+  for (int i = 0; i < tags->num; i++) {
+    if (i > 0)
+      status |= wt_strbuf_append_char(tail, ',');
+    status |= wt_strbuf_append_json_string(
+        tail, tags->storage.data + tags->tag[i].key);
+    status |= wt_strbuf_append_char(tail, ':');
+    status |= wt_strbuf_append_json_string(
+        tail, tags->storage.data + tags->tag[i].value);
+  }
+  status |= wt_strbuf_append_str(tail, "}}");
+
+  return (status != 0) ? -ENOMEM : 0;
+}
+
+/* Render the timestamp and value of a data point
+ * The timestamp is an integer in the unit of cb->precision, the TSD telling
+ * seconds from milliseconds by their number of digits. The value, formatted
+ * by wt_number_format_*(), is a JSON number.
+ */
+static int wt_render_value(struct wt_strbuf *buf,
+                           const struct wt_callback *cb, cdtime_t time,
+                           const char *value) {
+  char timestamp[WT_NUMBER_SIZE];
+  size_t timestamp_len;
+  int status = 0;
+
+  if (cb->precision == WT_PRECISION_SECONDS)
+    timestamp_len = wt_number_format_uint(timestamp, CDTIME_T_TO_TIME_T(time));
+  else
+    timestamp_len = wt_number_format_uint(timestamp, CDTIME_T_TO_MS(time));
+
+  status |= wt_strbuf_append(buf, timestamp, timestamp_len);
+  if (cb->protocol == WT_PROTOCOL_TELNET)
+    status |= wt_strbuf_append_char(buf, ' ');
+  else
+    status |= wt_strbuf_append_str(buf, ",\"value\":");
+  status |= wt_strbuf_append_str(buf, value);
+
+  return (status != 0) ? -ENOMEM : 0;
+}
+
+static int wt_format_name(char *ret, int ret_len, const value_list_t *vl,
+                          const struct wt_meta *meta,
+                          const struct wt_rule *rule,
+                          const struct wt_callback *cb, const char *ds_name) {
   int status;
   int i;
-  char *temp = NULL;
-  char *prefix = NULL;
+  const char *prefix = NULL;
   const char *meta_prefix = "tsdb_prefix";
-  char *tsdb_id = NULL;
+  const char *tsdb_id = NULL;
   const char *meta_id = "tsdb_id";
 
-  _Bool include_in_id[] = {
-      /* plugin =          */ 1,
-      /* plugin instance = */ (vl->plugin_instance[0] == '\0') ? 0 : 1,
-      /* type =            */ 1,
-      /* type instance =   */ (vl->type_instance[0] == '\0') ? 0 : 1,
-      /* ds_name =         */ (ds_name == NULL) ? 0 : 1};
+  _Bool include_in_id[] = {
+      /* plugin =          */ 1,
+      /* plugin instance = */ (vl->plugin_instance[0] == '\0') ? 0 : 1,
+      /* type =            */ 1,
+      /* type instance =   */ (vl->type_instance[0] == '\0') ? 0 : 1,
+      /* ds_name =         */ (ds_name == NULL) ? 0 : 1};
+
+  if (meta->num > 0 || rule != NULL) {
+    status = wt_meta_get(meta, meta_prefix, &prefix);
+    if (status == -ENOENT) {
+      /* defaults to the rule, or empty string */
+      prefix = (rule != NULL) ? rule->prefix : NULL;
+    } else if (status < 0) {
+      return status;
+    }
+
+    status = wt_meta_get(meta, meta_id, &tsdb_id);
+    if (status == -ENOENT) {
+      /* defaults to the rule, or empty string */
+      tsdb_id = (rule != NULL) ? rule->id : NULL;
+    } else if (status < 0) {
+      return status;
+    }
+
+    for (i = 0; i < (sizeof(meta_tag_metric_id) / sizeof(*meta_tag_metric_id));
+         i++) {
+      if (wt_meta_find(meta, meta_tag_metric_id[i]) == NULL &&
+          (rule == NULL || rule->tag[i] == NULL)) {
+        /* defaults to already initialized format */
+      } else {
+        include_in_id[i] = 0;
+      }
+    }
+  }
+  if (tsdb_id) {
+    ssnprintf(ret, ret_len, "%s%s", prefix ? prefix : "", tsdb_id);
+  } else {
+#define TSDB_STRING_APPEND_STRING(string)                                      \
+  do {                                                                         \
+    const char *str = (string);                                                \
+    size_t len = strlen(str);                                                  \
+    if (len > (remaining_len - 1)) {                                           \
+      ptr[0] = '\0';                                                           \
+      return (-ENOSPC);                                                        \
+    }                                                                          \
+    if (len > 0) {                                                             \
+      memcpy(ptr, str, len);                                                   \
+      ptr += len;                                                              \
+      remaining_len -= len;                                                    \
+    }                                                                          \
+  } while (0)
+
+#define TSDB_STRING_APPEND_DOT                                                 \
+  do {                                                                         \
+    if (remaining_len > 2) {                                                   \
+      ptr[0] = '.';                                                            \
+      ptr++;                                                                   \
+      remaining_len--;                                                         \
+    } else {                                                                   \
+      ptr[0] = '\0';                                                           \
+      return (-ENOSPC);                                                        \
+    }                                                                          \
+  } while (0)
+
+    char *ptr = ret;
+    size_t remaining_len = ret_len;
+    if (prefix) {
+      TSDB_STRING_APPEND_STRING(prefix);
+    }
+    if (include_in_id[TSDB_TAG_PLUGIN]) {
+      TSDB_STRING_APPEND_STRING(vl->plugin);
+    }
+
+    if (include_in_id[TSDB_TAG_PLUGININSTANCE]) {
+      TSDB_STRING_APPEND_DOT;
+      TSDB_STRING_APPEND_STRING(vl->plugin_instance);
+    }
+    if (include_in_id[TSDB_TAG_TYPE]) {
+      TSDB_STRING_APPEND_DOT;
+      TSDB_STRING_APPEND_STRING(vl->type);
+    }
+    if (include_in_id[TSDB_TAG_TYPEINSTANCE]) {
+      TSDB_STRING_APPEND_DOT;
+      TSDB_STRING_APPEND_STRING(vl->type_instance);
+    }
+
+    if (include_in_id[TSDB_TAG_DSNAME]) {
+      TSDB_STRING_APPEND_DOT;
+      TSDB_STRING_APPEND_STRING(ds_name);
+    }
+    ptr[0] = '\0';
+#undef TSDB_STRING_APPEND_STRING
+#undef TSDB_STRING_APPEND_DOT
+  }
+
+  return 0;
+}
+
+/* Fingerprint of the tsdb_* meta data of a value list, read by
+ * wt_meta_read()
+ * The meta data changes the metric name and tags, so it is part of the
+ * series identity. The fingerprint does not depend on the order of the keys.
+ */
+static uint64_t wt_meta_fingerprint(const struct wt_meta *meta) {
+  uint64_t fingerprint = 0;
+
+  for (int i = 0; i < meta->num; i++) {
+    const struct wt_meta_entry *entry = &meta->entry[i];
+    uint64_t hash =
+        wt_hash(entry->key, strlen(entry->key) + 1, WT_HASH_INIT);
+
+    if (entry->value != NULL)
+      hash = wt_hash(entry->value, strlen(entry->value), hash);
+    fingerprint += wt_hash_mix(hash);
+  }
+
+  return fingerprint;
+}
+
+/* Index of the first aggregation rule matching metric, -1 if none */
+static int wt_aggregate_match(const struct wt_callback *cb,
+                              const char *metric) {
+  for (int i = 0; i < cb->aggregates_num; i++) {
+    if (regexec(&cb->aggregates[i].regex, metric, 0, NULL, 0) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Fold a point into the aggregation window of its series
+ * Must be called with the shard of the series locked
+ */
+static void wt_aggregate_fold(const struct wt_callback *cb,
+                              struct wt_series *series,
+                              struct wt_point_filter *pf) {
+  const struct wt_aggregate_rule *rule = &cb->aggregates[series->aggregate];
+  uint64_t time = 0;
+
+  pf->absorbed = 1;
+  pf->function = rule->function;
+  pf->emit = wt_aggregate_add(&series->agg, rule->function, rule->window,
+                              pf->time, pf->value, &time, &pf->emit_value);
+  pf->emit_time = time;
+}
+
+/* Whether a point repeats the last one sent for its series, within the
+ * deadband and before the heartbeat. Otherwise it is recorded as sent.
+ * Must be called with the shard of the series locked
+ */
+static _Bool wt_dedup_suppress(const struct wt_callback *cb,
+                               struct wt_series *series, cdtime_t time,
+                               double value) {
+  if (series->sent &&
+      (cb->heartbeat == 0 || time < series->sent_time + cb->heartbeat)) {
+    double delta = fabs(value - series->sent_value);
+
+    if (value == series->sent_value || delta <= cb->deadband ||
+        delta <= cb->deadband_relative * fabs(series->sent_value))
+      return 1;
+  }
+
+  series->sent = 1;
+  series->sent_time = time;
+  series->sent_value = value;
+  return 0;
+}
+
+/* Rate of a counter, derive or absolute data source from the previous value
+ * of its series, for LocalRates. NAN for the first value of the series,
+ * when the time did not move forward and after a reset of the counter: a
+ * counter going down wrapped if it was in the upper half of the 32 bit range,
+ * else it was reset, and a derive whose minimum is not negative going down
+ * was reset.
+ * Must be called with the shard of the series locked
+ */
+static double wt_series_rate(struct wt_series *series,
+                             const struct wt_point_filter *pf) {
+  _Bool set = series->rate_set;
+  uint64_t prev = series->rate_value;
+  cdtime_t prev_time = series->rate_time;
+  double interval;
+
+  if (set && pf->time <= prev_time)
+    return NAN;
+
+  series->rate_set = 1;
+  series->rate_time = pf->time;
+  if (pf->type == DS_TYPE_COUNTER)
+    series->rate_value = pf->raw.counter;
+  else if (pf->type == DS_TYPE_DERIVE)
+    series->rate_value = (uint64_t)pf->raw.derive;
+  if (!set)
+    return NAN;
+  interval = CDTIME_T_TO_DOUBLE(pf->time - prev_time);
+
+  if (pf->type == DS_TYPE_COUNTER) {
+    uint64_t value = pf->raw.counter;
+
+    if (value >= prev)
+      return (double)(value - prev) / interval;
+    if (prev > UINT32_MAX / 2 && prev <= UINT32_MAX && value <= UINT32_MAX)
+      return (double)(UINT32_MAX - prev + value + 1) / interval;
+    return NAN;
+  }
+  if (pf->type == DS_TYPE_DERIVE) {
+    // subtracted as unsigned, the difference of two int64_t may overflow
+    int64_t diff = (int64_t)((uint64_t)pf->raw.derive - prev);
+
+    if (diff < 0 && pf->min >= 0)
+      return NAN;
+    return (double)diff / interval;
+  }
+  // an absolute value is reset when read
+  return (double)pf->raw.absolute / interval;
+}
+
+/* Run a point through the rate, aggregation and deduplication of its series
+ * The point is not sent if the rate is NAN.
+ * Must be called with the shard of the series locked
+ */
+static void wt_series_filter(const struct wt_callback *cb,
+                             struct wt_series *series,
+                             struct wt_point_filter *pf) {
+  if (pf->rate) {
+    pf->value = wt_series_rate(series, pf);
+    if (isnan(pf->value))
+      return;
+  }
+  if (series->aggregate >= 0) {
+    wt_aggregate_fold(cb, series, pf);
+    if (!pf->emit)
+      return;
+  }
+  if (cb->deduplicate)
+    pf->suppressed =
+        wt_dedup_suppress(cb, series, pf->emit ? pf->emit_time : pf->time,
+                          pf->emit ? pf->emit_value : pf->value);
+}
+
+/* Format the value of an aggregation window into buf, which must hold
+ * WT_NUMBER_SIZE bytes. Returns 0 if value is not finite.
+ */
+static size_t wt_format_aggregate(char *buf, int function, double value) {
+  if (function == WT_AGGREGATE_COUNT)
+    return wt_number_format_uint(buf, (uint64_t)value);
+  return wt_number_format_double(buf, value);
+}
+
+/* Series limit of a metric: the one with the longest matching prefix, NULL
+ * if none matches */
+static struct wt_series_limit *wt_limit_match(const struct wt_callback *cb,
+                                              const char *metric) {
+  struct wt_series_limit *match = NULL;
+
+  for (int i = 0; i < cb->limits_num; i++) {
+    struct wt_series_limit *limit = &cb->limits[i];
+
+    if (strncmp(metric, limit->prefix, limit->prefix_len) == 0 &&
+        (match == NULL || limit->prefix_len > match->prefix_len))
+      match = limit;
+  }
+  return match;
+}
+
+/* Rendering of a series, see wt_render_identity() */
+struct wt_identity {
+  // hash of the metric and tags, see wt_series.route
+  uint64_t route;
+  int aggregate;
+  // series limit of the metric, NULL if none
+  struct wt_series_limit *limit;
+  // see WT_LIMITED_*
+  int limited;
+};
+
+/* Render the metric name and tags of a series given by its meta data and
+ * rule into point and tail, see wt_render_series(), dropping the tags past
+ * max_tags
+ */
+static int wt_render_identity(struct wt_strbuf *point, struct wt_strbuf *tail,
+                              struct wt_tags *tags, const value_list_t *vl,
+                              const struct wt_meta *meta,
+                              const struct wt_rule *rule,
+                              const struct wt_callback *cb,
+                              const char *ds_name, struct wt_identity *id) {
+  char key[10 * DATA_MAX_NAME_LEN];
+  size_t start = point->len;
+  int status;
+
+  /* Copy the identifier to 'key' and escape it. */
+  status = wt_format_name(key, sizeof(key), vl, meta, rule, cb, ds_name);
+  if (status != 0) {
+    ERROR("write_opentsdb plugin: error with format_name");
+    return status;
+  }
+  id->aggregate = wt_aggregate_match(cb, key);
+  id->limit = wt_limit_match(cb, key);
+  escape_string(key, sizeof(key));
+
+  // Format the tags
+  status = wt_format_tags(tags, vl, meta, rule, cb, ds_name);
+  if (status != 0) {
+    ERROR("write_opentsdb plugin: error with format_tags");
+    return status;
+  }
+  if (cb->max_tags > 0 && tags->num > cb->max_tags) {
+    wt_tags_trim(tags, cb->max_tags);
+    id->limited |= WT_LIMITED_TRIMMED;
+  }
+
+  status = wt_render_series(point, tail, cb->protocol, key, tags);
+  if (status != 0)
+    return status;
+
+  // the metric and tags decide which endpoint gets the series
+  id->route = wt_hash_mix(
+      wt_hash(tail->data, tail->len,
+              wt_hash(point->data + start, point->len - start, WT_HASH_INIT)));
+  return 0;
+}
+
+/* Count a new series, rendered from start in point, against its limit
+ * Past the limit, the series is dropped or, with the collapse policy,
+ * rendered again with its plugin instance, or its type instance if it has
+ * none, replaced by "other": the part per-process or per-container values
+ * usually come in. The collapsed series are not limited themselves.
+ */
+static int wt_limit_series(struct wt_strbuf *point, struct wt_strbuf *tail,
+                           size_t start, struct wt_tags *tags,
+                           const value_list_t *vl, const struct wt_meta *meta,
+                           const struct wt_rule *rule,
+                           const struct wt_callback *cb, const char *ds_name,
+                           struct wt_identity *id) {
+  struct wt_series_limit *limit = id->limit;
+  struct wt_identity collapsed = {0};
+  value_list_t other;
+  int status;
+
+  status = wt_cardinality_admit(limit->series, id->route);
+  if (status != -EDQUOT)
+    return status;
+
+  if (!__atomic_exchange_n(&limit->reached, 1, __ATOMIC_RELAXED))
+    ERROR("write_opentsdb plugin: %zu series reached for the metrics "
+          "starting with \"%s\", the points of new series are %s",
+          limit->max, limit->prefix,
+          (cb->limit_policy == WT_LIMIT_POLICY_COLLAPSE) ? "collapsed"
+                                                         : "dropped");
+
+  id->limited |= WT_LIMITED_DROPPED;
+  if (cb->limit_policy != WT_LIMIT_POLICY_COLLAPSE ||
+      (vl->plugin_instance[0] == '\0' && vl->type_instance[0] == '\0'))
+    return 0;
+
+  other = *vl;
+  if (other.plugin_instance[0] != '\0')
+    sstrncpy(other.plugin_instance, WT_LIMIT_COLLAPSED_INSTANCE,
+             sizeof(other.plugin_instance));
+  else
+    sstrncpy(other.type_instance, WT_LIMIT_COLLAPSED_INSTANCE,
+             sizeof(other.type_instance));
+
+  point->len = start;
+  wt_strbuf_reset(tail);
+  status = wt_render_identity(point, tail, tags, &other, meta, rule, cb,
+                              ds_name, &collapsed);
+  if (status != 0)
+    return status;
+  // the instance is in neither the metric nor the tags
+  if (collapsed.route == id->route)
+    return 0;
+
+  collapsed.limited |= WT_LIMITED_COLLAPSED;
+  *id = collapsed;
+  return 0;
+}
+
+/* Count a point of a series changed by the cardinality guard
+ * Returns -EDQUOT if the point is dropped.
+ */
+static int wt_limited_point(struct wt_callback *cb, int limited) {
+  if (limited & WT_LIMITED_DROPPED) {
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_OVER_LIMIT, 1);
+    return -EDQUOT;
+  }
+  if (limited & WT_LIMITED_COLLAPSED)
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_COLLAPSED, 1);
+  if (limited & WT_LIMITED_TRIMMED)
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_TRIMMED, 1);
+  return 0;
+}
+
+/* Append the beginning of a data point to point and set tail to its end, see
+ * wt_render_series()
+ * The rendering is taken from the series cache, or done and cached on miss,
+ * reading the meta data of vl into meta unless already done.
+ * If pf is not NULL, the point goes through the aggregation and deduplication
+ * of the series, see struct wt_point_filter.
+ * Returns -EDQUOT if the point is dropped by the cardinality guard.
+ */
+static int wt_append_series(struct wt_strbuf *point, struct wt_strbuf *tail,
+                            struct wt_tags *tags, const value_list_t *vl,
+                            struct wt_meta *meta, struct wt_callback *cb,
+                            const char *ds_name, uint64_t fingerprint,
+                            uint64_t ident, uint64_t *route,
+                            struct wt_point_filter *pf) {
+  char series_key[6 * DATA_MAX_NAME_LEN + 16];
+  const struct wt_rule *rule = NULL;
+  struct wt_identity id = {0};
+  struct wt_series *series;
+  size_t key_len = 0;
+  size_t start = point->len;
+  uint64_t hash = 0;
+  int status;
+
+  wt_strbuf_reset(tail);
+
+  if (cb->series_cache != NULL) {
+    key_len = wt_series_key(series_key, sizeof(series_key), vl->host,
+                            vl->plugin, vl->plugin_instance, vl->type,
+                            vl->type_instance, ds_name, fingerprint);
+  }
 
-  if (vl->meta) {
-    status = meta_data_get_string(vl->meta, meta_prefix, &temp);
-    if (status == -ENOENT) {
-      /* defaults to empty string */
-    } else if (status < 0) {
-      sfree(temp);
+  if (key_len > 0) {
+    hash = wt_hash_mix(wt_hash(series_key, key_len, WT_HASH_INIT));
+    series = wt_series_cache_get(cb->series_cache, series_key, key_len, hash);
+    if (series != NULL) {
+      int limited = series->limited;
+
+      status = wt_strbuf_append(point, series->head, series->head_len);
+      if (status == 0)
+        status = wt_strbuf_append(tail, series->tail, series->tail_len);
+      *route = series->route;
+      if (status == 0 && pf != NULL && !(limited & WT_LIMITED_DROPPED))
+        wt_series_filter(cb, series, pf);
+      wt_series_cache_release(cb->series_cache, hash);
+      if (status == 0 && limited != 0)
+        status = wt_limited_point(cb, limited);
       return status;
-    } else {
-      prefix = temp;
     }
+    wt_series_cache_release(cb->series_cache, hash);
+  }
 
-    status = meta_data_get_string(vl->meta, meta_id, &temp);
-    if (status == -ENOENT) {
-      /* defaults to empty string */
-    } else if (status < 0) {
-      sfree(temp);
+  if (!meta->valid) {
+    status = wt_meta_read(meta, vl->meta);
+    if (status != 0) {
+      ERROR("write_opentsdb plugin: failed to read meta_data (host=%s, "
+            "plugin=%s, type=%s)",
+            vl->host, vl->plugin, vl->type);
       return status;
-    } else {
-      tsdb_id = temp;
     }
+  }
 
-    for (i = 0; i < (sizeof(meta_tag_metric_id) / sizeof(*meta_tag_metric_id));
-         i++) {
-      if (meta_data_exists(vl->meta, meta_tag_metric_id[i]) == 0) {
-        /* defaults to already initialized format */
-      } else {
-        include_in_id[i] = 0;
-      }
+  // the rule only depends on the plugin and type, part of the series key
+  if (cb->rules != NULL)
+    rule = wt_rules_match(cb->rules, vl->plugin, vl->type);
+
+  status = wt_render_identity(point, tail, tags, vl, meta, rule, cb, ds_name,
+                              &id);
+  if (status == 0 && id.limit != NULL)
+    status = wt_limit_series(point, tail, start, tags, vl, meta, rule, cb,
+                             ds_name, &id);
+  if (status != 0)
+    return status;
+  *route = id.route;
+
+  if (key_len > 0) {
+    series = wt_series_cache_insert(cb->series_cache, series_key, key_len,
+                                    hash, point->data + start,
+                                    point->len - start, tail->data,
+                                    tail->len);
+    if (series != NULL) {
+      series->route = id.route;
+      series->aggregate = id.aggregate;
+      series->ident = ident;
+      series->limited = id.limited;
+      if (pf != NULL && !(id.limited & WT_LIMITED_DROPPED))
+        wt_series_filter(cb, series, pf);
     }
+    wt_series_cache_release(cb->series_cache, hash);
   }
-  if (tsdb_id) {
-    ssnprintf(ret, ret_len, "%s%s", prefix ? prefix : "", tsdb_id);
+
+  return (id.limited != 0) ? wt_limited_point(cb, id.limited) : 0;
+}
+
+/* Lock cb->send_lock from the write path, timing the wait when contended */
+static void wt_send_lock(struct wt_callback *cb) {
+  cdtime_t start;
+
+  if (pthread_mutex_trylock(&cb->send_lock) == 0)
+    return;
+
+  start = cdtime();
+  pthread_mutex_lock(&cb->send_lock);
+  wt_stats_add(&cb->stats, WT_STAT_LOCK_WAITS, 1);
+  wt_stats_add(&cb->stats, WT_STAT_LOCK_WAIT_US,
+               CDTIME_T_TO_US(cdtime() - start));
+}
+
+/* Add a rendered data point to the open batch of the calling thread for the
+ * endpoint of its series
+ * send_lock is only taken to get an empty batch, when the previous one was
+ * handed over to the sender thread.
+ */
+static int wt_queue_point(struct wt_callback *cb, struct wt_writer *w,
+                          uint64_t route, const struct wt_strbuf *point,
+                          cdtime_t time, uint64_t ident) {
+  struct wt_batch **slot;
+  int idx;
+  int status = 0;
+
+  pthread_mutex_lock(&w->lock);
+
+  idx = wt_ring_lookup(&cb->ring, route, w->up);
+  slot = &w->batches[idx];
+
+  /* Hand the batch over to the sender thread if the point does not fit
+   */
+  if (*slot != NULL &&
+      wt_batch_full(cb, *slot, (*slot)->body.len + 1 + point->len))
+    wt_writer_hand_over(cb, slot);
+  if (*slot == NULL) {
+    wt_send_lock(cb);
+    *slot = wt_batch_get_nolock(cb);
+    memcpy(w->up, cb->endpoints_up, cb->endpoints_num * sizeof(*w->up));
+    pthread_mutex_unlock(&cb->send_lock);
+    if (*slot != NULL) {
+      (*slot)->endpoint = idx;
+      (*slot)->created = cdtime();
+    }
+  }
+
+  /* Add the new metric to the buffer, and send it right away if full
+   */
+  if (*slot == NULL ||
+      wt_batch_append(*slot, point->data, point->len, time, ident, route) !=
+          0) {
+    ERROR("write_opentsdb plugin: failed to add metric to buffer");
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_DROPPED, 1);
+    status = -1;
   } else {
-#define TSDB_STRING_APPEND_STRING(string)                                      \
-  do {                                                                         \
-    const char *str = (string);                                                \
-    size_t len = strlen(str);                                                  \
-    if (len > (remaining_len - 1)) {                                           \
-      ptr[0] = '\0';                                                           \
-      return (-ENOSPC);                                                        \
-    }                                                                          \
-    if (len > 0) {                                                             \
-      memcpy(ptr, str, len);                                                   \
-      ptr += len;                                                              \
-      remaining_len -= len;                                                    \
-    }                                                                          \
-  } while (0)
+    wt_stats_add(&cb->stats, WT_STAT_POINTS_QUEUED, 1);
+    if (cb->buffer_metric_max > 0 && (*slot)->points >= cb->buffer_metric_max)
+      wt_writer_hand_over(cb, slot);
+  }
 
-#define TSDB_STRING_APPEND_DOT                                                 \
-  do {                                                                         \
-    if (remaining_len > 2) {                                                   \
-      ptr[0] = '.';                                                            \
-      ptr++;                                                                   \
-      remaining_len--;                                                         \
-    } else {                                                                   \
-      ptr[0] = '\0';                                                           \
-      return (-ENOSPC);                                                        \
-    }                                                                          \
-  } while (0)
+  pthread_mutex_unlock(&w->lock);
+  return status;
+}
 
-    char *ptr = ret;
-    size_t remaining_len = ret_len;
-    if (prefix) {
-      TSDB_STRING_APPEND_STRING(prefix);
+/* Send the aggregate of a window of the series, see wt_aggregate_sweep() */
+struct wt_sweep {
+  struct wt_callback *cb;
+  struct wt_writer *writer;
+  cdtime_t now;
+  _Bool force;
+  struct wt_strbuf point;
+};
+
+static void wt_aggregate_sweep_series(struct wt_series *series, void *ctx) {
+  struct wt_sweep *sweep = ctx;
+  struct wt_callback *cb = sweep->cb;
+  const struct wt_aggregate_rule *rule;
+  char values[WT_NUMBER_SIZE];
+  uint64_t time;
+  double value;
+
+  if (series->aggregate < 0 || series->agg.count == 0)
+    return;
+  rule = &cb->aggregates[series->aggregate];
+  // the next point of a series still reporting sends the window
+  if (!sweep->force && sweep->now < series->agg.start + 2 * rule->window)
+    return;
+
+  wt_aggregate_take(&series->agg, rule->function, &time, &value);
+  if (cb->deduplicate && wt_dedup_suppress(cb, series, time, value))
+    return;
+  if (wt_format_aggregate(values, rule->function, value) == 0)
+    return;
+
+  wt_strbuf_reset(&sweep->point);
+  if (wt_strbuf_append(&sweep->point, series->head, series->head_len) != 0 ||
+      wt_render_value(&sweep->point, cb, time, values) != 0 ||
+      wt_strbuf_append(&sweep->point, series->tail, series->tail_len) != 0) {
+    ERROR("write_opentsdb plugin: failed to render aggregated point");
+    return;
+  }
+
+  // the writer and send_lock are locked with a series cache shard locked,
+  // never the reverse
+  wt_queue_point(cb, sweep->writer, series->route, &sweep->point, time,
+                 series->ident);
+}
+
+/* Send the aggregation windows that are over although no later point of
+ * their series arrived, or all of them if force is set.
+ * Called without holding cb->send_lock
+ */
+static void wt_aggregate_sweep(struct wt_callback *cb, cdtime_t now,
+                               _Bool force) {
+  struct wt_sweep sweep = {
+      .cb = cb, .now = now, .force = force, .point = WT_STRBUF_INIT};
+
+  if (cb->series_cache == NULL || cb->aggregates_num == 0)
+    return;
+
+  sweep.writer = wt_writer_get(cb);
+  if (sweep.writer == NULL) {
+    ERROR("write_opentsdb plugin: failed to allocate the write buffers");
+    return;
+  }
+  wt_series_cache_foreach(cb->series_cache, wt_aggregate_sweep_series,
+                          &sweep);
+  wt_strbuf_free(&sweep.point);
+}
+
+/* Send the window of a series evicted from the series cache, it would be lost
+ * with the series otherwise
+ * Called from the write path with the shard of the series locked
+ */
+static void wt_aggregate_evict(struct wt_series *series, void *ctx) {
+  struct wt_sweep sweep = {.cb = ctx, .force = 1, .point = WT_STRBUF_INIT};
+
+  if (series->aggregate < 0 || series->agg.count == 0)
+    return;
+
+  sweep.writer = wt_writer_get(sweep.cb);
+  if (sweep.writer == NULL) {
+    ERROR("write_opentsdb plugin: failed to allocate the write buffers");
+    wt_stats_add(&sweep.cb->stats, WT_STAT_POINTS_DROPPED, series->agg.count);
+    return;
+  }
+  wt_aggregate_sweep_series(series, &sweep);
+  wt_strbuf_free(&sweep.point);
+}
+
+static pthread_key_t wt_scratch_key;
+static pthread_once_t wt_scratch_once = PTHREAD_ONCE_INIT;
+static int wt_scratch_key_status;
+
+static void wt_scratch_free(void *data) {
+  struct wt_scratch *scratch = data;
+
+  wt_tags_free(&scratch->tags);
+  wt_meta_free(&scratch->meta);
+  wt_strbuf_free(&scratch->point);
+  wt_strbuf_free(&scratch->tail);
+  sfree(scratch);
+}
+
+static void wt_scratch_key_create(void) {
+  wt_scratch_key_status = pthread_key_create(&wt_scratch_key, wt_scratch_free);
+}
+
+/* Buffers of the calling thread, freed when it exits */
+static struct wt_scratch *wt_scratch_get(void) {
+  struct wt_scratch *scratch;
+
+  if (pthread_once(&wt_scratch_once, wt_scratch_key_create) != 0 ||
+      wt_scratch_key_status != 0)
+    return NULL;
+
+  scratch = pthread_getspecific(wt_scratch_key);
+  if (scratch != NULL)
+    return scratch;
+
+  scratch = calloc(1, sizeof(*scratch));
+  if (scratch == NULL)
+    return NULL;
+  scratch->tags.storage = (struct wt_strbuf)WT_STRBUF_INIT;
+  scratch->meta.arena = (struct wt_arena)WT_ARENA_INIT;
+  scratch->point = (struct wt_strbuf)WT_STRBUF_INIT;
+  scratch->tail = (struct wt_strbuf)WT_STRBUF_INIT;
+  if (pthread_setspecific(wt_scratch_key, scratch) != 0) {
+    sfree(scratch);
+    return NULL;
+  }
+  return scratch;
+}
+
+static int wt_write_messages(const data_set_t *ds, const value_list_t *vl,
+                             struct wt_callback *cb) {
+  char values[WT_NUMBER_SIZE];
+  struct wt_scratch *scratch;
+  struct wt_writer *writer;
+  uint64_t fingerprint = 0;
+  uint64_t ident;
+  gauge_t *rates;
+
+  int status = 0;
+
+  if (0 != strcmp(ds->type, vl->type)) {
+    ERROR("write_opentsdb plugin: DS type does not match "
+          "value list type");
+    return -1;
+  }
+
+  scratch = wt_scratch_get();
+  writer = wt_writer_get(cb);
+  if (scratch == NULL || writer == NULL) {
+    ERROR("write_opentsdb plugin: failed to allocate the write buffers");
+    return -ENOMEM;
+  }
+
+  ident = wt_identifier_hash(vl->host, vl->plugin, vl->plugin_instance,
+                             vl->type, vl->type_instance);
+
+  // read once, here for the fingerprint or else on the first series cache
+  // miss
+  scratch->meta.valid = 0;
+  if (vl->meta && cb->series_cache != NULL) {
+    status = wt_meta_read(&scratch->meta, vl->meta);
+    if (status != 0) {
+      ERROR("write_opentsdb plugin: failed to read meta_data (host=%s, "
+            "plugin=%s, type=%s)",
+            vl->host, vl->plugin, vl->type);
+      return status;
     }
-    if (include_in_id[TSDB_TAG_PLUGIN]) {
-      TSDB_STRING_APPEND_STRING(vl->plugin);
+    fingerprint = wt_meta_fingerprint(&scratch->meta);
+  }
+
+  rates = wt_get_rates(ds, vl, cb, &status);
+  if (status != 0)
+    return status;
+
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    const char *ds_name = NULL;
+    struct wt_point_filter pf = {.time = vl->time};
+    cdtime_t time = vl->time;
+    uint64_t route = 0;
+    int ret = 0;
+
+    if (cb->always_append_ds || (ds->ds_num > 1)){
+      ds_name = ds->ds[i].name;
+    }
+
+    /* Convert the values to an ASCII representation and put that into
+     * 'values'. */
+    if (cb->local_rates && ds->ds[i].type != DS_TYPE_GAUGE) {
+      // rate computed from the series, formatted once rendered
+      pf.rate = 1;
+      pf.type = ds->ds[i].type;
+      pf.raw = vl->values[i];
+      pf.min = ds->ds[i].min;
+      pf.value = NAN;
+    } else
+      ret = wt_format_values(values, &pf.value, i, ds, vl, rates);
+    // the TSD would reject NaN and infinite values anyway
+    if (ret == -EDOM) {
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_INVALID, 1);
+      continue;
+    }
+    if (ret != 0) {
+      ERROR("write_opentsdb plugin: error with "
+            "wt_format_values");
+      status += ret;
+      continue;
+    }
+
+    // Render the data point
+    wt_strbuf_reset(&scratch->point);
+    ret = wt_append_series(&scratch->point, &scratch->tail, &scratch->tags,
+                           vl, &scratch->meta, cb, ds_name,
+                           fingerprint, ident, &route,
+                           (cb->aggregates_num > 0 || cb->deduplicate ||
+                            pf.rate)
+                               ? &pf
+                               : NULL);
+    // counted by the cardinality guard
+    if (ret == -EDQUOT)
+      continue;
+    if (ret != 0) {
+      status += ret;
+      continue;
+    }
+    if (pf.rate && wt_number_format_double(values, pf.value) == 0) {
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_INVALID, 1);
+      continue;
+    }
+    // folded into its window, sent with the aggregate of the window
+    if ((pf.absorbed && !pf.emit) || pf.suppressed) {
+      wt_stats_add(&cb->stats, WT_STAT_POINTS_FILTERED, 1);
+      continue;
+    }
+    if (pf.emit) {
+      time = pf.emit_time;
+      if (wt_format_aggregate(values, pf.function, pf.emit_value) == 0) {
+        wt_stats_add(&cb->stats, WT_STAT_POINTS_INVALID, 1);
+        continue;
+      }
+    }
+
+    ret = wt_render_value(&scratch->point, cb, time, values);
+    if (ret == 0)
+      ret = wt_strbuf_append(&scratch->point, scratch->tail.data,
+                             scratch->tail.len);
+    if (ret != 0) {
+      status += ret;
+      continue;
+    }
+
+    if (wt_queue_point(cb, writer, route, &scratch->point, time, ident) != 0)
+      status += -1;
+  }
+
+  sfree(rates);
+  return status;
+}
+
+/* Read callback: dispatch the internal counters of a Node
+ */
+static int wt_read(user_data_t *user_data) {
+  struct wt_callback *cb = user_data->data;
+  value_list_t vl = VALUE_LIST_INIT;
+  value_t value;
+  struct wt_spool_stats spool = {0};
+  uint64_t series = 0;
+  uint64_t series_cache_hits = 0;
+  uint64_t series_cache_misses = 0;
+  size_t series_cache_entries = 0;
+  uint64_t host_tag_hits = 0;
+  uint64_t host_tag_misses = 0;
+  size_t host_tag_entries = 0;
+  int send_queue_len;
+  int retry_len;
+
+  vl.values = &value;
+  vl.values_len = 1;
+  sstrncpy(vl.plugin, "write_opentsdb", sizeof(vl.plugin));
+  sstrncpy(vl.plugin_instance, cb->stats_instance,
+           sizeof(vl.plugin_instance));
+
+  sstrncpy(vl.type, "derive", sizeof(vl.type));
+  for (int i = 0; i < WT_STAT_MAX; i++) {
+    value.derive = (derive_t)wt_stats_get(&cb->stats, i);
+    sstrncpy(vl.type_instance, wt_stats_name(i), sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+  // cumulative buckets, as the "le" buckets of a Prometheus histogram
+  for (int i = 0; i < WT_STAT_LATENCY_BUCKETS; i++) {
+    uint64_t bound;
+
+    value.derive = (derive_t)wt_stats_latency_le(&cb->stats, i, &bound);
+    if (bound > 0)
+      ssnprintf(vl.type_instance, sizeof(vl.type_instance),
+                "latency_le_%" PRIu64 "ms", bound);
+    else
+      sstrncpy(vl.type_instance, "latency_le_inf", sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+  if (cb->series_cache != NULL) {
+    wt_series_cache_stats(cb->series_cache, &series_cache_hits,
+                          &series_cache_misses, &series_cache_entries);
+    value.derive = (derive_t)series_cache_hits;
+    sstrncpy(vl.type_instance, "series_cache_hits", sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+    value.derive = (derive_t)series_cache_misses;
+    sstrncpy(vl.type_instance, "series_cache_misses",
+             sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+  if (cb->host_tag_cache != NULL) {
+    wt_hosttag_cache_stats(cb->host_tag_cache, &host_tag_hits,
+                           &host_tag_misses, &host_tag_entries);
+    value.derive = (derive_t)host_tag_hits;
+    sstrncpy(vl.type_instance, "host_tag_cache_hits",
+             sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+    value.derive = (derive_t)host_tag_misses;
+    sstrncpy(vl.type_instance, "host_tag_cache_misses",
+             sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+
+  pthread_mutex_lock(&cb->send_lock);
+  send_queue_len = cb->send_queue_len;
+  retry_len = cb->retry_len;
+  pthread_mutex_unlock(&cb->send_lock);
+  if (cb->spool != NULL)
+    wt_spool_stats(cb->spool, &spool);
+  for (int i = 0; i < cb->limits_num; i++)
+    series += wt_cardinality_estimate(cb->limits[i].series);
+
+  sstrncpy(vl.type, "gauge", sizeof(vl.type));
+  value.gauge = send_queue_len;
+  sstrncpy(vl.type_instance, "send_queue", sizeof(vl.type_instance));
+  plugin_dispatch_values(&vl);
+  value.gauge = retry_len;
+  sstrncpy(vl.type_instance, "retry_queue", sizeof(vl.type_instance));
+  plugin_dispatch_values(&vl);
+  value.gauge = spool.size;
+  sstrncpy(vl.type_instance, "spool_bytes", sizeof(vl.type_instance));
+  plugin_dispatch_values(&vl);
+  if (cb->limits_num > 0) {
+    value.gauge = series;
+    sstrncpy(vl.type_instance, "series", sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+  if (cb->series_cache != NULL) {
+    value.gauge = series_cache_entries;
+    sstrncpy(vl.type_instance, "series_cache_entries",
+             sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+  if (cb->host_tag_cache != NULL) {
+    value.gauge = host_tag_entries;
+    sstrncpy(vl.type_instance, "host_tag_cache_entries",
+             sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+
+  return 0;
+}
+
+/* Write callback
+ */
+static int wt_write(const data_set_t *ds, const value_list_t *vl,
+                    user_data_t *user_data) {
+  struct wt_callback *cb;
+  int status;
+
+  if (user_data == NULL)
+    return EINVAL;
+
+  cb = user_data->data;
+
+  status = wt_write_messages(ds, vl, cb);
+
+  return status;
+}
+
+/* Add an endpoint to the Node
+ * The URL is completed by wt_config_endpoints() once the protocol is known.
+ */
+static int wt_config_add_endpoint(struct wt_callback *cb,
+                                  const char *base_url) {
+  struct wt_endpoint *tmp;
+  struct wt_endpoint *ep;
+
+  tmp = realloc(cb->endpoints, (cb->endpoints_num + 1) * sizeof(*tmp));
+  if (tmp == NULL) {
+    ERROR("write_opentsdb plugin: realloc failed.");
+    return -1;
+  }
+  cb->endpoints = tmp;
+
+  ep = &cb->endpoints[cb->endpoints_num];
+  memset(ep, 0, sizeof(*ep));
+  ep->telnet.fd = -1;
+  ep->url = strdup(base_url);
+  if (ep->url == NULL) {
+    ERROR("write_opentsdb plugin: strdup failed.");
+    return -1;
+  }
+  cb->endpoints_num++;
+
+  return 0;
+}
+
+/* Complete the URLs of the endpoints for the protocol of the Node
+ * HTTP endpoints POST to /api/put, telnet endpoints are host:port addresses.
+ */
+static int wt_config_endpoints(struct wt_callback *cb) {
+  for (int i = 0; i < cb->endpoints_num; i++) {
+    struct wt_endpoint *ep = &cb->endpoints[i];
+    size_t len;
+    char *url;
+
+    if (cb->protocol == WT_PROTOCOL_TELNET) {
+      if (wt_telnet_init(&ep->telnet, ep->url, WT_DEFAULT_TELNET_PORT) != 0) {
+        ERROR("write_opentsdb plugin: invalid telnet address: %s", ep->url);
+        return -1;
+      }
+      continue;
+    }
+
+    len = strlen(ep->url) + sizeof("/api/put?details");
+    url = calloc(len, 1);
+    if (url == NULL) {
+      ERROR("write_opentsdb plugin: calloc failed.");
+      return -1;
     }
+    snprintf(url, len, "%s/api/put?details", ep->url);
+    sfree(ep->url);
+    ep->url = url;
+  }
+  return 0;
+}
+
+/* Parse an <Aggregate "regex"> block
+ */
+static int wt_config_aggregate(struct wt_callback *cb, oconfig_item_t *ci) {
+  struct wt_aggregate_rule *tmp;
+  struct wt_aggregate_rule *rule;
+  int status;
+
+  if (ci->values_num != 1 || ci->values[0].type != OCONFIG_TYPE_STRING) {
+    ERROR("write_opentsdb plugin: Aggregate expects a regular expression.");
+    return EINVAL;
+  }
+
+  tmp = realloc(cb->aggregates, (cb->aggregates_num + 1) * sizeof(*tmp));
+  if (tmp == NULL) {
+    ERROR("write_opentsdb plugin: realloc failed.");
+    return -1;
+  }
+  cb->aggregates = tmp;
+
+  rule = &cb->aggregates[cb->aggregates_num];
+  memset(rule, 0, sizeof(*rule));
+  rule->function = WT_AGGREGATE_AVG;
+  rule->window = TIME_T_TO_CDTIME_T(WT_DEFAULT_AGGREGATE_WINDOW);
+
+  status = regcomp(&rule->regex, ci->values[0].value.string,
+                   REG_EXTENDED | REG_NOSUB);
+  if (status != 0) {
+    char errbuf[256];
+
+    regerror(status, &rule->regex, errbuf, sizeof(errbuf));
+    ERROR("write_opentsdb plugin: invalid Aggregate regex %s: %s",
+          ci->values[0].value.string, errbuf);
+    return EINVAL;
+  }
+  cb->aggregates_num++;
+
+  for (int i = 0; i < ci->children_num; i++) {
+    oconfig_item_t *child = ci->children + i;
 
-    if (include_in_id[TSDB_TAG_PLUGININSTANCE]) {
-      TSDB_STRING_APPEND_DOT;
-      TSDB_STRING_APPEND_STRING(vl->plugin_instance);
-    }
-    if (include_in_id[TSDB_TAG_TYPE]) {
-      TSDB_STRING_APPEND_DOT;
-      TSDB_STRING_APPEND_STRING(vl->type);
-    }
-    if (include_in_id[TSDB_TAG_TYPEINSTANCE]) {
-      TSDB_STRING_APPEND_DOT;
-      TSDB_STRING_APPEND_STRING(vl->type_instance);
+    if (strcasecmp("Function", child->key) == 0) {
+      char *value = NULL;
+      status = cf_util_get_string(child, &value);
+      if (status != 0)
+        return status;
+      rule->function = wt_aggregate_parse_function(value);
+      if (rule->function < 0) {
+        ERROR("write_opentsdb plugin: Invalid aggregation Function: %s.",
+              value);
+        rule->function = WT_AGGREGATE_AVG;
+        status = EINVAL;
+      }
+      sfree(value);
     }
-
-    if (include_in_id[TSDB_TAG_DSNAME]) {
-      TSDB_STRING_APPEND_DOT;
-      TSDB_STRING_APPEND_STRING(ds_name);
+    else if (strcasecmp("Window", child->key) == 0)
+      status = cf_util_get_cdtime(child, &rule->window);
+    else {
+      ERROR("write_opentsdb plugin: Invalid Aggregate option: %s.",
+            child->key);
+      status = EINVAL;
     }
-    ptr[0] = '\0';
-#undef TSDB_STRING_APPEND_STRING
-#undef TSDB_STRING_APPEND_DOT
+    if (status != 0)
+      return status;
   }
 
-  sfree(tsdb_id);
-  sfree(prefix);
+  if (rule->window == 0) {
+    ERROR("write_opentsdb plugin: aggregation Window must be positive.");
+    return EINVAL;
+  }
   return 0;
 }
 
-static int wt_write_messages(const data_set_t *ds, const value_list_t *vl,
-                             struct wt_callback *cb) {
-  char key[10 * DATA_MAX_NAME_LEN];
-  char values[512];
-
+/* Parse a <Rule "plugin"> block into the tagging rules of the Node
+ */
+static int wt_config_rule(struct wt_callback *cb, oconfig_item_t *ci) {
+  static const char *tag_options[WT_RULE_TAGS] = {
+      "TagPlugin", "TagPluginInstance", "TagType", "TagTypeInstance",
+      "TagDSName"};
+  struct wt_rule *rule;
   int status;
 
-  if (0 != strcmp(ds->type, vl->type)) {
-    ERROR("write_opentsdb plugin: DS type does not match "
-          "value list type");
+  if (ci->values_num != 1 || ci->values[0].type != OCONFIG_TYPE_STRING) {
+    ERROR("write_opentsdb plugin: Rule expects a plugin name or /regex/.");
+    return EINVAL;
+  }
+
+  if (cb->rules == NULL) {
+    cb->rules = wt_rules_create();
+    if (cb->rules == NULL) {
+      ERROR("write_opentsdb plugin: calloc failed.");
+      return -1;
+    }
+  }
+
+  rule = wt_rule_create();
+  if (rule == NULL) {
+    ERROR("write_opentsdb plugin: calloc failed.");
     return -1;
   }
 
-  for (size_t i = 0; i < ds->ds_num; i++) {
-    const char *ds_name = NULL;
-    int ret = 0;
+  status = wt_rule_pattern_set(&rule->plugin, ci->values[0].value.string);
+  if (status != 0) {
+    ERROR("write_opentsdb plugin: invalid Rule plugin %s.",
+          ci->values[0].value.string);
+    wt_rule_free(rule);
+    return EINVAL;
+  }
 
-    json_object *dp = json_object_new_object();
+  for (int i = 0; i < ci->children_num; i++) {
+    oconfig_item_t *child = ci->children + i;
+    int tag = -1;
 
-    if (cb->always_append_ds || (ds->ds_num > 1)){
-      ds_name = ds->ds[i].name;
+    for (int j = 0; j < WT_RULE_TAGS; j++) {
+      if (strcasecmp(tag_options[j], child->key) == 0)
+        tag = j;
     }
 
-    /* Copy the identifier to 'key' and escape it. */
-    ret = wt_format_name(key, sizeof(key), vl, cb, ds_name);
-    if (ret != 0) {
-      ERROR("write_opentsdb plugin: error with format_name");
-      status += ret;
-      continue;
+    if (tag >= 0)
+      status = cf_util_get_string(child, &rule->tag[tag]);
+    else if (strcasecmp("Type", child->key) == 0) {
+      char *value = NULL;
+      status = cf_util_get_string(child, &value);
+      if (status == 0 && wt_rule_pattern_set(&rule->type, value) != 0) {
+        ERROR("write_opentsdb plugin: invalid Rule Type %s.", value);
+        status = EINVAL;
+      }
+      sfree(value);
     }
-    escape_string(key, sizeof(key));
-
-    /* Convert the values to an ASCII representation and put that into
-     * 'values'. */
-    ret = wt_format_values(values, sizeof(values), i, ds, vl, cb->store_rates);
-    if (ret != 0) {
-      ERROR("write_opentsdb plugin: error with "
-            "wt_format_values");
-      status += ret;
-      continue;
+    else if (strcasecmp("Prefix", child->key) == 0)
+      status = cf_util_get_string(child, &rule->prefix);
+    else if (strcasecmp("Id", child->key) == 0)
+      status = cf_util_get_string(child, &rule->id);
+    else if (strcasecmp("AddTag", child->key) == 0) {
+      if (child->values_num != 2 ||
+          child->values[0].type != OCONFIG_TYPE_STRING ||
+          child->values[1].type != OCONFIG_TYPE_STRING ||
+          child->values[0].value.string[0] == '\0') {
+        ERROR("write_opentsdb plugin: AddTag expects a key and a value.");
+        status = EINVAL;
+      } else if (wt_rule_add_tag(rule, child->values[0].value.string,
+                                 child->values[1].value.string) != 0) {
+        ERROR("write_opentsdb plugin: strdup failed.");
+        status = -1;
+      }
+    }
+    else {
+      ERROR("write_opentsdb plugin: Invalid Rule option: %s.", child->key);
+      status = EINVAL;
     }
-
-    // Add the timestamp
-    json_object *js_timestamp = json_object_new_double(CDTIME_T_TO_DOUBLE(vl->time));
-    json_object_object_add(dp, "timestamp", js_timestamp);
-    // Add the metric
-    json_object  *js_key = json_object_new_string(key);
-    json_object_object_add(dp, "metric", js_key);
-    // Add the value
-    json_object *js_values = json_object_new_string(values);
-    json_object_object_add(dp, "value", js_values);
-
-    // Add the tags
-    status = wt_format_tags(dp, vl, cb, ds_name);
     if (status != 0) {
-      ERROR("write_opentsdb plugin: error with format_tags");
-      status += ret;
-      json_object_put(dp);
-      continue;
+      wt_rule_free(rule);
+      return status;
     }
+  }
 
-    // We need some locks to avoid disaster
-    pthread_mutex_lock(&cb->send_lock);
+  wt_rules_add(cb->rules, rule);
+  return 0;
+}
 
-    /* Send the message to tsdb if buffer is full
-     */
+/* Parse a SeriesLimit option: a number of series and an optional metric
+ * prefix. Giving the same prefix again replaces its limit.
+ */
+static int wt_config_series_limit(struct wt_callback *cb,
+                                  oconfig_item_t *ci) {
+  struct wt_series_limit *limit = NULL;
+  struct wt_cardinality *series;
+  const char *prefix = "";
+  size_t max;
 
-    if(cb->buffer_metric_size == cb->buffer_metric_max ){
-      ret = wt_write_nolock(cb);
-      wt_reset_buffer(cb);
-      status += ret;
-    }
+  if (ci->values_num < 1 || ci->values_num > 2 ||
+      ci->values[0].type != OCONFIG_TYPE_NUMBER ||
+      ci->values[0].value.number < 1 ||
+      (ci->values_num == 2 && ci->values[1].type != OCONFIG_TYPE_STRING)) {
+    ERROR("write_opentsdb plugin: SeriesLimit expects a positive number and "
+          "an optional metric prefix.");
+    return EINVAL;
+  }
+  max = (size_t)ci->values[0].value.number;
+  if (ci->values_num == 2)
+    prefix = ci->values[1].value.string;
+
+  series = wt_cardinality_create(max);
+  if (series == NULL) {
+    ERROR("write_opentsdb plugin: calloc failed.");
+    return -1;
+  }
 
-    /* Add the new metric to the buffer
-     */
-    json_object_array_add(cb->json_buffer, dp);
-    cb->buffer_metric_size++;
+  for (int i = 0; i < cb->limits_num; i++) {
+    if (strcmp(cb->limits[i].prefix, prefix) == 0)
+      limit = &cb->limits[i];
+  }
+  if (limit == NULL) {
+    struct wt_series_limit *tmp =
+        realloc(cb->limits, (cb->limits_num + 1) * sizeof(*tmp));
+    if (tmp == NULL) {
+      ERROR("write_opentsdb plugin: realloc failed.");
+      wt_cardinality_destroy(series);
+      return -1;
+    }
+    cb->limits = tmp;
 
-    // Release lock
-    pthread_mutex_unlock(&cb->send_lock);
+    limit = &cb->limits[cb->limits_num];
+    memset(limit, 0, sizeof(*limit));
+    limit->prefix = strdup(prefix);
+    if (limit->prefix == NULL) {
+      ERROR("write_opentsdb plugin: strdup failed.");
+      wt_cardinality_destroy(series);
+      return -1;
+    }
+    limit->prefix_len = strlen(prefix);
+    cb->limits_num++;
   }
 
-  return status;
+  wt_cardinality_destroy(limit->series);
+  limit->series = series;
+  limit->max = max;
+  return 0;
 }
 
-/* Write callback
+/* Plugin instance of the internal counters: the Node name if given, or the
+ * host and port of its first endpoint
  */
-static int wt_write(const data_set_t *ds, const value_list_t *vl,
-                    user_data_t *user_data) {
-  struct wt_callback *cb;
-  int status;
-
-  if (user_data == NULL)
-    return EINVAL;
-
-  cb = user_data->data;
+static void wt_stats_instance(struct wt_callback *cb) {
+  const char *name = cb->endpoints[0].url;
+  const char *scheme = strstr(name, "://");
+  char *ptr;
 
-  status = wt_write_messages(ds, vl, cb);
+  if (cb->name != NULL)
+    name = cb->name;
+  else if (scheme != NULL)
+    name = scheme + strlen("://");
+  sstrncpy(cb->stats_instance, name, sizeof(cb->stats_instance));
 
-  return status;
+  // up to the path, and without the characters collectd identifiers use
+  if (cb->name == NULL && (ptr = strchr(cb->stats_instance, '/')) != NULL)
+    *ptr = '\0';
+  for (ptr = cb->stats_instance; *ptr != '\0'; ptr++) {
+    if (*ptr == '/' || *ptr == ':' || isspace((unsigned char)*ptr))
+      *ptr = '_';
+  }
 }
 
 /* Initialization of the plugin
@@ -717,38 +4062,183 @@ static int wt_config_tsd(oconfig_item_t *ci) {
     ERROR("write_opentsdb plugin: calloc failed.");
     return -1;
   }
-  cb->node = NULL;
+  cb->protocol = WT_PROTOCOL_HTTP;
+  cb->precision = WT_PRECISION_MILLISECONDS;
+  cb->endpoints = NULL;
+  cb->endpoints_num = 0;
+  cb->endpoint_failures_max = WT_DEFAULT_ENDPOINT_FAILURES;
+  cb->endpoint_retry_interval = WT_DEFAULT_ENDPOINT_RETRY_INTERVAL;
   cb->store_rates = 0;
+  cb->local_rates = 0;
   cb->buffer_metric_max = 30;
-  cb->buffer_metric_size = 0;
-  cb->connect_failed_log_count = 0;
-  cb->last_error_log = 0;
+  cb->buffer_bytes = 0;
+  cb->max_buffer_age = TIME_T_TO_CDTIME_T(WT_DEFAULT_MAX_BUFFER_AGE);
+  cb->series_cache = NULL;
+  cb->series_cache_size = WT_DEFAULT_SERIES_CACHE_SIZE;
+  cb->aggregates = NULL;
+  cb->aggregates_num = 0;
+  cb->rules = NULL;
+  cb->limits = NULL;
+  cb->limits_num = 0;
+  cb->limit_policy = WT_LIMIT_POLICY_DROP;
+  cb->max_tags = WT_DEFAULT_MAX_TAGS;
+  cb->deduplicate = 0;
+  cb->heartbeat = TIME_T_TO_CDTIME_T(WT_DEFAULT_HEARTBEAT);
+  cb->deadband = 0;
+  cb->deadband_relative = 0;
+  cb->host_tag_cache = NULL;
+  cb->host_tag_cache_size = WT_DEFAULT_HOST_TAG_CACHE_SIZE;
+  cb->compression = WT_COMPRESS_NONE;
+  cb->compression_level = -1;
   cb->auto_fqdn_failback = 0;
   cb->json_host_tag = 0;
+  cb->send_queue_max = WT_DEFAULT_SEND_QUEUE_SIZE;
+  cb->max_in_flight = WT_DEFAULT_MAX_IN_FLIGHT;
+  cb->http2 = 0;
+  cb->retry_queue_max = WT_DEFAULT_RETRY_QUEUE_SIZE;
+  cb->max_retries = WT_DEFAULT_MAX_RETRIES;
+  cb->retry_delay = TIME_T_TO_CDTIME_T(WT_DEFAULT_RETRY_DELAY);
+  cb->retry_delay_max = TIME_T_TO_CDTIME_T(WT_DEFAULT_RETRY_MAX_DELAY);
+  cb->retry_seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)cb;
+  cb->spool = NULL;
+  cb->spool_dir = NULL;
+  cb->spool_max_size = WT_DEFAULT_SPOOL_MAX_SIZE;
+  cb->spool_replay_rate = WT_DEFAULT_SPOOL_REPLAY_RATE;
+  cb->replayer_running = 0;
+  cb->sender_running = 0;
+  cb->sender_shutdown = 0;
 
   pthread_mutex_init(&cb->send_lock, NULL);
+  pthread_cond_init(&cb->send_cond, NULL);
+  pthread_cond_init(&cb->replay_cond, NULL);
   int status = 0;
 
+  if (ci->values_num == 1 && ci->values[0].type == OCONFIG_TYPE_STRING)
+    cb->name = strdup(ci->values[0].value.string);
+
   for (int i = 0; i < ci->children_num; i++) {
     oconfig_item_t *child = ci->children + i;
 
     if (strcasecmp("URL", child->key) == 0){
-      char *base_url = NULL;
-      cf_util_get_string(child, &base_url);
-      cb->node = calloc(10 + strlen(base_url), 1);
-      snprintf(cb->node, 10 + strlen(base_url), "%s/api/put", base_url);
-      free(base_url);
+      for (int j = 0; j < child->values_num; j++) {
+        if (child->values[j].type != OCONFIG_TYPE_STRING) {
+          ERROR("write_opentsdb plugin: URL expects string arguments.");
+          status = EINVAL;
+          continue;
+        }
+        if (wt_config_add_endpoint(cb, child->values[j].value.string) != 0)
+          status = -1;
+      }
+    }
+    else if (strcasecmp("Protocol", child->key) == 0) {
+      char *value = NULL;
+      status = cf_util_get_string(child, &value);
+      if (status != 0)
+        break;
+      if (strcasecmp("http", value) == 0)
+        cb->protocol = WT_PROTOCOL_HTTP;
+      else if (strcasecmp("telnet", value) == 0)
+        cb->protocol = WT_PROTOCOL_TELNET;
+      else {
+        ERROR("write_opentsdb plugin: Invalid Protocol option: %s.", value);
+        status = EINVAL;
+      }
+      sfree(value);
+    }
+    else if (strcasecmp("TimestampPrecision", child->key) == 0) {
+      char *value = NULL;
+      status = cf_util_get_string(child, &value);
+      if (status != 0)
+        break;
+      if (strcasecmp("seconds", value) == 0)
+        cb->precision = WT_PRECISION_SECONDS;
+      else if (strcasecmp("milliseconds", value) == 0)
+        cb->precision = WT_PRECISION_MILLISECONDS;
+      else {
+        ERROR("write_opentsdb plugin: Invalid TimestampPrecision option: %s.",
+              value);
+        status = EINVAL;
+      }
+      sfree(value);
+    }
+    else if (strcasecmp("Aggregate", child->key) == 0)
+      status = wt_config_aggregate(cb, child);
+    else if (strcasecmp("Rule", child->key) == 0)
+      status = wt_config_rule(cb, child);
+    else if (strcasecmp("SeriesLimit", child->key) == 0)
+      status = wt_config_series_limit(cb, child);
+    else if (strcasecmp("SeriesLimitPolicy", child->key) == 0) {
+      char *value = NULL;
+      status = cf_util_get_string(child, &value);
+      if (status != 0)
+        break;
+      if (strcasecmp("drop", value) == 0)
+        cb->limit_policy = WT_LIMIT_POLICY_DROP;
+      else if (strcasecmp("collapse", value) == 0)
+        cb->limit_policy = WT_LIMIT_POLICY_COLLAPSE;
+      else {
+        ERROR("write_opentsdb plugin: Invalid SeriesLimitPolicy option: %s.",
+              value);
+        status = EINVAL;
+      }
+      sfree(value);
     }
+    else if (strcasecmp("MaxTags", child->key) == 0)
+      status = cf_util_get_int(child, &cb->max_tags);
+    else if (strcasecmp("Deduplicate", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->deduplicate);
+    else if (strcasecmp("Heartbeat", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->heartbeat);
+    else if (strcasecmp("Deadband", child->key) == 0)
+      status = cf_util_get_double(child, &cb->deadband);
+    else if (strcasecmp("DeadbandRelative", child->key) == 0)
+      status = cf_util_get_double(child, &cb->deadband_relative);
+    else if (strcasecmp("ReportStats", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->report_stats);
+    else if (strcasecmp("MaxInFlight", child->key) == 0)
+      status = cf_util_get_int(child, &cb->max_in_flight);
+    else if (strcasecmp("HTTP2", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->http2);
+    else if (strcasecmp("RetryQueueSize", child->key) == 0)
+      status = cf_util_get_int(child, &cb->retry_queue_max);
+    else if (strcasecmp("MaxRetries", child->key) == 0)
+      status = cf_util_get_int(child, &cb->max_retries);
+    else if (strcasecmp("RetryDelay", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->retry_delay);
+    else if (strcasecmp("RetryMaxDelay", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->retry_delay_max);
+    else if (strcasecmp("SpoolDirectory", child->key) == 0)
+      status = cf_util_get_string(child, &cb->spool_dir);
+    else if (strcasecmp("SpoolMaxSize", child->key) == 0)
+      status = cf_util_get_int(child, &cb->spool_max_size);
+    else if (strcasecmp("SpoolReplayRate", child->key) == 0)
+      status = cf_util_get_int(child, &cb->spool_replay_rate);
+    else if (strcasecmp("EndpointFailures", child->key) == 0)
+      status = cf_util_get_int(child, &cb->endpoint_failures_max);
+    else if (strcasecmp("EndpointRetryInterval", child->key) == 0)
+      status = cf_util_get_int(child, &cb->endpoint_retry_interval);
     else if (strcasecmp("Timeout", child->key) == 0)
       status = cf_util_get_int(child, &cb->timeout);
     else if (strcasecmp("BufferSize", child->key) == 0)
       status = cf_util_get_int(child, &cb->buffer_metric_max);
+    else if (strcasecmp("BufferBytes", child->key) == 0)
+      status = cf_util_get_int(child, &cb->buffer_bytes);
+    else if (strcasecmp("MaxBufferAge", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->max_buffer_age);
+    else if (strcasecmp("SendQueueSize", child->key) == 0)
+      status = cf_util_get_int(child, &cb->send_queue_max);
+    else if (strcasecmp("SeriesCacheSize", child->key) == 0)
+      status = cf_util_get_int(child, &cb->series_cache_size);
+    else if (strcasecmp("HostTagCacheSize", child->key) == 0)
+      status = cf_util_get_int(child, &cb->host_tag_cache_size);
     else if (strcasecmp("JsonHostTag", child->key) == 0)
       status = cf_util_get_boolean(child, &cb->json_host_tag);
     else if (strcasecmp("AutoFqdnFallback", child->key) == 0)
       status = cf_util_get_boolean(child, &cb->auto_fqdn_failback);
     else if (strcasecmp("StoreRates", child->key) == 0)
       status = cf_util_get_boolean(child, &cb->store_rates);
+    else if (strcasecmp("LocalRates", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->local_rates);
     else if (strcasecmp("AlwaysAppendDS", child->key) == 0)
       status = cf_util_get_boolean(child, &cb->always_append_ds);
     else if (strcasecmp("VerifyPeer", child->key) == 0)
@@ -765,6 +4255,25 @@ static int wt_config_tsd(oconfig_item_t *ci) {
       status = cf_util_get_string(child, &cb->clientcert);
     else if (strcasecmp("ClientKeyPass", child->key) == 0)
       status = cf_util_get_string(child, &cb->clientkeypass);
+    else if (strcasecmp("Compression", child->key) == 0) {
+      char *value = NULL;
+      status = cf_util_get_string(child, &value);
+      if (status != 0)
+        break;
+      cb->compression = wt_compress_parse_type(value);
+      if (cb->compression < 0) {
+        ERROR("write_opentsdb plugin: Invalid or unsupported Compression "
+              "option: %s.",
+              value);
+        cb->compression = WT_COMPRESS_NONE;
+        status = EINVAL;
+      }
+      sfree(value);
+    }
+    else if (strcasecmp("CompressionLevel", child->key) == 0)
+      status = cf_util_get_int(child, &cb->compression_level);
+    else if (strcasecmp("StreamBody", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->stream_body);
     else if (strcasecmp("SSLVersion", child->key) == 0) {
       char *value = NULL;
       status = cf_util_get_string(child, &value);
@@ -808,13 +4317,184 @@ static int wt_config_tsd(oconfig_item_t *ci) {
     }
   }
 
-  status = wt_config_curl(cb);
+  if (wt_compress_init(&cb->compress, cb->compression,
+                       cb->compression_level) != 0) {
+    ERROR("write_opentsdb plugin: failed to initialize compression.");
+    wt_callback_free(cb);
+    return -1;
+  }
+
+  if (cb->protocol == WT_PROTOCOL_TELNET &&
+      cb->compression != WT_COMPRESS_NONE) {
+    ERROR("write_opentsdb plugin: Compression is not supported by the telnet "
+          "protocol.");
+    wt_callback_free(cb);
+    return -1;
+  }
+  // uncompressed bodies are POSTed straight from their batch already
+  if (cb->compression == WT_COMPRESS_NONE)
+    cb->stream_body = 0;
+
+  if (cb->endpoints_num == 0 &&
+      wt_config_add_endpoint(cb, (cb->protocol == WT_PROTOCOL_TELNET)
+                                     ? WT_DEFAULT_TELNET_NODE
+                                     : WT_DEFAULT_NODE) != 0) {
+    wt_callback_free(cb);
+    return -1;
+  }
+  if (wt_config_endpoints(cb) != 0) {
+    wt_callback_free(cb);
+    return -1;
+  }
+  if (cb->endpoint_failures_max < 1)
+    cb->endpoint_failures_max = 1;
+
+  if (cb->max_in_flight < 1)
+    cb->max_in_flight = 1;
+
+  cb->requests = calloc(cb->max_in_flight, sizeof(*cb->requests));
+  if (cb->requests == NULL) {
+    ERROR("write_opentsdb plugin: calloc failed.");
+    wt_callback_free(cb);
+    return -1;
+  }
+
+  // the telnet protocol writes to one connection per endpoint, without curl
+  if (cb->protocol == WT_PROTOCOL_HTTP) {
+    cb->multi = curl_multi_init();
+    if (cb->multi == NULL) {
+      ERROR("write_opentsdb plugin: failed to create the curl multi handle.");
+      wt_callback_free(cb);
+      return -1;
+    }
+    // idle connections kept alive for reuse, one per request slot and
+    // endpoint
+    curl_multi_setopt(cb->multi, CURLMOPT_MAXCONNECTS,
+                      (long)(cb->max_in_flight * cb->endpoints_num));
+#ifdef CURLPIPE_MULTIPLEX
+    if (cb->http2)
+      curl_multi_setopt(cb->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+    for (int i = 0; i < cb->max_in_flight; i++) {
+      if (wt_config_curl(cb, &cb->requests[i]) != 0)
+        status = -1;
+    }
+  }
+
+  {
+    char *names[cb->endpoints_num];
+
+    for (int i = 0; i < cb->endpoints_num; i++)
+      names[i] = cb->endpoints[i].url;
+    cb->endpoints_up = calloc(cb->endpoints_num, sizeof(*cb->endpoints_up));
+    if (cb->endpoints_up == NULL ||
+        wt_ring_init(&cb->ring, names, cb->endpoints_num) != 0) {
+      ERROR("write_opentsdb plugin: failed to create the endpoint ring.");
+      wt_callback_free(cb);
+      return -1;
+    }
+    for (int i = 0; i < cb->endpoints_num; i++)
+      cb->endpoints_up[i] = 1;
+  }
+
+  if (cb->send_queue_max < 1)
+    cb->send_queue_max = 1;
+  if (cb->max_tags < 0)
+    cb->max_tags = 0;
+  if (!cb->store_rates)
+    cb->local_rates = 0;
+  if (cb->retry_delay_max < cb->retry_delay)
+    cb->retry_delay_max = cb->retry_delay;
+
+  if (cb->spool_dir != NULL) {
+    uint64_t max_size = (uint64_t)cb->spool_max_size * 1024 * 1024;
+    uint64_t segment_size = WT_SPOOL_SEGMENT_SIZE;
+    struct wt_spool_stats stats;
+
+    if (cb->spool_max_size < 1 || cb->spool_replay_rate < 1) {
+      ERROR("write_opentsdb plugin: SpoolMaxSize and SpoolReplayRate must be "
+            "positive.");
+      wt_callback_free(cb);
+      return -1;
+    }
+    // keep several segments so that a full spool drops only its oldest part
+    if (segment_size > max_size / 8)
+      segment_size = max_size / 8;
+
+    cb->spool = wt_spool_open(cb->spool_dir, max_size, segment_size);
+    if (cb->spool == NULL) {
+      ERROR("write_opentsdb plugin: failed to open spool %s: %s",
+            cb->spool_dir, strerror(errno));
+      wt_callback_free(cb);
+      return -1;
+    }
+    if (cb->protocol == WT_PROTOCOL_TELNET) {
+      cb->replay_telnet =
+          calloc(cb->endpoints_num, sizeof(*cb->replay_telnet));
+      if (cb->replay_telnet == NULL) {
+        ERROR("write_opentsdb plugin: calloc failed.");
+        wt_callback_free(cb);
+        return -1;
+      }
+      for (int i = 0; i < cb->endpoints_num; i++)
+        cb->replay_telnet[i].fd = -1;
+      for (int i = 0; i < cb->endpoints_num; i++) {
+        if (wt_telnet_init(&cb->replay_telnet[i], cb->endpoints[i].url,
+                           WT_DEFAULT_TELNET_PORT) != 0) {
+          wt_callback_free(cb);
+          return -1;
+        }
+      }
+    } else if (wt_config_curl(cb, &cb->replay) != 0 ||
+               wt_compress_init(&cb->replay_compress, cb->compression,
+                                cb->compression_level) != 0) {
+      wt_callback_free(cb);
+      return -1;
+    }
+
+    wt_spool_stats(cb->spool, &stats);
+    if (stats.size > 0)
+      INFO("write_opentsdb plugin: %" PRIu64 " bytes of spooled batches to "
+           "replay from %s",
+           stats.size, cb->spool_dir);
+  }
+
+  if ((cb->aggregates_num > 0 || cb->deduplicate || cb->local_rates) &&
+      cb->series_cache_size <= 0) {
+    ERROR("write_opentsdb plugin: Aggregate, Deduplicate and LocalRates need "
+          "the series cache, SeriesCacheSize must be positive.");
+    wt_callback_free(cb);
+    return -1;
+  }
+
+  if (cb->series_cache_size > 0) {
+    cb->series_cache = wt_series_cache_create(
+        cb->series_cache_size,
+        (cb->aggregates_num > 0) ? wt_aggregate_evict : NULL, cb);
+    if (cb->series_cache == NULL) {
+      ERROR("write_opentsdb plugin: failed to create series cache.");
+      wt_callback_free(cb);
+      return -1;
+    }
+  }
+
+  if (cb->json_host_tag && cb->host_tag_cache_size > 0) {
+    cb->host_tag_cache = wt_hosttag_cache_create(cb->host_tag_cache_size);
+    if (cb->host_tag_cache == NULL) {
+      ERROR("write_opentsdb plugin: failed to create host tag cache.");
+      wt_callback_free(cb);
+      return -1;
+    }
+  }
 
-  cb->json_buffer = json_object_new_array();
-  cb->buffer_metric_size = 0;
+  pthread_mutex_lock(&wt_callbacks_lock);
+  cb->next = wt_callbacks;
+  wt_callbacks = cb;
+  pthread_mutex_unlock(&wt_callbacks_lock);
 
   ssnprintf(callback_name, sizeof(callback_name), "write_opentsdb/%s",
-            cb->node != NULL ? cb->node : WT_DEFAULT_NODE);
+            cb->endpoints[0].url);
 
   user_data_t user_data = {.data = cb, .free_func = wt_callback_free};
 
@@ -823,54 +4503,98 @@ static int wt_config_tsd(oconfig_item_t *ci) {
   user_data.free_func = NULL;
   plugin_register_flush(callback_name, wt_flush, &user_data);
 
+  if (cb->report_stats) {
+    wt_stats_instance(cb);
+    plugin_register_complex_read(NULL, callback_name, wt_read, 0, &user_data);
+  }
+
   return status;
 }
 
-/* Intialization of the curl structure
+/* Intialization of the curl structure of a request slot
  */
-int wt_config_curl(struct wt_callback *cb){
+int wt_config_curl(struct wt_callback *cb, struct wt_request *req){
+  CURL *curl;
 
-  if (cb->curl != NULL)
+  if (req->curl != NULL)
     return 0;
 
-  cb->curl = curl_easy_init();
-  if (cb->curl == NULL) {
+  curl = req->curl = curl_easy_init();
+  if (curl == NULL) {
     ERROR("curl plugin: curl_easy_init failed.");
     return -1;
   }
 
   if (cb->timeout > 0)
-    curl_easy_setopt(cb->curl, CURLOPT_TIMEOUT_MS, (long)cb->timeout);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)cb->timeout);
 
-  curl_easy_setopt(cb->curl, CURLOPT_NOSIGNAL, 1L);
-  curl_easy_setopt(cb->curl, CURLOPT_WRITEFUNCTION, writefunc);
-  curl_easy_setopt(cb->curl, CURLOPT_USERAGENT, COLLECTD_USERAGENT);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, COLLECTD_USERAGENT);
 
-  cb->headers = curl_slist_append(cb->headers, "Accept:  */*");
-  curl_slist_append(cb->headers, "Content-Type: application/json");
-  cb->headers = curl_slist_append(cb->headers, "Expect:");
-  curl_easy_setopt(cb->curl, CURLOPT_HTTPHEADER, cb->headers);
+  // the headers are shared by the endpoints of the Node
+  if (cb->headers == NULL) {
+    cb->headers = curl_slist_append(cb->headers, "Accept:  */*");
+    curl_slist_append(cb->headers, "Content-Type: application/json");
+    cb->headers = curl_slist_append(cb->headers, "Expect:");
+    if (wt_compress_encoding(cb->compression) != NULL) {
+      char header[64];
+      ssnprintf(header, sizeof(header), "Content-Encoding: %s",
+                wt_compress_encoding(cb->compression));
+      cb->headers = curl_slist_append(cb->headers, header);
+    }
+    // ignored by curl over HTTP/2, which has its own framing
+    if (cb->stream_body)
+      cb->headers =
+          curl_slist_append(cb->headers, "Transfer-Encoding: chunked");
+  }
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, cb->headers);
+
+  if (cb->stream_body) {
+    if (wt_compress_init(&req->stream, cb->compression,
+                         cb->compression_level) != 0) {
+      ERROR("write_opentsdb plugin: failed to initialize compression.");
+      return -1;
+    }
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, wt_read_body);
+    curl_easy_setopt(curl, CURLOPT_READDATA, req);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, wt_seek_body);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, req);
+  }
 
-  curl_easy_setopt(cb->curl, CURLOPT_ERRORBUFFER, cb->curl_errbuf);
-  curl_easy_setopt(cb->curl, CURLOPT_URL, cb->node);
-  curl_easy_setopt(cb->curl, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(cb->curl, CURLOPT_MAXREDIRS, 50L);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_errbuf);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, req);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
 
-  curl_easy_setopt(cb->curl, CURLOPT_SSL_VERIFYPEER, (long)cb->verify_peer);
-  curl_easy_setopt(cb->curl, CURLOPT_SSL_VERIFYHOST, cb->verify_host ? 2L : 0L);
-  curl_easy_setopt(cb->curl, CURLOPT_SSLVERSION, cb->sslversion);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, (long)cb->verify_peer);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, cb->verify_host ? 2L : 0L);
+  curl_easy_setopt(curl, CURLOPT_SSLVERSION, cb->sslversion);
   if (cb->cacert != NULL)
-    curl_easy_setopt(cb->curl, CURLOPT_CAINFO, cb->cacert);
+    curl_easy_setopt(curl, CURLOPT_CAINFO, cb->cacert);
   if (cb->capath != NULL)
-    curl_easy_setopt(cb->curl, CURLOPT_CAPATH, cb->capath);
+    curl_easy_setopt(curl, CURLOPT_CAPATH, cb->capath);
 
   if (cb->clientkey != NULL && cb->clientcert != NULL) {
-    curl_easy_setopt(cb->curl, CURLOPT_SSLKEY, cb->clientkey);
-    curl_easy_setopt(cb->curl, CURLOPT_SSLCERT, cb->clientcert);
+    curl_easy_setopt(curl, CURLOPT_SSLKEY, cb->clientkey);
+    curl_easy_setopt(curl, CURLOPT_SSLCERT, cb->clientcert);
 
     if (cb->clientkeypass != NULL)
-      curl_easy_setopt(cb->curl, CURLOPT_SSLKEYPASSWD, cb->clientkeypass);
+      curl_easy_setopt(curl, CURLOPT_SSLKEYPASSWD, cb->clientkeypass);
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  if (cb->http2) {
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // wait for a connection able to multiplex instead of opening a new one
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
   }
+#endif
+
+  return 0;
 }
 
 /* Plugin de-itialization
@@ -883,17 +4607,92 @@ static void wt_callback_free(void *data) {
 
   cb = data;
 
+  pthread_mutex_lock(&wt_callbacks_lock);
+  for (struct wt_callback **it = &wt_callbacks; *it != NULL;
+       it = &(*it)->next) {
+    if (*it == cb) {
+      *it = cb->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wt_callbacks_lock);
+
+  /* Queue what is left in the buffer and let the sender thread drain the
+   * queue before stopping it */
+  if (cb->sender_running)
+    wt_aggregate_sweep(cb, cdtime(), 1);
+  wt_writers_collect(cb, NULL, 0, 1);
   pthread_mutex_lock(&cb->send_lock);
+  cb->sender_shutdown = 1;
+  pthread_cond_signal(&cb->send_cond);
+  pthread_cond_signal(&cb->replay_cond);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  if (cb->sender_running) {
+    pthread_join(cb->sender_thread, NULL);
+    cb->sender_running = 0;
+  }
+  if (cb->replayer_running) {
+    pthread_join(cb->replayer_thread, NULL);
+    cb->replayer_running = 0;
+  }
 
-  wt_write_nolock(cb);
-  json_object_put(cb->json_buffer);
+  for (int i = 0; i < cb->endpoints_num; i++) {
+    struct wt_endpoint *ep = &cb->endpoints[i];
 
-  sfree(cb->node);
+    wt_telnet_free(&ep->telnet);
+    if (cb->replay_telnet != NULL)
+      wt_telnet_free(&cb->replay_telnet[i]);
+    sfree(ep->url);
+  }
+  sfree(cb->replay_telnet);
+  for (int i = 0; cb->requests != NULL && i < cb->max_in_flight; i++) {
+    struct wt_request *req = &cb->requests[i];
 
-  if (cb->curl != NULL) {
-    curl_easy_cleanup(cb->curl);
-    cb->curl = NULL;
+    wt_batch_free(req->batch);
+    wt_batch_free(req->split);
+    if (req->curl != NULL)
+      curl_easy_cleanup(req->curl);
+    wt_strbuf_free(&req->compressed);
+    wt_strbuf_free(&req->response);
+    wt_compress_free(&req->stream);
+  }
+  sfree(cb->requests);
+  if (cb->multi != NULL)
+    curl_multi_cleanup(cb->multi);
+  if (cb->replay.curl != NULL)
+    curl_easy_cleanup(cb->replay.curl);
+  wt_strbuf_free(&cb->replay.compressed);
+  wt_strbuf_free(&cb->replay.response);
+  wt_compress_free(&cb->replay.stream);
+  wt_compress_free(&cb->replay_compress);
+  wt_spool_close(cb->spool);
+  sfree(cb->spool_dir);
+  sfree(cb->endpoints);
+  sfree(cb->endpoints_up);
+  wt_ring_free(&cb->ring);
+  wt_writers_free(cb);
+  wt_batch_free(cb->handoff);
+  wt_batch_free(cb->send_queue_head);
+  wt_batch_free(cb->retry_head);
+  while (cb->flush_head != NULL) {
+    struct wt_flush_request *next = cb->flush_head->next;
+    sfree(cb->flush_head);
+    cb->flush_head = next;
   }
+  wt_batch_free(cb->free_batches);
+  wt_series_cache_destroy(cb->series_cache);
+  for (int i = 0; i < cb->aggregates_num; i++)
+    regfree(&cb->aggregates[i].regex);
+  sfree(cb->aggregates);
+  wt_rules_destroy(cb->rules);
+  for (int i = 0; i < cb->limits_num; i++) {
+    sfree(cb->limits[i].prefix);
+    wt_cardinality_destroy(cb->limits[i].series);
+  }
+  sfree(cb->limits);
+  wt_hosttag_cache_destroy(cb->host_tag_cache);
+  wt_compress_free(&cb->compress);
 
   if (cb->headers != NULL) {
     curl_slist_free_all(cb->headers);
@@ -904,12 +4703,53 @@ static void wt_callback_free(void *data) {
   sfree(cb->clientkey);
   sfree(cb->clientcert);
   sfree(cb->clientkeypass);
+  sfree(cb->name);
 
+  pthread_cond_destroy(&cb->send_cond);
+  pthread_cond_destroy(&cb->replay_cond);
   pthread_mutex_destroy(&cb->send_lock);
 
   sfree(cb);
 }
 
+/* Start the sender and replayer threads
+ * Done at init time rather than config time as collectd may fork in between
+ */
+static int wt_init(void) {
+  int status = 0;
+
+  pthread_mutex_lock(&wt_callbacks_lock);
+  for (struct wt_callback *cb = wt_callbacks; cb != NULL; cb = cb->next) {
+    int ret;
+
+    if (cb->sender_running)
+      continue;
+
+    ret = pthread_create(&cb->sender_thread, NULL, wt_sender_thread, cb);
+    if (ret != 0) {
+      ERROR("write_opentsdb plugin: failed to start sender thread: %s",
+            strerror(ret));
+      status = -1;
+      continue;
+    }
+    cb->sender_running = 1;
+
+    if (cb->spool == NULL)
+      continue;
+    ret = pthread_create(&cb->replayer_thread, NULL, wt_replayer_thread, cb);
+    if (ret != 0) {
+      ERROR("write_opentsdb plugin: failed to start spool replayer thread: %s",
+            strerror(ret));
+      status = -1;
+      continue;
+    }
+    cb->replayer_running = 1;
+  }
+  pthread_mutex_unlock(&wt_callbacks_lock);
+
+  return status;
+}
+
 /* plugin initialization callback
  */
 static int wt_config(oconfig_item_t *ci) {
@@ -933,6 +4773,7 @@ static int wt_config(oconfig_item_t *ci) {
  */
 void module_register(void) {
   plugin_register_complex_config("write_opentsdb", wt_config);
+  plugin_register_init("write_opentsdb", wt_init);
 }
 
 /* vim: set sw=4 ts=4 sts=4 tw=78 et : */
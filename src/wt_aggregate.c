@@ -0,0 +1,96 @@
+/**
+ * collectd - src/wt_aggregate.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <stddef.h>
+#include <strings.h>
+
+#include "wt_aggregate.h"
+
+static const char *wt_aggregate_functions[] = {
+    [WT_AGGREGATE_AVG] = "avg",   [WT_AGGREGATE_MIN] = "min",
+    [WT_AGGREGATE_MAX] = "max",   [WT_AGGREGATE_SUM] = "sum",
+    [WT_AGGREGATE_LAST] = "last", [WT_AGGREGATE_COUNT] = "count"};
+
+int wt_aggregate_parse_function(const char *name) {
+  for (size_t i = 0; i < sizeof(wt_aggregate_functions) /
+                             sizeof(wt_aggregate_functions[0]);
+       i++) {
+    if (strcasecmp(name, wt_aggregate_functions[i]) == 0)
+      return (int)i;
+  }
+  return -1;
+}
+
+int wt_aggregate_take(struct wt_aggregate *agg, int function, uint64_t *time,
+                      double *value) {
+  if (agg->count == 0)
+    return 0;
+
+  switch (function) {
+  case WT_AGGREGATE_AVG:
+    *value = agg->sum / agg->count;
+    break;
+  case WT_AGGREGATE_MIN:
+    *value = agg->min;
+    break;
+  case WT_AGGREGATE_MAX:
+    *value = agg->max;
+    break;
+  case WT_AGGREGATE_SUM:
+    *value = agg->sum;
+    break;
+  case WT_AGGREGATE_COUNT:
+    *value = (double)agg->count;
+    break;
+  default:
+    *value = agg->last;
+    break;
+  }
+  *time = agg->start;
+  agg->count = 0;
+  return 1;
+}
+
+int wt_aggregate_add(struct wt_aggregate *agg, int function, uint64_t window,
+                     uint64_t point_time, double point_value, uint64_t *time,
+                     double *value) {
+  uint64_t start = point_time - point_time % window;
+  int emitted = 0;
+
+  if (agg->count > 0 && start > agg->start)
+    emitted = wt_aggregate_take(agg, function, time, value);
+
+  if (agg->count == 0) {
+    agg->start = start;
+    agg->sum = 0;
+    agg->min = point_value;
+    agg->max = point_value;
+  }
+  agg->count++;
+  agg->sum += point_value;
+  if (point_value < agg->min)
+    agg->min = point_value;
+  if (point_value > agg->max)
+    agg->max = point_value;
+  agg->last = point_value;
+
+  return emitted;
+}
@@ -0,0 +1,99 @@
+/**
+ * collectd - src/wt_arena.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wt_arena.h"
+
+#ifndef WT_ARENA_CHUNK_SIZE
+#define WT_ARENA_CHUNK_SIZE 4096
+#endif
+
+// allocations are aligned for any scalar type
+#define WT_ARENA_ALIGN 16
+
+struct wt_arena_chunk {
+  struct wt_arena_chunk *next;
+  size_t size;
+  size_t used;
+  // padding keeps data aligned on WT_ARENA_ALIGN
+  size_t pad;
+  char data[];
+};
+
+void *wt_arena_alloc(struct wt_arena *arena, size_t size) {
+  struct wt_arena_chunk *chunk = arena->head;
+  size_t chunk_size;
+
+  size = (size + WT_ARENA_ALIGN - 1) & ~(size_t)(WT_ARENA_ALIGN - 1);
+  if (chunk != NULL && chunk->size - chunk->used >= size) {
+    chunk->used += size;
+    return chunk->data + chunk->used - size;
+  }
+
+  chunk_size = arena->chunk_size ? arena->chunk_size : WT_ARENA_CHUNK_SIZE;
+  if (chunk_size < size)
+    chunk_size = size;
+  chunk = malloc(sizeof(*chunk) + chunk_size);
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = arena->head;
+  chunk->size = chunk_size;
+  chunk->used = size;
+  arena->head = chunk;
+  return chunk->data;
+}
+
+char *wt_arena_strdup(struct wt_arena *arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = wt_arena_alloc(arena, len);
+
+  if (copy != NULL)
+    memcpy(copy, str, len);
+  return copy;
+}
+
+void wt_arena_reset(struct wt_arena *arena) {
+  size_t total = 0;
+
+  if (arena->head == NULL)
+    return;
+  if (arena->head->next == NULL) {
+    arena->head->used = 0;
+    return;
+  }
+
+  // replaced by a single chunk, allocated on the next wt_arena_alloc()
+  for (struct wt_arena_chunk *chunk = arena->head; chunk != NULL;
+       chunk = chunk->next)
+    total += chunk->size;
+  wt_arena_free(arena);
+  arena->chunk_size = total;
+}
+
+void wt_arena_free(struct wt_arena *arena) {
+  while (arena->head != NULL) {
+    struct wt_arena_chunk *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+}
@@ -0,0 +1,168 @@
+/**
+ * collectd - src/wt_cardinality.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "wt_cardinality.h"
+
+// 2^WT_HLL_BITS registers, about 1.6% standard error
+#define WT_HLL_BITS 12
+#define WT_HLL_REGISTERS (1 << WT_HLL_BITS)
+
+struct wt_cardinality {
+  pthread_mutex_t lock;
+  size_t limit;
+  // open addressing set of the admitted hashes, 0 marks an empty slot
+  uint64_t *set;
+  size_t set_size;
+  size_t set_num;
+  // HyperLogLog registers: highest rank seen for each register
+  uint8_t hll[WT_HLL_REGISTERS];
+};
+
+struct wt_cardinality *wt_cardinality_create(size_t limit) {
+  struct wt_cardinality *card;
+
+  if (limit == 0)
+    return NULL;
+
+  card = calloc(1, sizeof(*card));
+  if (card == NULL)
+    return NULL;
+  card->limit = limit;
+  pthread_mutex_init(&card->lock, NULL);
+  return card;
+}
+
+void wt_cardinality_destroy(struct wt_cardinality *card) {
+  if (card == NULL)
+    return;
+  free(card->set);
+  pthread_mutex_destroy(&card->lock);
+  free(card);
+}
+
+/* Slot of hash in set, or the empty slot where it goes */
+static size_t wt_cardinality_slot(const uint64_t *set, size_t size,
+                                  uint64_t hash) {
+  size_t i = hash & (size - 1);
+
+  while (set[i] != 0 && set[i] != hash)
+    i = (i + 1) & (size - 1);
+  return i;
+}
+
+/* Double the set, which starts with 64 slots and is kept at most half full
+ */
+static int wt_cardinality_grow(struct wt_cardinality *card) {
+  size_t size = (card->set_size == 0) ? 64 : 2 * card->set_size;
+  uint64_t *set = calloc(size, sizeof(*set));
+
+  if (set == NULL)
+    return -ENOMEM;
+  for (size_t i = 0; i < card->set_size; i++) {
+    if (card->set[i] != 0)
+      set[wt_cardinality_slot(set, size, card->set[i])] = card->set[i];
+  }
+  free(card->set);
+  card->set = set;
+  card->set_size = size;
+  return 0;
+}
+
+static void wt_cardinality_sketch(struct wt_cardinality *card,
+                                  uint64_t hash) {
+  uint64_t rest = (hash << WT_HLL_BITS) | (1ULL << (WT_HLL_BITS - 1));
+  uint8_t rank = __builtin_clzll(rest) + 1;
+  uint8_t *reg = &card->hll[hash >> (64 - WT_HLL_BITS)];
+
+  if (rank > *reg)
+    *reg = rank;
+}
+
+int wt_cardinality_admit(struct wt_cardinality *card, uint64_t hash) {
+  int status = 0;
+  size_t i;
+
+  // 0 marks empty slots
+  if (hash == 0)
+    hash = 1;
+
+  pthread_mutex_lock(&card->lock);
+  wt_cardinality_sketch(card, hash);
+
+  if (card->set_size > 0) {
+    i = wt_cardinality_slot(card->set, card->set_size, hash);
+    if (card->set[i] == hash)
+      goto out;
+  }
+  if (card->set_num >= card->limit) {
+    status = -EDQUOT;
+    goto out;
+  }
+  if (2 * (card->set_num + 1) > card->set_size) {
+    status = wt_cardinality_grow(card);
+    if (status != 0)
+      goto out;
+  }
+  card->set[wt_cardinality_slot(card->set, card->set_size, hash)] = hash;
+  card->set_num++;
+
+out:
+  pthread_mutex_unlock(&card->lock);
+  return status;
+}
+
+uint64_t wt_cardinality_estimate(struct wt_cardinality *card) {
+  const double m = WT_HLL_REGISTERS;
+  double sum = 0;
+  int zeros = 0;
+  double estimate;
+  size_t exact;
+
+  pthread_mutex_lock(&card->lock);
+  exact = card->set_num;
+  if (exact < card->limit) {
+    pthread_mutex_unlock(&card->lock);
+    return exact;
+  }
+  for (int i = 0; i < WT_HLL_REGISTERS; i++) {
+    sum += 1.0 / (double)(1ULL << card->hll[i]);
+    if (card->hll[i] == 0)
+      zeros++;
+  }
+  pthread_mutex_unlock(&card->lock);
+
+  estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+  // linear counting is more accurate for small cardinalities
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log(m / zeros);
+
+  // the admitted series alone are a lower bound
+  if (estimate < exact)
+    return exact;
+  return (uint64_t)estimate;
+}
@@ -0,0 +1,150 @@
+/**
+ * collectd - src/wt_compress.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include "wt_compress.h"
+
+int wt_compress_parse_type(const char *name) {
+  if (strcasecmp("none", name) == 0)
+    return WT_COMPRESS_NONE;
+#ifdef HAVE_ZLIB
+  if (strcasecmp("gzip", name) == 0)
+    return WT_COMPRESS_GZIP;
+  if (strcasecmp("deflate", name) == 0)
+    return WT_COMPRESS_DEFLATE;
+#endif
+  return -1;
+}
+
+const char *wt_compress_encoding(int type) {
+  switch (type) {
+  case WT_COMPRESS_GZIP:
+    return "gzip";
+  case WT_COMPRESS_DEFLATE:
+    return "deflate";
+  default:
+    return NULL;
+  }
+}
+
+int wt_compress_init(struct wt_compress *c, int type, int level) {
+  memset(c, 0, sizeof(*c));
+  c->type = type;
+  c->level = level;
+
+  if (type == WT_COMPRESS_NONE)
+    return 0;
+
+#ifdef HAVE_ZLIB
+  /* windowBits + 16 writes a gzip header and trailer instead of the zlib
+   * ones used by Content-Encoding: deflate */
+  if (deflateInit2(&c->stream, level, Z_DEFLATED,
+                   (type == WT_COMPRESS_GZIP) ? 15 + 16 : 15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  c->initialized = 1;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int wt_compress(struct wt_compress *c, const char *data, size_t len,
+                struct wt_strbuf *out) {
+#ifdef HAVE_ZLIB
+  int status;
+
+  wt_strbuf_reset(out);
+
+  if (!c->initialized)
+    return -EINVAL;
+
+  if (wt_strbuf_reserve(out, deflateBound(&c->stream, len)) != 0)
+    return -ENOMEM;
+
+  c->stream.next_in = (Bytef *)data;
+  c->stream.avail_in = len;
+  c->stream.next_out = (Bytef *)out->data;
+  c->stream.avail_out = out->size - 1;
+
+  status = deflate(&c->stream, Z_FINISH);
+  out->len = out->size - 1 - c->stream.avail_out;
+  out->data[out->len] = '\0';
+  deflateReset(&c->stream);
+
+  return (status == Z_STREAM_END) ? 0 : -1;
+#else
+  return -EINVAL;
+#endif
+}
+
+int wt_compress_read(struct wt_compress *c, const char *data, size_t len,
+                     size_t *consumed, char *out, size_t size,
+                     size_t *out_len) {
+#ifdef HAVE_ZLIB
+  int status;
+
+  *out_len = 0;
+  if (!c->initialized)
+    return -EINVAL;
+  if (c->finished)
+    return 0;
+
+  /* The whole body is at hand: Z_FINISH from the start, deflate() filling
+   * out on each call until the stream ends */
+  c->stream.next_in = (Bytef *)data + *consumed;
+  c->stream.avail_in = len - *consumed;
+  c->stream.next_out = (Bytef *)out;
+  c->stream.avail_out = size;
+
+  status = deflate(&c->stream, Z_FINISH);
+  *consumed = len - c->stream.avail_in;
+  *out_len = size - c->stream.avail_out;
+  if (status == Z_STREAM_END)
+    c->finished = 1;
+  else if (status != Z_OK && status != Z_BUF_ERROR)
+    return -1;
+
+  return 0;
+#else
+  *out_len = 0;
+  return -EINVAL;
+#endif
+}
+
+void wt_compress_rewind(struct wt_compress *c) {
+#ifdef HAVE_ZLIB
+  if (c->initialized)
+    deflateReset(&c->stream);
+  c->finished = 0;
+#endif
+}
+
+void wt_compress_free(struct wt_compress *c) {
+#ifdef HAVE_ZLIB
+  if (c->initialized)
+    deflateEnd(&c->stream);
+  c->initialized = 0;
+#endif
+}
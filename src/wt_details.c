@@ -0,0 +1,252 @@
+/**
+ * collectd - src/wt_details.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json-c/json.h>
+
+#include "wt_details.h"
+
+/* Errors caused by the state of the TSD or of HBase rather than by the point
+ * Compared in lower case. */
+static const char *wt_details_retryable[] = {
+    "timed out", "timeout", "throttle", "hbase", "region", "unavailable",
+    "interrupted"};
+
+static _Bool wt_details_is_retryable(const char *error) {
+  char lower[256];
+  size_t i;
+
+  for (i = 0; error[i] != '\0' && i < sizeof(lower) - 1; i++)
+    lower[i] = (char)tolower((unsigned char)error[i]);
+  lower[i] = '\0';
+
+  for (i = 0; i < sizeof(wt_details_retryable) / sizeof(*wt_details_retryable);
+       i++) {
+    if (strstr(lower, wt_details_retryable[i]) != NULL)
+      return 1;
+  }
+  return 0;
+}
+
+static json_object *wt_details_point(json_tokener *tok, const char *body,
+                                     size_t body_len, const size_t *offsets,
+                                     int points, int i) {
+  // points are separated by ',' and the last one is followed by ']'
+  size_t end = (i + 1 < points) ? offsets[i + 1] - 1 : body_len - 1;
+
+  if (offsets[i] >= end || end > body_len)
+    return NULL;
+
+  json_tokener_reset(tok);
+  return json_tokener_parse_ex(tok, body + offsets[i], (int)(end - offsets[i]));
+}
+
+static const char *wt_details_string(json_object *obj, const char *key) {
+  json_object *val;
+
+  if (!json_object_object_get_ex(obj, key, &val))
+    return NULL;
+  return json_object_get_string(val);
+}
+
+/* Timestamp in seconds, whether given in seconds or milliseconds */
+static int64_t wt_details_seconds(json_object *obj) {
+  json_object *val;
+  double ts;
+
+  if (!json_object_object_get_ex(obj, "timestamp", &val))
+    return -1;
+  ts = json_object_get_double(val);
+  if (ts > 1e11)
+    ts /= 1000;
+  return (int64_t)ts;
+}
+
+static _Bool wt_details_match(json_object *point, json_object *dp) {
+  const char *metric = wt_details_string(point, "metric");
+  const char *dp_metric = wt_details_string(dp, "metric");
+  json_object *tags;
+  json_object *dp_tags;
+
+  if (metric == NULL || dp_metric == NULL || strcmp(metric, dp_metric) != 0)
+    return 0;
+  if (wt_details_seconds(point) != wt_details_seconds(dp))
+    return 0;
+
+  if (!json_object_object_get_ex(point, "tags", &tags) ||
+      !json_object_object_get_ex(dp, "tags", &dp_tags) ||
+      json_object_object_length(tags) != json_object_object_length(dp_tags))
+    return 0;
+
+  json_object_object_foreach(tags, key, val) {
+    const char *value = wt_details_string(dp_tags, key);
+
+    if (value == NULL || strcmp(value, json_object_get_string(val)) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+int wt_details_parse(const char *response, const char *body, size_t body_len,
+                     const size_t *offsets, int points, int *status,
+                     wt_details_invalid_cb invalid, void *ctx) {
+  json_object **parsed;
+  json_object *root;
+  json_object *errors;
+  json_tokener *tok;
+  int matched = 0;
+
+  if (response == NULL)
+    return -1;
+  root = json_tokener_parse(response);
+  if (root == NULL)
+    return -1;
+  if (!json_object_is_type(root, json_type_object) ||
+      !json_object_object_get_ex(root, "errors", &errors) ||
+      !json_object_is_type(errors, json_type_array)) {
+    json_object_put(root);
+    return -1;
+  }
+
+  // our points are parsed on first use, most batches have few errors
+  parsed = calloc(points, sizeof(*parsed));
+  tok = json_tokener_new();
+  if (parsed == NULL || tok == NULL) {
+    free(parsed);
+    if (tok != NULL)
+      json_tokener_free(tok);
+    json_object_put(root);
+    return -1;
+  }
+
+  for (int i = 0; i < points; i++)
+    status[i] = WT_POINT_OK;
+
+  for (size_t e = 0; e < json_object_array_length(errors); e++) {
+    json_object *err = json_object_array_get_idx(errors, e);
+    const char *error;
+    json_object *dp;
+
+    if (err == NULL || !json_object_object_get_ex(err, "datapoint", &dp))
+      continue;
+    error = wt_details_string(err, "error");
+    if (error == NULL)
+      error = "unknown error";
+
+    for (int i = 0; i < points; i++) {
+      if (status[i] != WT_POINT_OK)
+        continue;
+      if (parsed[i] == NULL)
+        parsed[i] = wt_details_point(tok, body, body_len, offsets, points, i);
+      if (parsed[i] == NULL || !wt_details_match(parsed[i], dp))
+        continue;
+
+      if (wt_details_is_retryable(error)) {
+        status[i] = WT_POINT_RETRY;
+      } else {
+        status[i] = WT_POINT_INVALID;
+        if (invalid != NULL)
+          invalid(ctx, wt_details_string(parsed[i], "metric"), error);
+      }
+      matched++;
+      break;
+    }
+  }
+
+  for (int i = 0; i < points; i++) {
+    if (parsed[i] != NULL)
+      json_object_put(parsed[i]);
+  }
+  free(parsed);
+  json_tokener_free(tok);
+  json_object_put(root);
+
+  return matched;
+}
+
+int wt_details_point_metric(const char *body, size_t body_len,
+                            const size_t *offsets, int points, int i,
+                            char *buf, size_t size) {
+  json_tokener *tok = json_tokener_new();
+  json_object *point;
+  const char *metric = NULL;
+
+  if (tok == NULL)
+    return -1;
+  point = wt_details_point(tok, body, body_len, offsets, points, i);
+  if (point != NULL)
+    metric = wt_details_string(point, "metric");
+  if (metric != NULL)
+    snprintf(buf, size, "%s", metric);
+  if (point != NULL)
+    json_object_put(point);
+  json_tokener_free(tok);
+
+  return (metric != NULL) ? 0 : -1;
+}
+
+int wt_details_offsets(const char *body, size_t body_len, size_t *offsets,
+                       int points) {
+  _Bool in_string = 0;
+  int depth = 0;
+  int found = 0;
+
+  if (body_len == 0 || body[0] != '[')
+    return -1;
+
+  for (size_t i = 0; i < body_len; i++) {
+    char c = body[i];
+
+    if (in_string) {
+      if (c == '\\')
+        i++;
+      else if (c == '"')
+        in_string = 0;
+      continue;
+    }
+
+    switch (c) {
+    case '"':
+      in_string = 1;
+      break;
+    case '{':
+    case '[':
+      if (depth == 1 && c == '{') {
+        if (found == points)
+          return -1;
+        offsets[found++] = i;
+      }
+      depth++;
+      break;
+    case '}':
+    case ']':
+      depth--;
+      break;
+    }
+  }
+
+  return (depth == 0 && !in_string) ? found : -1;
+}
@@ -0,0 +1,267 @@
+/**
+ * collectd - src/wt_hosttag.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json-c/json.h>
+
+#include "wt_hash.h"
+#include "wt_hosttag.h"
+#include "wt_strbuf.h"
+
+struct wt_hosttag {
+  uint64_t hash;
+  char *host;
+  // tags as consecutive key\0value\0 pairs, tags_num is -1 if not json
+  char *tags;
+  int tags_num;
+
+  struct wt_hosttag *hash_next;
+  struct wt_hosttag *lru_prev;
+  struct wt_hosttag *lru_next;
+};
+
+struct wt_hosttag_cache {
+  pthread_mutex_t lock;
+  struct wt_hosttag **buckets;
+  size_t buckets_num;
+  size_t entries;
+  size_t max_entries;
+  // most recently used first
+  struct wt_hosttag *lru_head;
+  struct wt_hosttag *lru_tail;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/* Parse host into consecutive key\0value\0 pairs
+ * Returns the number of tags, -1 if host is not a json object
+ */
+static int wt_hosttag_parse(const char *host, struct wt_strbuf *tags) {
+  json_object *host_tags = json_tokener_parse(host);
+  int num = 0;
+
+  if (host_tags == NULL)
+    return -1;
+  if (!json_object_is_type(host_tags, json_type_object)) {
+    json_object_put(host_tags);
+    return -1;
+  }
+
+  json_object_object_foreach(host_tags, key, val) {
+    const char *value = json_object_get_string(val);
+
+    if (value == NULL)
+      value = "";
+    if (wt_strbuf_append(tags, key, strlen(key) + 1) != 0 ||
+        wt_strbuf_append(tags, value, strlen(value) + 1) != 0) {
+      json_object_put(host_tags);
+      return -ENOMEM;
+    }
+    num++;
+  }
+  json_object_put(host_tags);
+
+  return num;
+}
+
+static int wt_hosttag_call(const char *tags, int tags_num,
+                           wt_hosttag_add_cb add, void *ctx) {
+  const char *ptr = tags;
+
+  if (tags_num < 0)
+    return -1;
+
+  for (int i = 0; i < tags_num; i++) {
+    const char *key = ptr;
+    const char *value = key + strlen(key) + 1;
+    int status;
+
+    ptr = value + strlen(value) + 1;
+    status = add(ctx, key, value);
+    if (status != 0)
+      return status;
+  }
+  return 0;
+}
+
+static void wt_hosttag_lru_unlink(struct wt_hosttag_cache *cache,
+                                  struct wt_hosttag *entry) {
+  if (entry->lru_prev != NULL)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+  if (entry->lru_next != NULL)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+static void wt_hosttag_lru_push(struct wt_hosttag_cache *cache,
+                                struct wt_hosttag *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head != NULL)
+    cache->lru_head->lru_prev = entry;
+  cache->lru_head = entry;
+  if (cache->lru_tail == NULL)
+    cache->lru_tail = entry;
+}
+
+static void wt_hosttag_evict(struct wt_hosttag_cache *cache) {
+  struct wt_hosttag *entry = cache->lru_tail;
+  struct wt_hosttag **it = &cache->buckets[entry->hash % cache->buckets_num];
+
+  while (*it != entry)
+    it = &(*it)->hash_next;
+  *it = entry->hash_next;
+
+  wt_hosttag_lru_unlink(cache, entry);
+  cache->entries--;
+  free(entry);
+}
+
+struct wt_hosttag_cache *wt_hosttag_cache_create(size_t max_entries) {
+  struct wt_hosttag_cache *cache;
+
+  if (max_entries < 1)
+    max_entries = 1;
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return NULL;
+
+  cache->max_entries = max_entries;
+  cache->buckets_num = (max_entries < 65536) ? max_entries : 65536;
+  cache->buckets = calloc(cache->buckets_num, sizeof(*cache->buckets));
+  if (cache->buckets == NULL) {
+    free(cache);
+    return NULL;
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+
+  return cache;
+}
+
+void wt_hosttag_cache_destroy(struct wt_hosttag_cache *cache) {
+  if (cache == NULL)
+    return;
+
+  while (cache->lru_head != NULL) {
+    struct wt_hosttag *next = cache->lru_head->lru_next;
+    free(cache->lru_head);
+    cache->lru_head = next;
+  }
+  free(cache->buckets);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+int wt_hosttag_cache_get(struct wt_hosttag_cache *cache, const char *host,
+                         wt_hosttag_add_cb add, void *ctx) {
+  struct wt_strbuf tags = WT_STRBUF_INIT;
+  struct wt_hosttag *entry;
+  struct wt_hosttag **bucket;
+  size_t host_len = strlen(host);
+  uint64_t hash;
+  int tags_num;
+  int status;
+
+  if (cache == NULL) {
+    tags_num = wt_hosttag_parse(host, &tags);
+    status = (tags_num == -ENOMEM) ? -ENOMEM
+                                   : wt_hosttag_call(tags.data, tags_num, add,
+                                                     ctx);
+    wt_strbuf_free(&tags);
+    return status;
+  }
+
+  hash = wt_hash_mix(wt_hash(host, host_len, WT_HASH_INIT));
+
+  pthread_mutex_lock(&cache->lock);
+  bucket = &cache->buckets[hash % cache->buckets_num];
+  for (entry = *bucket; entry != NULL; entry = entry->hash_next) {
+    if (entry->hash == hash && strcmp(entry->host, host) == 0)
+      break;
+  }
+
+  if (entry != NULL) {
+    cache->hits++;
+    if (cache->lru_head != entry) {
+      wt_hosttag_lru_unlink(cache, entry);
+      wt_hosttag_lru_push(cache, entry);
+    }
+    status = wt_hosttag_call(entry->tags, entry->tags_num, add, ctx);
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+  }
+  cache->misses++;
+
+  // Hosts are few and parsing is cheap enough to be done under the lock
+  tags_num = wt_hosttag_parse(host, &tags);
+  if (tags_num == -ENOMEM) {
+    pthread_mutex_unlock(&cache->lock);
+    wt_strbuf_free(&tags);
+    return -ENOMEM;
+  }
+
+  if (cache->entries >= cache->max_entries) {
+    wt_hosttag_evict(cache);
+    bucket = &cache->buckets[hash % cache->buckets_num];
+  }
+
+  // entry, host and tags in a single allocation
+  entry = malloc(sizeof(*entry) + host_len + 1 + tags.len);
+  if (entry != NULL) {
+    entry->hash = hash;
+    entry->host = (char *)(entry + 1);
+    memcpy(entry->host, host, host_len + 1);
+    entry->tags = entry->host + host_len + 1;
+    if (tags.len > 0)
+      memcpy(entry->tags, tags.data, tags.len);
+    entry->tags_num = tags_num;
+
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    wt_hosttag_lru_push(cache, entry);
+    cache->entries++;
+  }
+
+  status = wt_hosttag_call(tags.data, tags_num, add, ctx);
+  pthread_mutex_unlock(&cache->lock);
+  wt_strbuf_free(&tags);
+
+  return status;
+}
+
+void wt_hosttag_cache_stats(struct wt_hosttag_cache *cache, uint64_t *hits,
+                            uint64_t *misses, size_t *entries) {
+  pthread_mutex_lock(&cache->lock);
+  *hits = cache->hits;
+  *misses = cache->misses;
+  *entries = cache->entries;
+  pthread_mutex_unlock(&cache->lock);
+}
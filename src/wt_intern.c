@@ -0,0 +1,176 @@
+/**
+ * collectd - src/wt_intern.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wt_hash.h"
+#include "wt_intern.h"
+
+#ifndef WT_INTERN_BUCKETS
+#define WT_INTERN_BUCKETS 256
+#endif
+
+struct wt_intern_entry {
+  struct wt_intern_entry *next;
+  uint64_t hash;
+  size_t len;
+  size_t refs;
+  char data[];
+};
+
+struct wt_intern {
+  pthread_mutex_t lock;
+  struct wt_intern_entry **buckets;
+  size_t buckets_num;
+  size_t entries;
+};
+
+struct wt_intern *wt_intern_create(void) {
+  struct wt_intern *table = calloc(1, sizeof(*table));
+
+  if (table == NULL)
+    return NULL;
+
+  table->buckets_num = WT_INTERN_BUCKETS;
+  table->buckets = calloc(table->buckets_num, sizeof(*table->buckets));
+  if (table->buckets == NULL) {
+    free(table);
+    return NULL;
+  }
+  pthread_mutex_init(&table->lock, NULL);
+  return table;
+}
+
+void wt_intern_destroy(struct wt_intern *table) {
+  if (table == NULL)
+    return;
+
+  for (size_t i = 0; i < table->buckets_num; i++) {
+    while (table->buckets[i] != NULL) {
+      struct wt_intern_entry *next = table->buckets[i]->next;
+      free(table->buckets[i]);
+      table->buckets[i] = next;
+    }
+  }
+  free(table->buckets);
+  pthread_mutex_destroy(&table->lock);
+  free(table);
+}
+
+static struct wt_intern_entry *wt_intern_entry(const char *str) {
+  return (struct wt_intern_entry *)(str -
+                                    offsetof(struct wt_intern_entry, data));
+}
+
+/* Double the buckets once the chains get longer than 2 on average,
+ * keeping the old ones if the allocation fails
+ */
+static void wt_intern_grow(struct wt_intern *table) {
+  size_t buckets_num = 2 * table->buckets_num;
+  struct wt_intern_entry **buckets = calloc(buckets_num, sizeof(*buckets));
+
+  if (buckets == NULL)
+    return;
+
+  for (size_t i = 0; i < table->buckets_num; i++) {
+    while (table->buckets[i] != NULL) {
+      struct wt_intern_entry *entry = table->buckets[i];
+      struct wt_intern_entry **bucket = &buckets[entry->hash % buckets_num];
+
+      table->buckets[i] = entry->next;
+      entry->next = *bucket;
+      *bucket = entry;
+    }
+  }
+  free(table->buckets);
+  table->buckets = buckets;
+  table->buckets_num = buckets_num;
+}
+
+const char *wt_intern_get(struct wt_intern *table, const char *data,
+                          size_t len) {
+  uint64_t hash = wt_hash_mix(wt_hash(data, len, WT_HASH_INIT));
+  struct wt_intern_entry **bucket;
+  struct wt_intern_entry *entry;
+
+  pthread_mutex_lock(&table->lock);
+
+  bucket = &table->buckets[hash % table->buckets_num];
+  for (entry = *bucket; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && entry->len == len &&
+        memcmp(entry->data, data, len) == 0) {
+      entry->refs++;
+      pthread_mutex_unlock(&table->lock);
+      return entry->data;
+    }
+  }
+
+  entry = malloc(sizeof(*entry) + len + 1);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&table->lock);
+    return NULL;
+  }
+  entry->hash = hash;
+  entry->len = len;
+  entry->refs = 1;
+  memcpy(entry->data, data, len);
+  entry->data[len] = '\0';
+
+  if (table->entries >= 2 * table->buckets_num) {
+    wt_intern_grow(table);
+    bucket = &table->buckets[hash % table->buckets_num];
+  }
+  entry->next = *bucket;
+  *bucket = entry;
+  table->entries++;
+
+  pthread_mutex_unlock(&table->lock);
+  return entry->data;
+}
+
+void wt_intern_put(struct wt_intern *table, const char *str) {
+  struct wt_intern_entry *entry;
+  struct wt_intern_entry **it;
+
+  if (str == NULL)
+    return;
+
+  entry = wt_intern_entry(str);
+
+  pthread_mutex_lock(&table->lock);
+  if (--entry->refs > 0) {
+    pthread_mutex_unlock(&table->lock);
+    return;
+  }
+
+  it = &table->buckets[entry->hash % table->buckets_num];
+  while (*it != entry)
+    it = &(*it)->next;
+  *it = entry->next;
+  table->entries--;
+  pthread_mutex_unlock(&table->lock);
+
+  free(entry);
+}
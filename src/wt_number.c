@@ -0,0 +1,76 @@
+/**
+ * collectd - src/wt_number.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wt_number.h"
+
+/* Doubles up to 2^53 in magnitude are exact integers when integral */
+#define WT_NUMBER_EXACT 9007199254740992.0
+
+size_t wt_number_format_uint(char *buf, uint64_t value) {
+  char digits[WT_NUMBER_SIZE];
+  size_t len = 0;
+
+  do {
+    digits[len++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  for (size_t i = 0; i < len; i++)
+    buf[i] = digits[len - 1 - i];
+  buf[len] = '\0';
+  return len;
+}
+
+size_t wt_number_format_int(char *buf, int64_t value) {
+  if (value >= 0)
+    return wt_number_format_uint(buf, (uint64_t)value);
+
+  // negated as unsigned so that INT64_MIN does not overflow
+  buf[0] = '-';
+  return 1 + wt_number_format_uint(buf + 1, -(uint64_t)value);
+}
+
+size_t wt_number_format_double(char *buf, double value) {
+  int len;
+
+  if (!isfinite(value)) {
+    buf[0] = '\0';
+    return 0;
+  }
+
+  // gauges are mostly integral: no need for printf and strtod
+  if (value == trunc(value) && fabs(value) < WT_NUMBER_EXACT)
+    return wt_number_format_int(buf, (int64_t)value);
+
+  // 15 significant digits are exact for most values, 17 always are
+  for (int precision = 15; precision < 17; precision++) {
+    len = snprintf(buf, WT_NUMBER_SIZE, "%.*g", precision, value);
+    if (strtod(buf, NULL) == value)
+      return (size_t)len;
+  }
+  len = snprintf(buf, WT_NUMBER_SIZE, "%.17g", value);
+  return (size_t)len;
+}
@@ -0,0 +1,126 @@
+/**
+ * collectd - src/wt_ring.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wt_hash.h"
+#include "wt_ring.h"
+
+static int wt_ring_point_cmp(const void *a, const void *b) {
+  const struct wt_ring_point *pa = a;
+  const struct wt_ring_point *pb = b;
+
+  if (pa->hash != pb->hash)
+    return (pa->hash < pb->hash) ? -1 : 1;
+  return pa->endpoint - pb->endpoint;
+}
+
+int wt_ring_init(struct wt_ring *ring, char *const *names, int endpoints_num) {
+  size_t n = 0;
+
+  ring->points_num = 0;
+  ring->endpoints_num = endpoints_num;
+  ring->points =
+      calloc((size_t)endpoints_num * WT_RING_REPLICAS, sizeof(*ring->points));
+  if (ring->points == NULL)
+    return -ENOMEM;
+
+  for (int i = 0; i < endpoints_num; i++) {
+    for (int r = 0; r < WT_RING_REPLICAS; r++) {
+      char replica[16];
+      uint64_t hash = wt_hash(names[i], strlen(names[i]), WT_HASH_INIT);
+
+      snprintf(replica, sizeof(replica), "#%d", r);
+      hash = wt_hash(replica, strlen(replica), hash);
+      ring->points[n].hash = wt_hash_mix(hash);
+      ring->points[n].endpoint = i;
+      n++;
+    }
+  }
+  ring->points_num = n;
+
+  qsort(ring->points, n, sizeof(*ring->points), wt_ring_point_cmp);
+  return 0;
+}
+
+void wt_ring_free(struct wt_ring *ring) {
+  free(ring->points);
+  ring->points = NULL;
+  ring->points_num = 0;
+}
+
+int wt_ring_lookup(const struct wt_ring *ring, uint64_t hash,
+                   const _Bool *up) {
+  size_t lo = 0;
+  size_t hi = ring->points_num;
+  size_t start;
+
+  if (ring->endpoints_num <= 1 || ring->points_num == 0)
+    return 0;
+
+  // first point whose hash is >= hash, wrapping around
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ring->points[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  start = (lo == ring->points_num) ? 0 : lo;
+
+  if (up == NULL || up[ring->points[start].endpoint])
+    return ring->points[start].endpoint;
+
+  for (size_t i = 1; i < ring->points_num; i++) {
+    const struct wt_ring_point *point =
+        &ring->points[(start + i) % ring->points_num];
+    if (up[point->endpoint])
+      return point->endpoint;
+  }
+
+  return ring->points[start].endpoint;
+}
+
+int wt_ring_successor(const struct wt_ring *ring, int endpoint,
+                      const _Bool *up) {
+  size_t start;
+
+  if (up == NULL || up[endpoint])
+    return endpoint;
+
+  for (start = 0; start < ring->points_num; start++)
+    if (ring->points[start].endpoint == endpoint)
+      break;
+  if (start == ring->points_num)
+    return endpoint;
+
+  for (size_t i = 1; i < ring->points_num; i++) {
+    const struct wt_ring_point *point =
+        &ring->points[(start + i) % ring->points_num];
+    if (up[point->endpoint])
+      return point->endpoint;
+  }
+
+  return endpoint;
+}
@@ -0,0 +1,194 @@
+/**
+ * collectd - src/wt_rules.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wt_hash.h"
+#include "wt_rules.h"
+
+#ifndef WT_RULES_BUCKETS
+#define WT_RULES_BUCKETS 64
+#endif
+
+struct wt_rules {
+  // rules matching a plugin by name, by hash of the name
+  struct wt_rule *buckets[WT_RULES_BUCKETS];
+  // rules matching plugins by regex, in order
+  struct wt_rule *patterns;
+};
+
+struct wt_rule *wt_rule_create(void) {
+  return calloc(1, sizeof(struct wt_rule));
+}
+
+static void wt_rule_pattern_free(struct wt_rule_pattern *pattern) {
+  if (pattern->is_regex)
+    regfree(&pattern->regex);
+  free(pattern->name);
+  pattern->name = NULL;
+  pattern->is_regex = 0;
+}
+
+void wt_rule_free(struct wt_rule *rule) {
+  if (rule == NULL)
+    return;
+
+  wt_rule_pattern_free(&rule->plugin);
+  wt_rule_pattern_free(&rule->type);
+  free(rule->prefix);
+  free(rule->id);
+  for (int i = 0; i < WT_RULE_TAGS; i++)
+    free(rule->tag[i]);
+  for (int i = 0; i < rule->add_num; i++) {
+    free(rule->add[i].key);
+    free(rule->add[i].value);
+  }
+  free(rule->add);
+  free(rule);
+}
+
+int wt_rule_pattern_set(struct wt_rule_pattern *pattern, const char *str) {
+  size_t len = strlen(str);
+
+  wt_rule_pattern_free(pattern);
+
+  if (len >= 2 && str[0] == '/' && str[len - 1] == '/') {
+    pattern->name = strndup(str + 1, len - 2);
+    if (pattern->name == NULL)
+      return -ENOMEM;
+    if (regcomp(&pattern->regex, pattern->name, REG_EXTENDED | REG_NOSUB) !=
+        0) {
+      free(pattern->name);
+      pattern->name = NULL;
+      return -EINVAL;
+    }
+    pattern->is_regex = 1;
+    return 0;
+  }
+
+  pattern->name = strdup(str);
+  return (pattern->name == NULL) ? -ENOMEM : 0;
+}
+
+static _Bool wt_rule_pattern_match(const struct wt_rule_pattern *pattern,
+                                   const char *str) {
+  if (pattern->name == NULL)
+    return 1;
+  if (pattern->is_regex)
+    return regexec(&pattern->regex, str, 0, NULL, 0) == 0;
+  return strcmp(pattern->name, str) == 0;
+}
+
+int wt_rule_add_tag(struct wt_rule *rule, const char *key, const char *value) {
+  struct wt_rule_tag *tmp;
+  char *copy = strdup(value);
+
+  if (copy == NULL)
+    return -ENOMEM;
+
+  for (int i = 0; i < rule->add_num; i++) {
+    if (strcmp(rule->add[i].key, key) == 0) {
+      free(rule->add[i].value);
+      rule->add[i].value = copy;
+      return 0;
+    }
+  }
+
+  tmp = realloc(rule->add, (rule->add_num + 1) * sizeof(*tmp));
+  if (tmp == NULL) {
+    free(copy);
+    return -ENOMEM;
+  }
+  rule->add = tmp;
+  rule->add[rule->add_num].key = strdup(key);
+  if (rule->add[rule->add_num].key == NULL) {
+    free(copy);
+    return -ENOMEM;
+  }
+  rule->add[rule->add_num].value = copy;
+  rule->add_num++;
+
+  return 0;
+}
+
+struct wt_rules *wt_rules_create(void) {
+  return calloc(1, sizeof(struct wt_rules));
+}
+
+static void wt_rules_free_list(struct wt_rule *rule) {
+  while (rule != NULL) {
+    struct wt_rule *next = rule->next;
+    wt_rule_free(rule);
+    rule = next;
+  }
+}
+
+void wt_rules_destroy(struct wt_rules *rules) {
+  if (rules == NULL)
+    return;
+
+  for (int i = 0; i < WT_RULES_BUCKETS; i++)
+    wt_rules_free_list(rules->buckets[i]);
+  wt_rules_free_list(rules->patterns);
+  free(rules);
+}
+
+static size_t wt_rules_bucket(const char *plugin) {
+  return wt_hash_mix(wt_hash(plugin, strlen(plugin), WT_HASH_INIT)) %
+         WT_RULES_BUCKETS;
+}
+
+void wt_rules_add(struct wt_rules *rules, struct wt_rule *rule) {
+  struct wt_rule **it;
+
+  if (rule->plugin.is_regex)
+    it = &rules->patterns;
+  else
+    it = &rules->buckets[wt_rules_bucket(rule->plugin.name)];
+
+  // keep the configuration order, the first match wins
+  while (*it != NULL)
+    it = &(*it)->next;
+  rule->next = NULL;
+  *it = rule;
+}
+
+const struct wt_rule *wt_rules_match(const struct wt_rules *rules,
+                                     const char *plugin, const char *type) {
+  const struct wt_rule *rule;
+
+  for (rule = rules->buckets[wt_rules_bucket(plugin)]; rule != NULL;
+       rule = rule->next) {
+    if (strcmp(rule->plugin.name, plugin) == 0 &&
+        wt_rule_pattern_match(&rule->type, type))
+      return rule;
+  }
+
+  for (rule = rules->patterns; rule != NULL; rule = rule->next) {
+    if (wt_rule_pattern_match(&rule->plugin, plugin) &&
+        wt_rule_pattern_match(&rule->type, type))
+      return rule;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,318 @@
+/**
+ * collectd - src/wt_series.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wt_hash.h"
+#include "wt_intern.h"
+#include "wt_series.h"
+
+#ifndef WT_SERIES_SHARDS
+#define WT_SERIES_SHARDS 16
+#endif
+
+struct wt_series_shard {
+  pthread_mutex_t lock;
+  struct wt_series **buckets;
+  size_t buckets_num;
+  size_t entries;
+  size_t max_entries;
+  // most recently used first
+  struct wt_series *lru_head;
+  struct wt_series *lru_tail;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct wt_series_cache {
+  struct wt_series_shard shard[WT_SERIES_SHARDS];
+  // tails of the series
+  struct wt_intern *tails;
+  // called on the series evicted from a full shard
+  void (*evict)(struct wt_series *series, void *ctx);
+  void *evict_ctx;
+};
+
+static struct wt_series_shard *wt_series_shard(struct wt_series_cache *cache,
+                                               uint64_t hash) {
+  return &cache->shard[hash % WT_SERIES_SHARDS];
+}
+
+static void wt_series_lru_unlink(struct wt_series_shard *shard,
+                                 struct wt_series *entry) {
+  if (entry->lru_prev != NULL)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    shard->lru_head = entry->lru_next;
+  if (entry->lru_next != NULL)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    shard->lru_tail = entry->lru_prev;
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+static void wt_series_lru_push(struct wt_series_shard *shard,
+                               struct wt_series *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head != NULL)
+    shard->lru_head->lru_prev = entry;
+  shard->lru_head = entry;
+  if (shard->lru_tail == NULL)
+    shard->lru_tail = entry;
+}
+
+static void wt_series_remove(struct wt_series_cache *cache,
+                             struct wt_series_shard *shard,
+                             struct wt_series *entry) {
+  struct wt_series **it =
+      &shard->buckets[(entry->hash / WT_SERIES_SHARDS) % shard->buckets_num];
+
+  while (*it != entry)
+    it = &(*it)->hash_next;
+  *it = entry->hash_next;
+
+  wt_series_lru_unlink(shard, entry);
+  shard->entries--;
+  wt_intern_put(cache->tails, entry->tail);
+  free(entry);
+}
+
+struct wt_series_cache *
+wt_series_cache_create(size_t max_entries,
+                       void (*evict)(struct wt_series *series, void *ctx),
+                       void *ctx) {
+  struct wt_series_cache *cache;
+  size_t shard_max = max_entries / WT_SERIES_SHARDS;
+
+  if (shard_max < 1)
+    shard_max = 1;
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return NULL;
+  cache->tails = wt_intern_create();
+  if (cache->tails == NULL) {
+    free(cache);
+    return NULL;
+  }
+  cache->evict = evict;
+  cache->evict_ctx = ctx;
+
+  for (int i = 0; i < WT_SERIES_SHARDS; i++) {
+    struct wt_series_shard *shard = &cache->shard[i];
+
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->max_entries = shard_max;
+    // keep chains short without over-allocating for huge limits
+    shard->buckets_num = (shard_max < 65536) ? shard_max : 65536;
+    shard->buckets = calloc(shard->buckets_num, sizeof(*shard->buckets));
+    if (shard->buckets == NULL) {
+      for (int j = 0; j <= i; j++)
+        pthread_mutex_destroy(&cache->shard[j].lock);
+      for (int j = 0; j < i; j++)
+        free(cache->shard[j].buckets);
+      wt_intern_destroy(cache->tails);
+      free(cache);
+      return NULL;
+    }
+  }
+
+  return cache;
+}
+
+void wt_series_cache_destroy(struct wt_series_cache *cache) {
+  if (cache == NULL)
+    return;
+
+  for (int i = 0; i < WT_SERIES_SHARDS; i++) {
+    struct wt_series_shard *shard = &cache->shard[i];
+
+    while (shard->lru_head != NULL) {
+      struct wt_series *next = shard->lru_head->lru_next;
+      wt_intern_put(cache->tails, shard->lru_head->tail);
+      free(shard->lru_head);
+      shard->lru_head = next;
+    }
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  wt_intern_destroy(cache->tails);
+  free(cache);
+}
+
+size_t wt_series_key(char *buffer, size_t buffer_size, const char *host,
+                     const char *plugin, const char *plugin_instance,
+                     const char *type, const char *type_instance,
+                     const char *ds_name, uint64_t fingerprint) {
+  const char *fields[] = {host, plugin, plugin_instance, type, type_instance,
+                          (ds_name != NULL) ? ds_name : ""};
+  size_t offset = 0;
+
+  for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+    size_t len = strlen(fields[i]) + 1;
+
+    if (offset + len > buffer_size)
+      return 0;
+    memcpy(buffer + offset, fields[i], len);
+    offset += len;
+  }
+
+  // ds_name NULL and "" are different series: NULL is not appended to metric
+  if (offset + 1 + sizeof(fingerprint) > buffer_size)
+    return 0;
+  buffer[offset++] = (ds_name != NULL) ? 1 : 0;
+  memcpy(buffer + offset, &fingerprint, sizeof(fingerprint));
+  offset += sizeof(fingerprint);
+
+  return offset;
+}
+
+static struct wt_series *wt_series_lookup(struct wt_series_shard *shard,
+                                          const char *key, size_t key_len,
+                                          uint64_t hash) {
+  struct wt_series *entry =
+      shard->buckets[(hash / WT_SERIES_SHARDS) % shard->buckets_num];
+
+  for (; entry != NULL; entry = entry->hash_next) {
+    if (entry->hash == hash && entry->key_len == key_len &&
+        memcmp(entry->key, key, key_len) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+struct wt_series *wt_series_cache_get(struct wt_series_cache *cache,
+                                      const char *key, size_t key_len,
+                                      uint64_t hash) {
+  struct wt_series_shard *shard = wt_series_shard(cache, hash);
+  struct wt_series *entry;
+
+  pthread_mutex_lock(&shard->lock);
+
+  entry = wt_series_lookup(shard, key, key_len, hash);
+  if (entry == NULL) {
+    shard->misses++;
+    return NULL;
+  }
+
+  shard->hits++;
+  if (shard->lru_head != entry) {
+    wt_series_lru_unlink(shard, entry);
+    wt_series_lru_push(shard, entry);
+  }
+  return entry;
+}
+
+struct wt_series *wt_series_cache_insert(struct wt_series_cache *cache,
+                                         const char *key, size_t key_len,
+                                         uint64_t hash, const char *head,
+                                         size_t head_len, const char *tail,
+                                         size_t tail_len) {
+  struct wt_series_shard *shard = wt_series_shard(cache, hash);
+  struct wt_series **bucket;
+  struct wt_series *entry;
+
+  pthread_mutex_lock(&shard->lock);
+
+  entry = wt_series_lookup(shard, key, key_len, hash);
+  if (entry != NULL)
+    return entry;
+
+  if (shard->entries >= shard->max_entries) {
+    if (cache->evict != NULL)
+      cache->evict(shard->lru_tail, cache->evict_ctx);
+    wt_series_remove(cache, shard, shard->lru_tail);
+  }
+
+  // entry, key and head in a single allocation
+  entry = malloc(sizeof(*entry) + key_len + head_len + 1);
+  if (entry == NULL)
+    return NULL;
+  entry->tail = wt_intern_get(cache->tails, tail, tail_len);
+  if (entry->tail == NULL) {
+    free(entry);
+    return NULL;
+  }
+
+  entry->hash = hash;
+  entry->key = (char *)(entry + 1);
+  entry->key_len = key_len;
+  memcpy(entry->key, key, key_len);
+  entry->head = entry->key + key_len;
+  entry->head_len = head_len;
+  memcpy(entry->head, head, head_len);
+  entry->head[head_len] = '\0';
+  entry->tail_len = tail_len;
+  entry->route = 0;
+  entry->aggregate = -1;
+  entry->limited = 0;
+  memset(&entry->agg, 0, sizeof(entry->agg));
+  entry->ident = 0;
+  entry->sent = 0;
+  entry->rate_set = 0;
+
+  bucket = &shard->buckets[(hash / WT_SERIES_SHARDS) % shard->buckets_num];
+  entry->hash_next = *bucket;
+  *bucket = entry;
+  wt_series_lru_push(shard, entry);
+  shard->entries++;
+
+  return entry;
+}
+
+void wt_series_cache_foreach(struct wt_series_cache *cache,
+                             void (*fn)(struct wt_series *series, void *ctx),
+                             void *ctx) {
+  for (int i = 0; i < WT_SERIES_SHARDS; i++) {
+    struct wt_series_shard *shard = &cache->shard[i];
+
+    pthread_mutex_lock(&shard->lock);
+    for (struct wt_series *entry = shard->lru_head; entry != NULL;
+         entry = entry->lru_next)
+      fn(entry, ctx);
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void wt_series_cache_release(struct wt_series_cache *cache, uint64_t hash) {
+  pthread_mutex_unlock(&wt_series_shard(cache, hash)->lock);
+}
+
+void wt_series_cache_stats(struct wt_series_cache *cache, uint64_t *hits,
+                           uint64_t *misses, size_t *entries) {
+  *hits = 0;
+  *misses = 0;
+  *entries = 0;
+
+  for (int i = 0; i < WT_SERIES_SHARDS; i++) {
+    struct wt_series_shard *shard = &cache->shard[i];
+
+    pthread_mutex_lock(&shard->lock);
+    *hits += shard->hits;
+    *misses += shard->misses;
+    *entries += shard->entries;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
@@ -0,0 +1,469 @@
+/**
+ * collectd - src/wt_spool.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "wt_spool.h"
+
+#define WT_SPOOL_MAGIC 0x50535457 /* "WTSP" */
+#define WT_SPOOL_SUFFIX ".spool"
+
+struct wt_spool_header {
+  uint32_t magic;
+  // CRC32 of the rest of the header and of the body
+  uint32_t crc;
+  uint32_t len;
+  int32_t points;
+  int32_t endpoint;
+};
+
+struct wt_spool_segment {
+  uint64_t seq;
+  uint64_t size;
+};
+
+struct wt_spool {
+  char *dir;
+  uint64_t max_size;
+  uint64_t segment_size;
+  pthread_mutex_t lock;
+
+  // segments on disk, oldest first
+  // the newest one is appended to while write_fd is open
+  struct wt_spool_segment *segments;
+  int segments_num;
+  int segments_size;
+  uint64_t next_seq;
+  uint64_t size;
+  int write_fd;
+
+  // read position in the oldest segment
+  int read_fd;
+  uint64_t read_offset;
+  // size of the record returned by the last peek, 0 if none
+  uint64_t peeked;
+
+  uint64_t dropped_bytes;
+  uint64_t corrupted;
+};
+
+static uint32_t wt_crc32_table[256];
+static pthread_once_t wt_crc32_once = PTHREAD_ONCE_INIT;
+
+static void wt_crc32_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    wt_crc32_table[i] = c;
+  }
+}
+
+static uint32_t wt_crc32(uint32_t crc, const void *data, size_t len) {
+  const unsigned char *p = data;
+
+  crc = ~crc;
+  while (len-- > 0)
+    crc = wt_crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t wt_spool_crc(const struct wt_spool_header *h,
+                             const char *data) {
+  size_t offset = offsetof(struct wt_spool_header, len);
+  uint32_t crc = wt_crc32(0, (const char *)h + offset, sizeof(*h) - offset);
+
+  return wt_crc32(crc, data, h->len);
+}
+
+static void wt_spool_path(const struct wt_spool *spool, uint64_t seq,
+                          char *buf, size_t size) {
+  snprintf(buf, size, "%s/%016" PRIx64 WT_SPOOL_SUFFIX, spool->dir, seq);
+}
+
+static int wt_spool_segment_cmp(const void *a, const void *b) {
+  const struct wt_spool_segment *sa = a;
+  const struct wt_spool_segment *sb = b;
+
+  return (sa->seq > sb->seq) - (sa->seq < sb->seq);
+}
+
+static int wt_spool_segment_add(struct wt_spool *spool, uint64_t seq,
+                                uint64_t size) {
+  if (spool->segments_num == spool->segments_size) {
+    int new_size = spool->segments_size ? spool->segments_size * 2 : 16;
+    struct wt_spool_segment *segments;
+
+    segments = realloc(spool->segments, new_size * sizeof(*segments));
+    if (segments == NULL)
+      return -ENOMEM;
+    spool->segments = segments;
+    spool->segments_size = new_size;
+  }
+
+  spool->segments[spool->segments_num].seq = seq;
+  spool->segments[spool->segments_num].size = size;
+  spool->segments_num++;
+  spool->size += size;
+  if (seq >= spool->next_seq)
+    spool->next_seq = seq + 1;
+  return 0;
+}
+
+static void wt_spool_close_write(struct wt_spool *spool) {
+  if (spool->write_fd < 0)
+    return;
+  fdatasync(spool->write_fd);
+  close(spool->write_fd);
+  spool->write_fd = -1;
+}
+
+/* Must be called with spool->lock held */
+static int wt_spool_new_segment(struct wt_spool *spool) {
+  char path[PATH_MAX];
+  int status;
+  int fd;
+
+  wt_spool_path(spool, spool->next_seq, path, sizeof(path));
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -errno;
+
+  status = wt_spool_segment_add(spool, spool->next_seq, 0);
+  if (status != 0) {
+    close(fd);
+    unlink(path);
+    return status;
+  }
+  spool->write_fd = fd;
+  return 0;
+}
+
+/* Must be called with spool->lock held */
+static void wt_spool_remove_oldest(struct wt_spool *spool) {
+  char path[PATH_MAX];
+
+  if (spool->read_fd >= 0) {
+    close(spool->read_fd);
+    spool->read_fd = -1;
+  }
+  if (spool->segments_num == 1)
+    wt_spool_close_write(spool);
+
+  wt_spool_path(spool, spool->segments[0].seq, path, sizeof(path));
+  unlink(path);
+
+  spool->size -= spool->segments[0].size;
+  spool->segments_num--;
+  memmove(spool->segments, spool->segments + 1,
+          spool->segments_num * sizeof(*spool->segments));
+  spool->read_offset = 0;
+  spool->peeked = 0;
+}
+
+struct wt_spool *wt_spool_open(const char *dir, uint64_t max_size,
+                               uint64_t segment_size) {
+  struct wt_spool *spool;
+  struct dirent *de;
+  DIR *d;
+
+  pthread_once(&wt_crc32_once, wt_crc32_init);
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    return NULL;
+
+  spool = calloc(1, sizeof(*spool));
+  if (spool == NULL)
+    return NULL;
+  spool->dir = strdup(dir);
+  if (spool->dir == NULL) {
+    free(spool);
+    errno = ENOMEM;
+    return NULL;
+  }
+  spool->max_size = max_size;
+  spool->segment_size = segment_size;
+  spool->write_fd = -1;
+  spool->read_fd = -1;
+  pthread_mutex_init(&spool->lock, NULL);
+
+  d = opendir(dir);
+  if (d == NULL) {
+    int err = errno;
+    wt_spool_close(spool);
+    errno = err;
+    return NULL;
+  }
+
+  while ((de = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    struct stat st;
+    char *end;
+    uint64_t seq;
+
+    if (de->d_name[0] == '.')
+      continue;
+    errno = 0;
+    seq = strtoull(de->d_name, &end, 16);
+    if (errno != 0 || end == de->d_name || strcmp(end, WT_SPOOL_SUFFIX) != 0)
+      continue;
+
+    wt_spool_path(spool, seq, path, sizeof(path));
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    if (wt_spool_segment_add(spool, seq, (uint64_t)st.st_size) != 0) {
+      closedir(d);
+      wt_spool_close(spool);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+  closedir(d);
+
+  if (spool->segments_num > 1)
+    qsort(spool->segments, spool->segments_num, sizeof(*spool->segments),
+          wt_spool_segment_cmp);
+
+  return spool;
+}
+
+void wt_spool_close(struct wt_spool *spool) {
+  if (spool == NULL)
+    return;
+
+  wt_spool_close_write(spool);
+  if (spool->read_fd >= 0)
+    close(spool->read_fd);
+  pthread_mutex_destroy(&spool->lock);
+  free(spool->segments);
+  free(spool->dir);
+  free(spool);
+}
+
+int wt_spool_append(struct wt_spool *spool, const char *data, size_t len,
+                    int points, int endpoint) {
+  struct wt_spool_header h = {.magic = WT_SPOOL_MAGIC,
+                              .len = (uint32_t)len,
+                              .points = points,
+                              .endpoint = endpoint};
+  uint64_t rec_size = sizeof(h) + len;
+  struct wt_spool_segment *seg;
+  struct iovec iov[2];
+  ssize_t n;
+  int status = 0;
+
+  if (len > UINT32_MAX || rec_size > spool->max_size)
+    return -EFBIG;
+  h.crc = wt_spool_crc(&h, data);
+
+  pthread_mutex_lock(&spool->lock);
+
+  // make room by dropping the oldest records
+  while (spool->segments_num > 0 &&
+         spool->size + rec_size > spool->max_size) {
+    spool->dropped_bytes += spool->segments[0].size;
+    wt_spool_remove_oldest(spool);
+  }
+
+  if (spool->write_fd >= 0 &&
+      spool->segments[spool->segments_num - 1].size + rec_size >
+          spool->segment_size)
+    wt_spool_close_write(spool);
+
+  if (spool->write_fd < 0) {
+    status = wt_spool_new_segment(spool);
+    if (status != 0) {
+      pthread_mutex_unlock(&spool->lock);
+      return status;
+    }
+  }
+  seg = &spool->segments[spool->segments_num - 1];
+
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = len;
+  n = writev(spool->write_fd, iov, 2);
+  if (n < 0)
+    status = -errno;
+
+  if (n > 0) {
+    seg->size += (uint64_t)n;
+    spool->size += (uint64_t)n;
+  }
+  if ((uint64_t)n != rec_size) {
+    // the partial record is skipped as corrupted when read back
+    wt_spool_close_write(spool);
+    if (status == 0)
+      status = -EIO;
+  }
+
+  pthread_mutex_unlock(&spool->lock);
+  return status;
+}
+
+/* Read the record at the read position of the oldest segment
+ * Returns 0, 1 if the record is corrupted or a negative errno value.
+ * Must be called with spool->lock held
+ */
+static int wt_spool_read_record(struct wt_spool *spool,
+                                 const struct wt_spool_segment *seg,
+                                 struct wt_spool_header *h,
+                                 struct wt_strbuf *body) {
+  uint64_t left = seg->size - spool->read_offset;
+  ssize_t n;
+
+  if (left < sizeof(*h))
+    return 1;
+
+  n = pread(spool->read_fd, h, sizeof(*h), (off_t)spool->read_offset);
+  if (n < 0)
+    return -errno;
+  if ((size_t)n != sizeof(*h) || h->magic != WT_SPOOL_MAGIC ||
+      h->len > left - sizeof(*h))
+    return 1;
+
+  wt_strbuf_reset(body);
+  if (wt_strbuf_reserve(body, h->len) != 0)
+    return -ENOMEM;
+
+  n = pread(spool->read_fd, body->data, h->len,
+            (off_t)(spool->read_offset + sizeof(*h)));
+  if (n < 0)
+    return -errno;
+  if ((size_t)n != h->len || wt_spool_crc(h, body->data) != h->crc)
+    return 1;
+
+  body->len = h->len;
+  body->data[body->len] = '\0';
+  return 0;
+}
+
+int wt_spool_peek(struct wt_spool *spool, struct wt_strbuf *body, int *points,
+                  int *endpoint) {
+  struct wt_spool_header h;
+  int status;
+
+  pthread_mutex_lock(&spool->lock);
+  spool->peeked = 0;
+
+  while (1) {
+    struct wt_spool_segment *seg;
+    _Bool writing;
+
+    if (spool->segments_num == 0) {
+      status = 1;
+      break;
+    }
+    seg = &spool->segments[0];
+    writing = (spool->segments_num == 1 && spool->write_fd >= 0);
+
+    if (spool->read_offset >= seg->size) {
+      if (writing) {
+        status = 1;
+        break;
+      }
+      wt_spool_remove_oldest(spool);
+      continue;
+    }
+
+    if (spool->read_fd < 0) {
+      char path[PATH_MAX];
+
+      wt_spool_path(spool, seg->seq, path, sizeof(path));
+      spool->read_fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (spool->read_fd < 0) {
+        status = -errno;
+        if (status == -ENOENT) {
+          wt_spool_remove_oldest(spool);
+          continue;
+        }
+        break;
+      }
+    }
+
+    status = wt_spool_read_record(spool, seg, &h, body);
+    if (status == 0) {
+      *points = h.points;
+      *endpoint = h.endpoint;
+      spool->peeked = sizeof(h) + h.len;
+      break;
+    }
+    if (status < 0)
+      break;
+
+    // the next record cannot be found, skip the rest of the segment
+    spool->corrupted++;
+    if (writing)
+      wt_spool_close_write(spool);
+    spool->read_offset = seg->size;
+  }
+
+  pthread_mutex_unlock(&spool->lock);
+  return status;
+}
+
+void wt_spool_consume(struct wt_spool *spool) {
+  pthread_mutex_lock(&spool->lock);
+  spool->read_offset += spool->peeked;
+  spool->peeked = 0;
+  // remove a fully replayed segment right away, not on the next peek
+  if (spool->segments_num > 0 &&
+      spool->read_offset >= spool->segments[0].size &&
+      !(spool->segments_num == 1 && spool->write_fd >= 0))
+    wt_spool_remove_oldest(spool);
+  pthread_mutex_unlock(&spool->lock);
+}
+
+_Bool wt_spool_empty(struct wt_spool *spool) {
+  _Bool empty;
+
+  pthread_mutex_lock(&spool->lock);
+  empty = spool->segments_num == 0 ||
+          (spool->segments_num == 1 &&
+           spool->read_offset >= spool->segments[0].size);
+  pthread_mutex_unlock(&spool->lock);
+  return empty;
+}
+
+void wt_spool_stats(struct wt_spool *spool, struct wt_spool_stats *stats) {
+  pthread_mutex_lock(&spool->lock);
+  stats->size = spool->size;
+  stats->segments = spool->segments_num;
+  stats->dropped_bytes = spool->dropped_bytes;
+  stats->corrupted = spool->corrupted;
+  pthread_mutex_unlock(&spool->lock);
+}
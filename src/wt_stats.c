@@ -0,0 +1,70 @@
+/**
+ * collectd - src/wt_stats.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <stddef.h>
+
+#include "wt_stats.h"
+
+static const char *wt_stats_names[WT_STAT_MAX] = {
+    [WT_STAT_POINTS_QUEUED] = "points_queued",
+    [WT_STAT_POINTS_FILTERED] = "points_filtered",
+    [WT_STAT_POINTS_SENT] = "points_sent",
+    [WT_STAT_POINTS_RETRIED] = "points_retried",
+    [WT_STAT_POINTS_SPOOLED] = "points_spooled",
+    [WT_STAT_POINTS_REPLAYED] = "points_replayed",
+    [WT_STAT_POINTS_INVALID] = "points_invalid",
+    [WT_STAT_POINTS_DROPPED] = "points_dropped",
+    [WT_STAT_POINTS_OVER_LIMIT] = "points_over_limit",
+    [WT_STAT_POINTS_COLLAPSED] = "points_collapsed",
+    [WT_STAT_POINTS_TRIMMED] = "points_trimmed",
+    [WT_STAT_BATCHES_SENT] = "batches_sent",
+    [WT_STAT_BATCHES_FAILED] = "batches_failed",
+    [WT_STAT_BYTES_UNCOMPRESSED] = "bytes_uncompressed",
+    [WT_STAT_BYTES_SENT] = "bytes_sent",
+    [WT_STAT_LOCK_WAITS] = "lock_waits",
+    [WT_STAT_LOCK_WAIT_US] = "lock_wait_us",
+    [WT_STAT_LATENCY_US] = "latency_us"};
+
+static const uint64_t wt_stats_bounds[] = WT_STAT_LATENCY_BOUNDS;
+
+const char *wt_stats_name(int id) { return wt_stats_names[id]; }
+
+void wt_stats_latency(struct wt_stats *stats, uint64_t us) {
+  int bucket = 0;
+
+  while (bucket < WT_STAT_LATENCY_BUCKETS - 1 &&
+         us > wt_stats_bounds[bucket] * 1000)
+    bucket++;
+
+  __atomic_fetch_add(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+  wt_stats_add(stats, WT_STAT_LATENCY_US, us);
+}
+
+uint64_t wt_stats_latency_le(struct wt_stats *stats, int bucket,
+                             uint64_t *bound) {
+  uint64_t count = 0;
+
+  for (int i = 0; i <= bucket; i++)
+    count += __atomic_load_n(&stats->latency[i], __ATOMIC_RELAXED);
+  *bound = (bucket < WT_STAT_LATENCY_BUCKETS - 1) ? wt_stats_bounds[bucket]
+                                                  : 0;
+  return count;
+}
@@ -0,0 +1,143 @@
+/**
+ * collectd - src/wt_strbuf.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wt_strbuf.h"
+
+#ifndef WT_STRBUF_MIN_SIZE
+#define WT_STRBUF_MIN_SIZE 4096
+#endif
+
+int wt_strbuf_reserve(struct wt_strbuf *buf, size_t len) {
+  size_t needed = buf->len + len + 1;
+  size_t size;
+  char *data;
+
+  if (needed <= buf->size)
+    return 0;
+
+  size = (buf->size < WT_STRBUF_MIN_SIZE) ? WT_STRBUF_MIN_SIZE : buf->size;
+  while (size < needed)
+    size *= 2;
+
+  data = realloc(buf->data, size);
+  if (data == NULL)
+    return -ENOMEM;
+
+  buf->data = data;
+  buf->size = size;
+  return 0;
+}
+
+int wt_strbuf_append(struct wt_strbuf *buf, const char *data, size_t len) {
+  if (wt_strbuf_reserve(buf, len) != 0)
+    return -ENOMEM;
+
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+  return 0;
+}
+
+int wt_strbuf_append_str(struct wt_strbuf *buf, const char *str) {
+  return wt_strbuf_append(buf, str, strlen(str));
+}
+
+int wt_strbuf_append_char(struct wt_strbuf *buf, char c) {
+  return wt_strbuf_append(buf, &c, 1);
+}
+
+int wt_strbuf_append_json_string(struct wt_strbuf *buf, const char *str) {
+  static const char hex[] = "0123456789abcdef";
+  size_t len = strlen(str);
+  const char *start = str;
+  char *ptr;
+
+  /* worst case: every byte becomes a \u00XX sequence, plus the quotes */
+  if (wt_strbuf_reserve(buf, 6 * len + 2) != 0)
+    return -ENOMEM;
+
+  ptr = buf->data + buf->len;
+  *ptr++ = '"';
+  for (; *str != '\0'; str++) {
+    unsigned char c = (unsigned char)*str;
+
+    /* copy runs of characters which do not need escaping at once */
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+
+    memcpy(ptr, start, str - start);
+    ptr += str - start;
+    start = str + 1;
+
+    *ptr++ = '\\';
+    switch (c) {
+    case '"':
+    case '\\':
+      *ptr++ = c;
+      break;
+    case '\n':
+      *ptr++ = 'n';
+      break;
+    case '\r':
+      *ptr++ = 'r';
+      break;
+    case '\t':
+      *ptr++ = 't';
+      break;
+    case '\b':
+      *ptr++ = 'b';
+      break;
+    case '\f':
+      *ptr++ = 'f';
+      break;
+    default:
+      *ptr++ = 'u';
+      *ptr++ = '0';
+      *ptr++ = '0';
+      *ptr++ = hex[c >> 4];
+      *ptr++ = hex[c & 0xf];
+    }
+  }
+  memcpy(ptr, start, str - start);
+  ptr += str - start;
+  *ptr++ = '"';
+  *ptr = '\0';
+
+  buf->len = ptr - buf->data;
+  return 0;
+}
+
+void wt_strbuf_reset(struct wt_strbuf *buf) {
+  buf->len = 0;
+  if (buf->data != NULL)
+    buf->data[0] = '\0';
+}
+
+void wt_strbuf_free(struct wt_strbuf *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->size = 0;
+}
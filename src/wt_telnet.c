@@ -0,0 +1,262 @@
+/**
+ * collectd - src/wt_telnet.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "wt_telnet.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+int wt_telnet_init(struct wt_telnet *conn, const char *address,
+                   const char *default_port) {
+  const char *host = address;
+  const char *port = NULL;
+  const char *end;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = -1;
+
+  if (strncmp(host, "tcp://", strlen("tcp://")) == 0)
+    host += strlen("tcp://");
+
+  if (host[0] == '[') {
+    host++;
+    end = strchr(host, ']');
+    if (end == NULL)
+      return -EINVAL;
+    if (end[1] == ':')
+      port = end + 2;
+    else if (end[1] != '\0')
+      return -EINVAL;
+  } else {
+    end = strchr(host, ':');
+    if (end != NULL)
+      port = end + 1;
+    else
+      end = host + strlen(host);
+  }
+  if (end == host || (port != NULL && port[0] == '\0'))
+    return -EINVAL;
+
+  conn->host = strndup(host, end - host);
+  conn->port = strdup((port != NULL) ? port : default_port);
+  if (conn->host == NULL || conn->port == NULL) {
+    wt_telnet_free(conn);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void wt_telnet_free(struct wt_telnet *conn) {
+  wt_telnet_close(conn);
+  free(conn->host);
+  free(conn->port);
+  conn->host = NULL;
+  conn->port = NULL;
+}
+
+void wt_telnet_close(struct wt_telnet *conn) {
+  if (conn->fd >= 0)
+    close(conn->fd);
+  conn->fd = -1;
+  conn->partial_len = 0;
+}
+
+/* Wait for fd to be ready for events, timeout <= 0 waits forever */
+static int wt_telnet_wait(int fd, short events, int timeout) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+  int status;
+
+  do {
+    status = poll(&pfd, 1, (timeout > 0) ? timeout : -1);
+  } while (status < 0 && errno == EINTR);
+
+  if (status < 0)
+    return -errno;
+  if (status == 0)
+    return -ETIMEDOUT;
+  return 0;
+}
+
+static int wt_telnet_connect_addr(const struct addrinfo *ai, int timeout) {
+  int fd;
+  int err = 0;
+  socklen_t err_len = sizeof(err);
+  int one = 1;
+  int status;
+
+  fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (fd < 0)
+    return -errno;
+
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+    err = errno;
+    close(fd);
+    return -err;
+  }
+  // an idle connection to a TSD that went away is noticed
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+    return fd;
+  if (errno != EINPROGRESS) {
+    err = errno;
+    close(fd);
+    return -err;
+  }
+
+  status = wt_telnet_wait(fd, POLLOUT, timeout);
+  if (status == 0 &&
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0)
+    status = -errno;
+  else if (status == 0 && err != 0)
+    status = -err;
+  if (status != 0) {
+    close(fd);
+    return status;
+  }
+  return fd;
+}
+
+int wt_telnet_connect(struct wt_telnet *conn, int timeout) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM,
+                           .ai_flags = AI_ADDRCONFIG};
+  struct addrinfo *res;
+  int status = -EHOSTUNREACH;
+
+  if (conn->fd >= 0)
+    return 0;
+
+  // resolved on each connection, the TSD may have moved
+  if (getaddrinfo(conn->host, conn->port, &hints, &res) != 0)
+    return -EHOSTUNREACH;
+
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    status = wt_telnet_connect_addr(ai, timeout);
+    if (status >= 0) {
+      conn->fd = status;
+      conn->partial_len = 0;
+      status = 0;
+      break;
+    }
+  }
+  freeaddrinfo(res);
+  return status;
+}
+
+int wt_telnet_writev(struct wt_telnet *conn, struct iovec *iov, int iovcnt,
+                     int timeout) {
+  int status = wt_telnet_connect(conn, timeout);
+
+  if (status != 0)
+    return status;
+
+  while (iovcnt > 0) {
+    // sendmsg() is writev() with MSG_NOSIGNAL, a closed peer gives EPIPE
+    // instead of killing the daemon with SIGPIPE
+    struct msghdr msg = {.msg_iov = iov,
+                         .msg_iovlen = (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX};
+    ssize_t written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        status = wt_telnet_wait(conn->fd, POLLOUT, timeout);
+      else
+        status = -errno;
+      if (status != 0) {
+        wt_telnet_close(conn);
+        return status;
+      }
+      continue;
+    }
+
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+int wt_telnet_drain(struct wt_telnet *conn, char *line, size_t line_size) {
+  char buf[4096];
+  int lines = 0;
+
+  if (conn->fd < 0)
+    return 0;
+
+  while (1) {
+    ssize_t len = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+    if (len == 0) {
+      wt_telnet_close(conn);
+      return -EPIPE;
+    }
+    if (len < 0) {
+      int err = errno;
+
+      if (err == EINTR)
+        continue;
+      if (err == EAGAIN || err == EWOULDBLOCK)
+        return lines;
+      wt_telnet_close(conn);
+      return -err;
+    }
+
+    for (ssize_t i = 0; i < len; i++) {
+      if (buf[i] != '\n') {
+        // long lines are truncated
+        if (buf[i] != '\r' && conn->partial_len < sizeof(conn->partial) - 1)
+          conn->partial[conn->partial_len++] = buf[i];
+        continue;
+      }
+      conn->partial[conn->partial_len] = '\0';
+      if (line_size > 0) {
+        strncpy(line, conn->partial, line_size - 1);
+        line[line_size - 1] = '\0';
+      }
+      conn->partial_len = 0;
+      lines++;
+    }
+  }
+}
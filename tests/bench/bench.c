@@ -0,0 +1,420 @@
+/**
+ * collectd - tests/bench/bench.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+/* Microbenchmarks of the write path
+ *
+ * The plugin is built into this program, its static functions being
+ * measured directly, against the collectd stub of collectd_stub.c. Each
+ * stage is run over the same fixtures of value lists and reports the time
+ * and the number of allocations per data point:
+ *
+ *   read_meta      wt_meta_read(), once per value list
+ *   format_name    wt_format_name()
+ *   format_tags    wt_format_tags()
+ *   format_values  wt_format_values()
+ *   serialize      rendering of a point from the series cache into a batch
+ *   write          wt_write_messages(), queueing included
+ *
+ * Usage: bench [iterations] [http|telnet] [raw|rates|local]
+ * rates sets StoreRates, local also LocalRates. The times of the value lists
+ * move forward on each write for the rates to be computed.
+ * The allocations are counted by wrapping malloc(), calloc(), realloc() and
+ * strdup() at link time (ld --wrap), see CMakeLists.txt.
+ */
+
+#include "../../src/write_opentsdb.c"
+
+#define BENCH_SERIES 1024
+#define BENCH_ADD_TAGS 8
+#define BENCH_DEFAULT_ITERATIONS 200
+
+extern user_data_t stub_write_user_data;
+
+static uint64_t bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) {
+  bench_allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  bench_allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  bench_allocs++;
+  return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+  bench_allocs++;
+  return __real_strdup(s);
+}
+
+/* Data sets of the fixtures, single and multi data sources */
+static data_source_t bench_if_octets_ds[] = {{"rx", DS_TYPE_DERIVE, 0, NAN},
+                                             {"tx", DS_TYPE_DERIVE, 0, NAN}};
+static data_source_t bench_load_ds[] = {{"shortterm", DS_TYPE_GAUGE, 0, 5000},
+                                        {"midterm", DS_TYPE_GAUGE, 0, 5000},
+                                        {"longterm", DS_TYPE_GAUGE, 0, 5000}};
+static data_source_t bench_memory_ds[] = {{"value", DS_TYPE_GAUGE, 0, NAN}};
+static data_source_t bench_cpu_ds[] = {{"value", DS_TYPE_DERIVE, 0, NAN}};
+static data_source_t bench_disk_ds[] = {{"read", DS_TYPE_COUNTER, 0, NAN},
+                                        {"write", DS_TYPE_COUNTER, 0, NAN}};
+
+static data_set_t bench_data_sets[] = {
+    {"if_octets", 2, bench_if_octets_ds}, {"load", 3, bench_load_ds},
+    {"memory", 1, bench_memory_ds},       {"cpu", 1, bench_cpu_ds},
+    {"disk_octets", 2, bench_disk_ds}};
+
+static const char *bench_plugins[] = {"interface", "load", "memory", "cpu",
+                                      "disk"};
+
+static const char *bench_add_tags[BENCH_ADD_TAGS] = {
+    "rack", "row", "pod", "cluster", "zone", "tier", "owner", "service"};
+
+struct bench_fixture {
+  const data_set_t *ds;
+  value_list_t vl;
+  value_t values[3];
+  // meta data of vl, read beforehand for the formatting stages
+  struct wt_meta meta;
+};
+
+struct bench {
+  struct wt_callback *cb;
+  struct bench_fixture *fixtures;
+  size_t points;
+  // scratch buffers of the stages
+  struct wt_tags tags;
+  struct wt_meta meta;
+  struct wt_strbuf point;
+  struct wt_strbuf tail;
+  struct wt_batch batch;
+};
+
+/* Value lists of BENCH_SERIES series: half of the hosts are JSON host tags,
+ * three quarters of the value lists carry a prefix, a tag rename and
+ * BENCH_ADD_TAGS added tags as meta data.
+ */
+static void bench_fixtures_init(struct bench *b) {
+  char value[64];
+
+  b->fixtures = calloc(BENCH_SERIES, sizeof(*b->fixtures));
+  if (b->fixtures == NULL) {
+    fprintf(stderr, "calloc failed\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < BENCH_SERIES; i++) {
+    struct bench_fixture *f = &b->fixtures[i];
+    size_t kind = i % STATIC_ARRAY_SIZE(bench_data_sets);
+    value_list_t *vl = &f->vl;
+
+    f->ds = &bench_data_sets[kind];
+    vl->values = f->values;
+    vl->values_len = f->ds->ds_num;
+    vl->time = TIME_T_TO_CDTIME_T(1500000000 + i);
+    vl->interval = TIME_T_TO_CDTIME_T(10);
+    for (size_t j = 0; j < f->ds->ds_num; j++) {
+      if (f->ds->ds[j].type == DS_TYPE_GAUGE)
+        f->values[j].gauge = (double)(i * 7 + j) / 8.0 + 0.1;
+      else if (f->ds->ds[j].type == DS_TYPE_DERIVE)
+        f->values[j].derive = (derive_t)(i * 1000003 + j);
+      else
+        f->values[j].counter = (counter_t)(i * 7919 + j) << 20;
+    }
+
+    if (i % 2 == 0)
+      ssnprintf(vl->host, sizeof(vl->host),
+                "{\"fqdn\":\"web-%03zu.par1.example.org\",\"env\":\"prod\","
+                "\"dc\":\"par1\",\"role\":\"web\",\"team\":\"infra\"}",
+                i / 16);
+    else
+      ssnprintf(vl->host, sizeof(vl->host), "db-%03zu.example.org", i / 16);
+    sstrncpy(vl->plugin, bench_plugins[kind], sizeof(vl->plugin));
+    ssnprintf(vl->plugin_instance, sizeof(vl->plugin_instance), "%zu",
+              i % 16);
+    sstrncpy(vl->type, f->ds->type, sizeof(vl->type));
+    if (kind == 3)
+      sstrncpy(vl->type_instance, (i % 3) ? "user" : "system",
+               sizeof(vl->type_instance));
+
+    if (i % 4 != 3) {
+      vl->meta = meta_data_create();
+      meta_data_add_string(vl->meta, "tsdb_prefix", "sys.");
+      meta_data_add_string(vl->meta, "tsdb_tag_pluginInstance", "instance");
+      for (int j = 0; j < BENCH_ADD_TAGS; j++) {
+        char key[64];
+
+        ssnprintf(key, sizeof(key), "tsdb_tag_add_%s", bench_add_tags[j]);
+        ssnprintf(value, sizeof(value), "%s-%zu", bench_add_tags[j],
+                  i % (j + 2));
+        meta_data_add_string(vl->meta, key, value);
+      }
+    }
+    f->meta.arena = (struct wt_arena)WT_ARENA_INIT;
+    wt_meta_read(&f->meta, vl->meta);
+
+    b->points += f->ds->ds_num;
+  }
+}
+
+static const char *bench_ds_name(const struct bench *b,
+                                  const struct bench_fixture *f, size_t i) {
+  if (b->cb->always_append_ds || f->ds->ds_num > 1)
+    return f->ds->ds[i].name;
+  return NULL;
+}
+
+static void bench_read_meta(struct bench *b) {
+  for (size_t n = 0; n < BENCH_SERIES; n++)
+    wt_meta_read(&b->meta, b->fixtures[n].vl.meta);
+}
+
+static void bench_format_name(struct bench *b) {
+  char key[10 * DATA_MAX_NAME_LEN];
+
+  for (size_t n = 0; n < BENCH_SERIES; n++) {
+    const struct bench_fixture *f = &b->fixtures[n];
+
+    for (size_t i = 0; i < f->ds->ds_num; i++)
+      wt_format_name(key, sizeof(key), &f->vl, &f->meta, NULL, b->cb,
+                     bench_ds_name(b, f, i));
+  }
+}
+
+static void bench_format_tags(struct bench *b) {
+  for (size_t n = 0; n < BENCH_SERIES; n++) {
+    const struct bench_fixture *f = &b->fixtures[n];
+
+    for (size_t i = 0; i < f->ds->ds_num; i++)
+      wt_format_tags(&b->tags, &f->vl, &f->meta, NULL, b->cb,
+                     bench_ds_name(b, f, i));
+  }
+}
+
+static void bench_format_values(struct bench *b) {
+  char values[WT_NUMBER_SIZE];
+  double number;
+  int status;
+
+  for (size_t n = 0; n < BENCH_SERIES; n++) {
+    const struct bench_fixture *f = &b->fixtures[n];
+    gauge_t *rates = wt_get_rates(f->ds, &f->vl, b->cb, &status);
+
+    for (size_t i = 0; i < f->ds->ds_num; i++)
+      wt_format_values(values, &number, i, f->ds, &f->vl, rates);
+    sfree(rates);
+  }
+}
+
+/* Render the points from the series cache, filled by the first pass, and
+ * append them to a batch cut at the BufferSize of the Node */
+static void bench_serialize(struct bench *b) {
+  char values[WT_NUMBER_SIZE];
+  double number;
+  int status;
+
+  for (size_t n = 0; n < BENCH_SERIES; n++) {
+    const struct bench_fixture *f = &b->fixtures[n];
+    gauge_t *rates = wt_get_rates(f->ds, &f->vl, b->cb, &status);
+    uint64_t ident = wt_identifier_hash(f->vl.host, f->vl.plugin,
+                                        f->vl.plugin_instance, f->vl.type,
+                                        f->vl.type_instance);
+    uint64_t fingerprint = 0;
+
+    b->meta.valid = 0;
+    if (f->vl.meta != NULL) {
+      wt_meta_read(&b->meta, f->vl.meta);
+      fingerprint = wt_meta_fingerprint(&b->meta);
+    }
+
+    for (size_t i = 0; i < f->ds->ds_num; i++) {
+      uint64_t route;
+
+      wt_strbuf_reset(&b->point);
+      wt_format_values(values, &number, i, f->ds, &f->vl, rates);
+      wt_append_series(&b->point, &b->tail, &b->tags, &f->vl, &b->meta, b->cb,
+                       bench_ds_name(b, f, i), fingerprint, ident, &route,
+                       NULL);
+      wt_render_value(&b->point, b->cb, f->vl.time, values);
+      wt_strbuf_append(&b->point, b->tail.data, b->tail.len);
+
+      if (b->batch.points >= b->cb->buffer_metric_max) {
+        wt_strbuf_reset(&b->batch.body);
+        b->batch.points = 0;
+      }
+      wt_batch_append(&b->batch, b->point.data, b->point.len, f->vl.time,
+                      ident, route);
+    }
+    sfree(rates);
+  }
+}
+
+/* The whole write callback, the batches handed over to the sender thread
+ * being recycled right away as there is none */
+static void bench_write(struct bench *b) {
+  struct wt_callback *cb = b->cb;
+
+  for (size_t n = 0; n < BENCH_SERIES; n++) {
+    b->fixtures[n].vl.time += b->fixtures[n].vl.interval;
+    wt_write_messages(b->fixtures[n].ds, &b->fixtures[n].vl, cb);
+  }
+
+  pthread_mutex_lock(&cb->send_lock);
+  wt_handoff_take_nolock(cb);
+  while (cb->send_queue_head != NULL) {
+    struct wt_batch *batch = cb->send_queue_head;
+
+    cb->send_queue_head = batch->next;
+    wt_batch_put_nolock(cb, batch);
+  }
+  cb->send_queue_tail = NULL;
+  cb->send_queue_len = 0;
+  pthread_mutex_unlock(&cb->send_lock);
+}
+
+static void bench_run(struct bench *b, const char *name,
+                      void (*stage)(struct bench *), int iterations) {
+  struct timespec start, end;
+  uint64_t allocs;
+  double ns;
+
+  // warm up the caches and the scratch buffers
+  stage(b);
+
+  bench_allocs = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < iterations; i++)
+    stage(b);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  allocs = bench_allocs;
+
+  ns = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+       (double)(end.tv_nsec - start.tv_nsec);
+  printf("%-14s %10.1f ns/point %8.2f allocs/point\n", name,
+         ns / ((double)b->points * iterations),
+         (double)allocs / ((double)b->points * iterations));
+}
+
+/* Configuration of the Node under test, as collectd would pass it */
+static oconfig_item_t *bench_option(oconfig_item_t *parent, const char *key,
+                                    int type) {
+  oconfig_item_t *child = &parent->children[parent->children_num++];
+
+  child->key = (char *)key;
+  child->parent = parent;
+  child->values = calloc(1, sizeof(*child->values));
+  child->values_num = 1;
+  child->values[0].type = type;
+  return child;
+}
+
+static struct wt_callback *bench_config(const char *protocol,
+                                       const char *rates) {
+  static oconfig_item_t children[16];
+  oconfig_item_t node = {.key = "Node", .children = children};
+  _Bool telnet = (strcasecmp(protocol, "telnet") == 0);
+
+  bench_option(&node, "URL", OCONFIG_TYPE_STRING)->values[0].value.string =
+      telnet ? "127.0.0.1:4242" : "http://127.0.0.1:4242";
+  bench_option(&node, "Protocol", OCONFIG_TYPE_STRING)
+      ->values[0]
+      .value.string = (char *)protocol;
+  bench_option(&node, "JsonHostTag", OCONFIG_TYPE_BOOLEAN)
+      ->values[0]
+      .value.boolean = 1;
+  bench_option(&node, "AutoFqdnFallback", OCONFIG_TYPE_BOOLEAN)
+      ->values[0]
+      .value.boolean = 1;
+  bench_option(&node, "BufferSize", OCONFIG_TYPE_NUMBER)
+      ->values[0]
+      .value.number = 50;
+  bench_option(&node, "StoreRates", OCONFIG_TYPE_BOOLEAN)
+      ->values[0]
+      .value.boolean = (strcasecmp(rates, "raw") != 0);
+  bench_option(&node, "LocalRates", OCONFIG_TYPE_BOOLEAN)
+      ->values[0]
+      .value.boolean = (strcasecmp(rates, "local") == 0);
+
+  if (wt_config_tsd(&node) != 0)
+    return NULL;
+  return stub_write_user_data.data;
+}
+
+int main(int argc, char **argv) {
+  struct bench b = {.tags = {.storage = WT_STRBUF_INIT},
+                    .meta = {.arena = WT_ARENA_INIT},
+                    .point = WT_STRBUF_INIT,
+                    .tail = WT_STRBUF_INIT,
+                    .batch = {.body = WT_STRBUF_INIT}};
+  int iterations = (argc > 1) ? atoi(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+  const char *protocol = (argc > 2) ? argv[2] : "http";
+  const char *rates = (argc > 3) ? argv[3] : "raw";
+
+  if (iterations <= 0) {
+    fprintf(stderr,
+            "usage: %s [iterations] [http|telnet] [raw|rates|local]\n",
+            argv[0]);
+    return 1;
+  }
+
+  b.cb = bench_config(protocol, rates);
+  if (b.cb == NULL) {
+    fprintf(stderr, "configuration failed\n");
+    return 1;
+  }
+  b.batch.lines = (b.cb->protocol == WT_PROTOCOL_TELNET);
+  bench_fixtures_init(&b);
+
+  printf("%zu series, %zu points, %d iterations, %s, %s\n",
+         (size_t)BENCH_SERIES, b.points, iterations, protocol, rates);
+  bench_run(&b, "read_meta", bench_read_meta, iterations);
+  bench_run(&b, "format_name", bench_format_name, iterations);
+  bench_run(&b, "format_tags", bench_format_tags, iterations);
+  bench_run(&b, "format_values", bench_format_values, iterations);
+  bench_run(&b, "serialize", bench_serialize, iterations);
+  bench_run(&b, "write", bench_write, iterations);
+
+  wt_tags_free(&b.tags);
+  wt_meta_free(&b.meta);
+  wt_strbuf_free(&b.point);
+  wt_strbuf_free(&b.tail);
+  wt_strbuf_free(&b.batch.body);
+  free(b.batch.offsets);
+  free(b.batch.times);
+  free(b.batch.idents);
+  free(b.batch.routes);
+  for (size_t i = 0; i < BENCH_SERIES; i++) {
+    meta_data_destroy(b.fixtures[i].vl.meta);
+    wt_meta_free(&b.fixtures[i].meta);
+  }
+  free(b.fixtures);
+  wt_callback_free(b.cb);
+  return 0;
+}
@@ -0,0 +1,291 @@
+/**
+ * collectd - tests/bench/collectd_stub.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+/* Minimal implementation of the collectd daemon functions used by the
+ * plugin, so that its code can be linked into the bench program without
+ * collectd. Only the write path is exercised: registrations are recorded,
+ * values dispatched and log messages below LOG_ERR are dropped.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// as in write_opentsdb.c, for the collectd headers
+#define HAVE__BOOL 1
+#define FP_LAYOUT_NEED_NOTHING 1
+
+#include <collectd.h>
+#include <common.h>
+#include <plugin.h>
+#include <utils_cache.h>
+
+// user data of the last write callback registered, see bench.c
+user_data_t stub_write_user_data;
+
+void plugin_log(int level, const char *format, ...) {
+  va_list ap;
+
+  if (level > LOG_ERR)
+    return;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+cdtime_t cdtime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return TIME_T_TO_CDTIME_T(ts.tv_sec) +
+         (((cdtime_t)ts.tv_nsec << 30) / 1000000000);
+}
+
+int ssnprintf(char *dest, size_t n, const char *format, ...) {
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
+  ret = vsnprintf(dest, n, format, ap);
+  if (n > 0)
+    dest[n - 1] = '\0';
+  va_end(ap);
+  return ret;
+}
+
+char *sstrncpy(char *dest, const char *src, size_t n) {
+  strncpy(dest, src, n);
+  dest[n - 1] = '\0';
+  return dest;
+}
+
+char *sstrdup(const char *s) {
+  return (s == NULL) ? NULL : strdup(s);
+}
+
+// quotes the string if it holds blanks or quotes, as collectd does
+int escape_string(char *buffer, size_t buffer_size) {
+  char *temp;
+  size_t j = 1;
+
+  if (strpbrk(buffer, " \t\"\\") == NULL)
+    return 0;
+  if (buffer_size < 3)
+    return EINVAL;
+  temp = calloc(1, buffer_size);
+  if (temp == NULL)
+    return ENOMEM;
+
+  temp[0] = '"';
+  for (size_t i = 0; i < buffer_size && buffer[i] != '\0'; i++) {
+    if (buffer[i] == '"' || buffer[i] == '\\') {
+      if (j > buffer_size - 4)
+        break;
+      temp[j++] = '\\';
+    } else if (j > buffer_size - 3)
+      break;
+    temp[j++] = buffer[i];
+  }
+  temp[j] = '"';
+  sstrncpy(buffer, temp, buffer_size);
+  free(temp);
+  return 0;
+}
+
+/* Meta data: a list of string entries, which is all the plugin reads */
+struct meta_entry {
+  char *key;
+  char *value;
+  struct meta_entry *next;
+};
+
+struct meta_data_s {
+  struct meta_entry *head;
+};
+
+meta_data_t *meta_data_create(void) {
+  return calloc(1, sizeof(meta_data_t));
+}
+
+void meta_data_destroy(meta_data_t *md) {
+  struct meta_entry *e;
+
+  if (md == NULL)
+    return;
+  while ((e = md->head) != NULL) {
+    md->head = e->next;
+    free(e->key);
+    free(e->value);
+    free(e);
+  }
+  free(md);
+}
+
+int meta_data_add_string(meta_data_t *md, const char *key,
+                         const char *value) {
+  struct meta_entry *e = calloc(1, sizeof(*e));
+
+  if (e == NULL)
+    return -ENOMEM;
+  e->key = strdup(key);
+  e->value = strdup(value);
+  e->next = md->head;
+  md->head = e;
+  return 0;
+}
+
+int meta_data_exists(meta_data_t *md, const char *key) {
+  for (struct meta_entry *e = md->head; e != NULL; e = e->next)
+    if (strcmp(e->key, key) == 0)
+      return 1;
+  return 0;
+}
+
+int meta_data_toc(meta_data_t *md, char ***toc) {
+  int num = 0;
+  int i = 0;
+
+  for (struct meta_entry *e = md->head; e != NULL; e = e->next)
+    num++;
+  *toc = calloc(num ? num : 1, sizeof(**toc));
+  if (*toc == NULL)
+    return -ENOMEM;
+  for (struct meta_entry *e = md->head; e != NULL; e = e->next)
+    (*toc)[i++] = strdup(e->key);
+  return num;
+}
+
+int meta_data_get_string(meta_data_t *md, const char *key, char **value) {
+  for (struct meta_entry *e = md->head; e != NULL; e = e->next) {
+    if (strcmp(e->key, key) == 0) {
+      *value = strdup(e->value);
+      return (*value == NULL) ? -ENOMEM : 0;
+    }
+  }
+  return -ENOENT;
+}
+
+/* Rates are not computed: a constant rate per data source is enough to
+ * exercise the formatting */
+gauge_t *uc_get_rate(const data_set_t *ds, const value_list_t *vl) {
+  gauge_t *rates = calloc(ds->ds_num, sizeof(*rates));
+
+  (void)vl;
+  if (rates == NULL)
+    return NULL;
+  for (size_t i = 0; i < ds->ds_num; i++)
+    rates[i] = 12.5 * (double)(i + 1);
+  return rates;
+}
+
+int plugin_register_complex_config(const char *type,
+                                   int (*callback)(oconfig_item_t *)) {
+  (void)type;
+  (void)callback;
+  return 0;
+}
+
+int plugin_register_init(const char *name, int (*callback)(void)) {
+  (void)name;
+  (void)callback;
+  return 0;
+}
+
+int plugin_register_write(const char *name, plugin_write_cb callback,
+                          user_data_t const *user_data) {
+  (void)name;
+  (void)callback;
+  stub_write_user_data = *user_data;
+  return 0;
+}
+
+int plugin_register_flush(const char *name, plugin_flush_cb callback,
+                          user_data_t const *user_data) {
+  (void)name;
+  (void)callback;
+  (void)user_data;
+  return 0;
+}
+
+int plugin_register_complex_read(const char *group, const char *name,
+                                 plugin_read_cb callback, cdtime_t interval,
+                                 user_data_t const *user_data) {
+  (void)group;
+  (void)name;
+  (void)callback;
+  (void)interval;
+  (void)user_data;
+  return 0;
+}
+
+int plugin_dispatch_values(value_list_t const *vl) {
+  (void)vl;
+  return 0;
+}
+
+static int stub_config_type(const oconfig_item_t *ci, int type) {
+  return (ci->values_num == 1 && ci->values[0].type == type) ? 0 : -1;
+}
+
+int cf_util_get_string(const oconfig_item_t *ci, char **ret_string) {
+  char *string;
+
+  if (stub_config_type(ci, OCONFIG_TYPE_STRING) != 0)
+    return -1;
+  string = strdup(ci->values[0].value.string);
+  if (string == NULL)
+    return -1;
+  free(*ret_string);
+  *ret_string = string;
+  return 0;
+}
+
+int cf_util_get_int(const oconfig_item_t *ci, int *ret_value) {
+  if (stub_config_type(ci, OCONFIG_TYPE_NUMBER) != 0)
+    return -1;
+  *ret_value = (int)ci->values[0].value.number;
+  return 0;
+}
+
+int cf_util_get_double(const oconfig_item_t *ci, double *ret_value) {
+  if (stub_config_type(ci, OCONFIG_TYPE_NUMBER) != 0)
+    return -1;
+  *ret_value = ci->values[0].value.number;
+  return 0;
+}
+
+int cf_util_get_boolean(const oconfig_item_t *ci, _Bool *ret_bool) {
+  if (stub_config_type(ci, OCONFIG_TYPE_BOOLEAN) != 0)
+    return -1;
+  *ret_bool = ci->values[0].value.boolean ? 1 : 0;
+  return 0;
+}
+
+int cf_util_get_cdtime(const oconfig_item_t *ci, cdtime_t *ret_value) {
+  if (stub_config_type(ci, OCONFIG_TYPE_NUMBER) != 0)
+    return -1;
+  *ret_value = DOUBLE_TO_CDTIME_T(ci->values[0].value.number);
+  return 0;
+}
@@ -0,0 +1,305 @@
+/**
+ * collectd - tests/load/loadgen.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+/* End to end load generator
+ *
+ * Configures a Node, starts its sender thread and pushes value lists through
+ * wt_write(), the write callback collectd calls, from several threads, as
+ * the write threads of collectd do. The plugin is built into this program
+ * against the collectd stub of tests/bench.
+ *
+ * Reports the write throughput and the latency percentiles of the write
+ * callback, then waits for the points to be sent, or given up, and reports
+ * the end to end throughput and the counters of the Node.
+ *
+ * Usage: loadgen [-u url] [-t threads] [-s series] [-n rounds] [-w seconds]
+ *                [-o Option=value]...
+ * -o sets any option of the Node, e.g. -o Compression=gzip -o MaxInFlight=8;
+ * values are parsed as booleans, numbers or strings. Meant to be run
+ * against tests/load/mock_tsd.
+ */
+
+#include "../../src/write_opentsdb.c"
+
+#define LOAD_MAX_OPTIONS 64
+
+extern user_data_t stub_write_user_data;
+
+static data_source_t load_gauge_ds[] = {{"value", DS_TYPE_GAUGE, 0, NAN}};
+static data_source_t load_if_octets_ds[] = {{"rx", DS_TYPE_DERIVE, 0, NAN},
+                                            {"tx", DS_TYPE_DERIVE, 0, NAN}};
+static data_source_t load_load_ds[] = {{"shortterm", DS_TYPE_GAUGE, 0, 5000},
+                                       {"midterm", DS_TYPE_GAUGE, 0, 5000},
+                                       {"longterm", DS_TYPE_GAUGE, 0, 5000}};
+
+static data_set_t load_data_sets[] = {{"gauge", 1, load_gauge_ds},
+                                      {"if_octets", 2, load_if_octets_ds},
+                                      {"load", 3, load_load_ds}};
+
+struct load_thread {
+  pthread_t thread;
+  int index;
+  int threads;
+  int series;
+  int rounds;
+  user_data_t *user_data;
+  // duration of each write callback, in nanoseconds
+  uint64_t *latencies;
+  size_t count;
+  uint64_t points;
+};
+
+static uint64_t load_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Write rounds values of the series index, index + threads, ... */
+static void *load_thread_run(void *arg) {
+  struct load_thread *t = arg;
+  value_list_t vl = VALUE_LIST_INIT;
+  value_t values[3];
+  cdtime_t start = cdtime();
+
+  vl.values = values;
+  vl.interval = TIME_T_TO_CDTIME_T(10);
+  for (int r = 0; r < t->rounds; r++) {
+    for (int i = t->index; i < t->series; i += t->threads) {
+      const data_set_t *ds = &load_data_sets[i % 3];
+      uint64_t begin;
+
+      vl.values_len = ds->ds_num;
+      vl.time = start + TIME_T_TO_CDTIME_T(10 * r);
+      if (i % 2 == 0)
+        ssnprintf(vl.host, sizeof(vl.host),
+                  "{\"fqdn\":\"host-%05d.example.org\",\"env\":\"load\"}",
+                  i / 64);
+      else
+        ssnprintf(vl.host, sizeof(vl.host), "host-%05d.example.org", i / 64);
+      sstrncpy(vl.plugin, "loadgen", sizeof(vl.plugin));
+      ssnprintf(vl.plugin_instance, sizeof(vl.plugin_instance), "%d", i % 64);
+      sstrncpy(vl.type, ds->type, sizeof(vl.type));
+      ssnprintf(vl.type_instance, sizeof(vl.type_instance), "s%d", i);
+      for (size_t j = 0; j < ds->ds_num; j++) {
+        if (ds->ds[j].type == DS_TYPE_GAUGE)
+          values[j].gauge = (double)((i + r) % 1000) / 4.0;
+        else
+          values[j].derive = (derive_t)(r * 1000 + i);
+      }
+
+      begin = load_now_ns();
+      wt_write(ds, &vl, t->user_data);
+      t->latencies[t->count++] = load_now_ns() - begin;
+      t->points += ds->ds_num;
+    }
+  }
+  return NULL;
+}
+
+static int load_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double load_percentile(const uint64_t *sorted, size_t count,
+                              double p) {
+  if (count == 0)
+    return 0;
+  return (double)sorted[(size_t)(p * (double)(count - 1))] / 1000.0;
+}
+
+/* Add Option=value to the Node configuration */
+static int load_option(oconfig_item_t *node, const char *arg) {
+  oconfig_item_t *child;
+  const char *eq = strchr(arg, '=');
+  char *end;
+  double number;
+
+  if (eq == NULL || eq == arg || node->children_num == LOAD_MAX_OPTIONS)
+    return -1;
+
+  child = &node->children[node->children_num++];
+  child->key = strndup(arg, eq - arg);
+  child->parent = node;
+  child->values = calloc(1, sizeof(*child->values));
+  child->values_num = 1;
+  eq++;
+
+  number = strtod(eq, &end);
+  if (strcasecmp(eq, "true") == 0 || strcasecmp(eq, "false") == 0) {
+    child->values[0].type = OCONFIG_TYPE_BOOLEAN;
+    child->values[0].value.boolean = (strcasecmp(eq, "true") == 0);
+  } else if (*eq != '\0' && *end == '\0') {
+    child->values[0].type = OCONFIG_TYPE_NUMBER;
+    child->values[0].value.number = number;
+  } else {
+    child->values[0].type = OCONFIG_TYPE_STRING;
+    child->values[0].value.string = strdup(eq);
+  }
+  return 0;
+}
+
+static void load_usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-u url] [-t threads] [-s series] [-n rounds] "
+          "[-w seconds] [-o Option=value]...\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  static oconfig_item_t children[LOAD_MAX_OPTIONS];
+  oconfig_item_t node = {.key = "Node", .children = children};
+  const char *url = "http://127.0.0.1:4242";
+  struct wt_callback *cb;
+  struct load_thread *threads;
+  uint64_t *latencies;
+  uint64_t points = 0;
+  uint64_t start, written, done, settled;
+  size_t count = 0;
+  int nthreads = 4;
+  int series = 10000;
+  int rounds = 10;
+  int wait = 30;
+  int c;
+
+  while ((c = getopt(argc, argv, "u:t:s:n:w:o:")) != -1) {
+    switch (c) {
+    case 'u':
+      url = optarg;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 's':
+      series = atoi(optarg);
+      break;
+    case 'n':
+      rounds = atoi(optarg);
+      break;
+    case 'w':
+      wait = atoi(optarg);
+      break;
+    case 'o':
+      if (load_option(&node, optarg) != 0)
+        load_usage(argv[0]);
+      break;
+    default:
+      load_usage(argv[0]);
+    }
+  }
+  if (nthreads <= 0 || series <= 0 || rounds <= 0)
+    load_usage(argv[0]);
+
+  {
+    char option[1024];
+
+    ssnprintf(option, sizeof(option), "URL=%s", url);
+    load_option(&node, option);
+  }
+  if (wt_config_tsd(&node) != 0 || wt_init() != 0) {
+    fprintf(stderr, "configuration failed\n");
+    return 1;
+  }
+  cb = stub_write_user_data.data;
+
+  threads = calloc(nthreads, sizeof(*threads));
+  if (threads == NULL)
+    return 1;
+  start = load_now_ns();
+  for (int i = 0; i < nthreads; i++) {
+    struct load_thread *t = &threads[i];
+
+    t->index = i;
+    t->threads = nthreads;
+    t->series = series;
+    t->rounds = rounds;
+    t->user_data = &stub_write_user_data;
+    t->latencies = calloc((size_t)(series / nthreads + 1) * rounds,
+                          sizeof(*t->latencies));
+    if (t->latencies == NULL ||
+        pthread_create(&t->thread, NULL, load_thread_run, t) != 0) {
+      fprintf(stderr, "failed to start thread %d\n", i);
+      return 1;
+    }
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    points += threads[i].points;
+    count += threads[i].count;
+  }
+  written = load_now_ns();
+
+  latencies = calloc(count ? count : 1, sizeof(*latencies));
+  if (latencies == NULL)
+    return 1;
+  count = 0;
+  for (int i = 0; i < nthreads; i++) {
+    memcpy(latencies + count, threads[i].latencies,
+           threads[i].count * sizeof(*latencies));
+    count += threads[i].count;
+    free(threads[i].latencies);
+  }
+  qsort(latencies, count, sizeof(*latencies), load_compare);
+
+  printf("wrote %zu value lists, %" PRIu64 " points, from %d threads in "
+         "%.3f s: %.0f points/s\n",
+         count, points, nthreads, (double)(written - start) / 1e9,
+         (double)points / ((double)(written - start) / 1e9));
+  printf("write callback latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+         load_percentile(latencies, count, 0.50),
+         load_percentile(latencies, count, 0.99),
+         load_percentile(latencies, count, 1.0));
+
+  // wait for every queued point to be sent or given up
+  wt_flush(0, NULL, &stub_write_user_data);
+  done = written;
+  settled = written + (uint64_t)wait * 1000000000;
+  while (load_now_ns() < settled) {
+    uint64_t queued = wt_stats_get(&cb->stats, WT_STAT_POINTS_QUEUED);
+    uint64_t over = wt_stats_get(&cb->stats, WT_STAT_POINTS_SENT) +
+                    wt_stats_get(&cb->stats, WT_STAT_POINTS_INVALID) +
+                    wt_stats_get(&cb->stats, WT_STAT_POINTS_DROPPED) +
+                    wt_stats_get(&cb->stats, WT_STAT_POINTS_SPOOLED);
+
+    done = load_now_ns();
+    if (over >= queued)
+      break;
+    usleep(10000);
+  }
+  printf("sent %" PRIu64 " points in %.3f s: %.0f points/s end to end\n",
+         wt_stats_get(&cb->stats, WT_STAT_POINTS_SENT),
+         (double)(done - start) / 1e9,
+         (double)wt_stats_get(&cb->stats, WT_STAT_POINTS_SENT) /
+             ((double)(done - start) / 1e9));
+  for (int i = 0; i < WT_STAT_MAX; i++)
+    printf("  %-20s %" PRIu64 "\n", wt_stats_name(i),
+           wt_stats_get(&cb->stats, i));
+
+  free(latencies);
+  free(threads);
+  stub_write_user_data.free_func(cb);
+  return 0;
+}
@@ -0,0 +1,690 @@
+/**
+ * collectd - tests/load/mock_tsd.c
+ * Copyright (C) 2017  Pierre-Francois Carpentier
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Pierre-Francois Carpentier <carpentier.pf@gmail.com>
+ **/
+
+/* Mock TSD for load tests
+ *
+ * A single threaded, epoll based server answering POSTs to /api/put the way
+ * OpenTSDB does, without storing anything. Bodies may be gzip or deflate
+ * encoded, and sent with a Content-Length or chunked. Faults are injected at
+ * random, per request:
+ *
+ *   -l ms    answer each request after ms milliseconds
+ *   -e rate  answer 500
+ *   -d rate  answer 400 with the details of failed points, a -f fraction of
+ *            the points of the batch failing
+ *   -r rate  reset the connection instead of answering
+ *
+ * With -T, the telnet interface is mocked instead: "put" lines are counted
+ * and a -d fraction of them answered with an error line.
+ *
+ * Usage: mock_tsd [-p port] [-l ms] [-e rate] [-d rate] [-f fraction]
+ *                 [-r rate] [-s seed] [-i seconds] [-T]
+ * The counters are printed every -i seconds and on SIGINT or SIGTERM.
+ */
+
+// accept4()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#define MOCK_MAX_EVENTS 256
+#define MOCK_READ_SIZE 65536
+// larger requests are answered 413, as OpenTSDB does with its default limit
+#define MOCK_MAX_REQUEST (64 * 1024 * 1024)
+
+struct mock_options {
+  int port;
+  int latency_ms;
+  double error_rate;
+  double details_rate;
+  double fail_fraction;
+  double reset_rate;
+  int interval;
+  _Bool telnet;
+};
+
+struct mock_counters {
+  uint64_t connections;
+  uint64_t requests;
+  uint64_t points;
+  uint64_t points_failed;
+  uint64_t errors;
+  uint64_t details;
+  uint64_t resets;
+  uint64_t bytes;
+};
+
+/* A client connection
+ * Requests are read into in, one at a time: the next one is parsed once the
+ * response to the current one is written.
+ */
+struct mock_conn {
+  int fd;
+  char *in;
+  size_t in_len;
+  size_t in_size;
+  // response waiting for its latency to be over, then being written
+  char *out;
+  size_t out_len;
+  size_t out_size;
+  size_t out_sent;
+  uint64_t respond_at;
+  _Bool pending;
+  // bytes of in taken by the request being answered
+  size_t consumed;
+};
+
+static struct mock_options opt = {.port = 4242,
+                                  .fail_fraction = 0.1,
+                                  .interval = 10};
+static struct mock_counters counters;
+static struct mock_conn **conns;
+static int conns_size;
+static volatile sig_atomic_t stopping;
+
+static uint64_t mock_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static _Bool mock_chance(double rate) {
+  return rate > 0 && (double)rand() / ((double)RAND_MAX + 1) < rate;
+}
+
+static void mock_print_counters(void) {
+  fprintf(stderr,
+          "connections %" PRIu64 " requests %" PRIu64 " points %" PRIu64
+          " failed %" PRIu64 " errors %" PRIu64 " details %" PRIu64
+          " resets %" PRIu64 " bytes %" PRIu64 "\n",
+          counters.connections, counters.requests, counters.points,
+          counters.points_failed, counters.errors, counters.details,
+          counters.resets, counters.bytes);
+}
+
+static void mock_stop(int signum) {
+  (void)signum;
+  stopping = 1;
+}
+
+static void mock_close(int epfd, struct mock_conn *conn, _Bool reset) {
+  if (reset) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  }
+  epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  conns[conn->fd] = NULL;
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
+
+static int mock_append(char **buf, size_t *len, size_t *size, const char *data,
+                       size_t data_len) {
+  if (*len + data_len + 1 > *size) {
+    size_t new_size = (*size != 0) ? *size : 4096;
+    char *tmp;
+
+    while (new_size < *len + data_len + 1)
+      new_size *= 2;
+    tmp = realloc(*buf, new_size);
+    if (tmp == NULL)
+      return -1;
+    *buf = tmp;
+    *size = new_size;
+  }
+  memcpy(*buf + *len, data, data_len);
+  *len += data_len;
+  (*buf)[*len] = '\0';
+  return 0;
+}
+
+/* Value of header name in the headers of a request, NULL if missing */
+static const char *mock_header(const char *headers, const char *end,
+                               const char *name, size_t *value_len) {
+  size_t name_len = strlen(name);
+
+  for (const char *line = strstr(headers, "\r\n"); line != NULL && line < end;
+       line = strstr(line + 2, "\r\n")) {
+    const char *value = line + 2;
+
+    if (strncasecmp(value, name, name_len) != 0 || value[name_len] != ':')
+      continue;
+    value += name_len + 1;
+    while (*value == ' ')
+      value++;
+    *value_len = strcspn(value, "\r");
+    return value;
+  }
+  return NULL;
+}
+
+/* Decode a chunked body into body
+ * Returns the length of the chunked body, 0 if incomplete, -1 if invalid.
+ */
+static long mock_dechunk(const char *data, size_t len, char **body,
+                         size_t *body_len, size_t *body_size) {
+  size_t pos = 0;
+
+  *body_len = 0;
+  for (;;) {
+    char *end;
+    unsigned long chunk;
+    const char *eol = memchr(data + pos, '\n', len - pos);
+
+    if (eol == NULL)
+      return 0;
+    chunk = strtoul(data + pos, &end, 16);
+    if (end == data + pos)
+      return -1;
+    pos = eol - data + 1;
+    if (chunk == 0) {
+      // no trailers: the body ends with an empty line
+      if (len - pos < 2)
+        return 0;
+      return (long)(pos + 2);
+    }
+    if (len - pos < chunk + 2)
+      return 0;
+    if (mock_append(body, body_len, body_size, data + pos, chunk) != 0)
+      return -1;
+    pos += chunk + 2;
+  }
+}
+
+static int mock_inflate(const char *data, size_t len, char **out,
+                        size_t *out_len, size_t *out_size) {
+  z_stream stream = {0};
+  char buf[MOCK_READ_SIZE];
+  int status;
+
+  // 15 + 32: zlib or gzip header, detected
+  if (inflateInit2(&stream, 15 + 32) != Z_OK)
+    return -1;
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = len;
+  *out_len = 0;
+  do {
+    stream.next_out = (Bytef *)buf;
+    stream.avail_out = sizeof(buf);
+    status = inflate(&stream, Z_NO_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END)
+      break;
+    if (mock_append(out, out_len, out_size, buf,
+                    sizeof(buf) - stream.avail_out) != 0)
+      break;
+  } while (status != Z_STREAM_END);
+  inflateEnd(&stream);
+  return (status == Z_STREAM_END) ? 0 : -1;
+}
+
+/* End of the JSON value starting at p, strings being skipped */
+static const char *mock_json_end(const char *p, const char *end) {
+  int depth = 0;
+  _Bool string = 0;
+
+  for (; p < end; p++) {
+    if (string) {
+      if (*p == '\\')
+        p++;
+      else if (*p == '"')
+        string = 0;
+    } else if (*p == '"')
+      string = 1;
+    else if (*p == '{' || *p == '[')
+      depth++;
+    else if (*p == '}' || *p == ']') {
+      if (--depth == 0)
+        return p + 1;
+    }
+  }
+  return NULL;
+}
+
+/* Build the response to a batch of points */
+static void mock_answer_points(struct mock_conn *conn, const char *path,
+                               const char *body, size_t body_len) {
+  char *resp = NULL;
+  size_t resp_len = 0;
+  size_t resp_size = 0;
+  char head[256];
+  uint64_t points = 0;
+  uint64_t failed = 0;
+  int status = 204;
+
+  for (const char *p = body; (p = strstr(p, "\"metric\"")) != NULL; p++)
+    points++;
+  counters.points += points;
+
+  if (mock_chance(opt.error_rate)) {
+    counters.errors++;
+    status = 500;
+    mock_append(&resp, &resp_len, &resp_size, "{\"error\":{\"code\":500}}",
+                22);
+  } else if (strstr(path, "details") != NULL || points == 0) {
+    _Bool details = mock_chance(opt.details_rate);
+    const char *end = body + body_len;
+    const char *p = memchr(body, '[', body_len);
+
+    mock_append(&resp, &resp_len, &resp_size, "{\"errors\":[", 11);
+    while (details && p != NULL && p < end) {
+      const char *point = memchr(p, '{', end - p);
+      const char *point_end;
+
+      if (point == NULL || (point_end = mock_json_end(point, end)) == NULL)
+        break;
+      if (mock_chance(opt.fail_fraction)) {
+        if (failed > 0)
+          mock_append(&resp, &resp_len, &resp_size, ",", 1);
+        mock_append(&resp, &resp_len, &resp_size, "{\"datapoint\":", 13);
+        mock_append(&resp, &resp_len, &resp_size, point, point_end - point);
+        mock_append(&resp, &resp_len, &resp_size,
+                    ",\"error\":\"Unable to parse value to a number\"}", 45);
+        failed++;
+      }
+      p = point_end;
+    }
+    snprintf(head, sizeof(head), "],\"failed\":%" PRIu64 ",\"success\":%" PRIu64
+             "}", failed, points - failed);
+    mock_append(&resp, &resp_len, &resp_size, head, strlen(head));
+    status = (failed > 0 || points == 0) ? 400 : 200;
+    if (failed > 0)
+      counters.details++;
+    counters.points_failed += failed;
+  }
+
+  snprintf(head, sizeof(head),
+           "HTTP/1.1 %d Mock\r\nContent-Type: application/json\r\n"
+           "Content-Length: %zu\r\n\r\n",
+           status, resp_len);
+  conn->out_len = 0;
+  conn->out_sent = 0;
+  mock_append(&conn->out, &conn->out_len, &conn->out_size, head, strlen(head));
+  if (resp_len > 0)
+    mock_append(&conn->out, &conn->out_len, &conn->out_size, resp, resp_len);
+  free(resp);
+}
+
+/* Parse the request at the start of conn->in and prepare its response
+ * Returns 1 if a response is pending, 0 if the request is incomplete and -1
+ * if the connection must be reset.
+ */
+static int mock_parse_request(struct mock_conn *conn) {
+  const char *headers_end = strstr(conn->in, "\r\n\r\n");
+  const char *value;
+  char path[256] = "";
+  char *body = NULL;
+  size_t body_len = 0;
+  size_t body_size = 0;
+  size_t header_len;
+  size_t value_len;
+  size_t request_len;
+
+  if (headers_end == NULL)
+    return (conn->in_len > MOCK_MAX_REQUEST) ? -1 : 0;
+  header_len = headers_end - conn->in + 4;
+  sscanf(conn->in, "%*s %255s", path);
+
+  value = mock_header(conn->in, headers_end, "Transfer-Encoding", &value_len);
+  if (value != NULL && strncasecmp(value, "chunked", 7) == 0) {
+    long chunked = mock_dechunk(conn->in + header_len,
+                                conn->in_len - header_len, &body, &body_len,
+                                &body_size);
+    if (chunked <= 0) {
+      free(body);
+      return (chunked < 0 || conn->in_len > MOCK_MAX_REQUEST) ? -1 : 0;
+    }
+    request_len = header_len + chunked;
+  } else {
+    value = mock_header(conn->in, headers_end, "Content-Length", &value_len);
+    request_len = header_len + ((value != NULL) ? strtoul(value, NULL, 10) : 0);
+    if (conn->in_len < request_len)
+      return 0;
+    mock_append(&body, &body_len, &body_size, conn->in + header_len,
+                request_len - header_len);
+  }
+  conn->consumed = request_len;
+  counters.requests++;
+
+  if (mock_chance(opt.reset_rate)) {
+    counters.resets++;
+    free(body);
+    return -1;
+  }
+
+  value = mock_header(conn->in, headers_end, "Content-Encoding", &value_len);
+  if (value != NULL && body != NULL &&
+      (strncasecmp(value, "gzip", 4) == 0 ||
+       strncasecmp(value, "deflate", 7) == 0)) {
+    char *inflated = NULL;
+    size_t inflated_len = 0;
+    size_t inflated_size = 0;
+
+    if (mock_inflate(body, body_len, &inflated, &inflated_len,
+                     &inflated_size) != 0) {
+      free(inflated);
+      inflated = NULL;
+      inflated_len = 0;
+    }
+    free(body);
+    body = inflated;
+    body_len = inflated_len;
+  }
+
+  mock_answer_points(conn, path, (body != NULL) ? body : "", body_len);
+  free(body);
+  conn->respond_at = mock_now_ms() + opt.latency_ms;
+  conn->pending = 1;
+  return 1;
+}
+
+/* Write the response of conn once due, then parse the next request
+ * Returns -1 if the connection must be closed.
+ */
+static int mock_respond(int epfd, struct mock_conn *conn) {
+  struct epoll_event ev = {.data.fd = conn->fd};
+
+  while (conn->pending) {
+    ssize_t n;
+
+    if (mock_now_ms() < conn->respond_at)
+      return 0;
+    n = send(conn->fd, conn->out + conn->out_sent,
+             conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      ev.events = EPOLLIN | EPOLLOUT;
+      epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+      return 0;
+    }
+    conn->out_sent += (size_t)n;
+    if (conn->out_sent < conn->out_len)
+      continue;
+
+    conn->pending = 0;
+    memmove(conn->in, conn->in + conn->consumed,
+            conn->in_len - conn->consumed);
+    conn->in_len -= conn->consumed;
+    conn->in[conn->in_len] = '\0';
+    conn->consumed = 0;
+    ev.events = EPOLLIN;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+
+    if (conn->in_len > 0 && mock_parse_request(conn) < 0) {
+      mock_close(epfd, conn, 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Telnet interface: count the put lines, answering errors for some */
+static int mock_telnet_read(struct mock_conn *conn) {
+  char *line = conn->in;
+  char *eol;
+
+  while ((eol = memchr(line, '\n', conn->in_len - (line - conn->in))) !=
+         NULL) {
+    if (strncmp(line, "put ", 4) == 0) {
+      counters.points++;
+      if (mock_chance(opt.details_rate)) {
+        static const char error[] = "put: illegal argument: mock error\n";
+
+        counters.points_failed++;
+        if (send(conn->fd, error, sizeof(error) - 1, MSG_NOSIGNAL) < 0)
+          return -1;
+      }
+    }
+    line = eol + 1;
+  }
+  conn->in_len -= line - conn->in;
+  memmove(conn->in, line, conn->in_len);
+  conn->in[conn->in_len] = '\0';
+
+  if (mock_chance(opt.reset_rate)) {
+    counters.resets++;
+    return -1;
+  }
+  return 0;
+}
+
+static void mock_read(int epfd, struct mock_conn *conn) {
+  char buf[MOCK_READ_SIZE];
+
+  for (;;) {
+    ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      mock_close(epfd, conn, 0);
+      return;
+    }
+    if (n < 0)
+      break;
+    counters.bytes += (uint64_t)n;
+    if (mock_append(&conn->in, &conn->in_len, &conn->in_size, buf,
+                    (size_t)n) != 0) {
+      mock_close(epfd, conn, 1);
+      return;
+    }
+  }
+
+  if (opt.telnet) {
+    if (mock_telnet_read(conn) != 0)
+      mock_close(epfd, conn, 1);
+    return;
+  }
+
+  if (conn->pending)
+    return;
+  switch (mock_parse_request(conn)) {
+  case -1:
+    mock_close(epfd, conn, 1);
+    break;
+  case 1:
+    mock_respond(epfd, conn);
+    break;
+  }
+}
+
+static void mock_accept(int epfd, int lfd) {
+  int fd;
+
+  while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    struct mock_conn *conn;
+    int one = 1;
+
+    if (fd >= conns_size) {
+      int size = (fd + 1) * 2;
+      struct mock_conn **tmp = realloc(conns, size * sizeof(*conns));
+
+      if (tmp == NULL) {
+        close(fd);
+        continue;
+      }
+      memset(tmp + conns_size, 0, (size - conns_size) * sizeof(*conns));
+      conns = tmp;
+      conns_size = size;
+    }
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conns[fd] = conn;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    counters.connections++;
+  }
+}
+
+static int mock_listen(int port) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons((uint16_t)port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 1024) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void mock_usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-p port] [-l ms] [-e rate] [-d rate] [-f fraction] "
+          "[-r rate] [-s seed] [-i seconds] [-T]\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  struct epoll_event events[MOCK_MAX_EVENTS];
+  struct epoll_event ev = {.events = EPOLLIN};
+  uint64_t next_print;
+  int epfd, lfd;
+  int c;
+
+  srand((unsigned)time(NULL));
+  while ((c = getopt(argc, argv, "p:l:e:d:f:r:s:i:T")) != -1) {
+    switch (c) {
+    case 'p':
+      opt.port = atoi(optarg);
+      break;
+    case 'l':
+      opt.latency_ms = atoi(optarg);
+      break;
+    case 'e':
+      opt.error_rate = atof(optarg);
+      break;
+    case 'd':
+      opt.details_rate = atof(optarg);
+      break;
+    case 'f':
+      opt.fail_fraction = atof(optarg);
+      break;
+    case 'r':
+      opt.reset_rate = atof(optarg);
+      break;
+    case 's':
+      srand((unsigned)atoi(optarg));
+      break;
+    case 'i':
+      opt.interval = atoi(optarg);
+      break;
+    case 'T':
+      opt.telnet = 1;
+      break;
+    default:
+      mock_usage(argv[0]);
+    }
+  }
+
+  lfd = mock_listen(opt.port);
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (lfd < 0 || epfd < 0) {
+    fprintf(stderr, "cannot listen on 127.0.0.1:%d: %s\n", opt.port,
+            strerror(errno));
+    return 1;
+  }
+  ev.data.fd = lfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+  signal(SIGINT, mock_stop);
+  signal(SIGTERM, mock_stop);
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "mock TSD (%s) listening on 127.0.0.1:%d\n",
+          opt.telnet ? "telnet" : "http", opt.port);
+
+  next_print = mock_now_ms() + (uint64_t)opt.interval * 1000;
+  while (!stopping) {
+    uint64_t now = mock_now_ms();
+    int timeout = (opt.interval > 0) ? (int)(next_print - now) : -1;
+    int n;
+
+    // wake up for the earliest delayed response
+    for (int fd = 0; fd < conns_size; fd++) {
+      struct mock_conn *conn = conns[fd];
+
+      if (conn != NULL && conn->pending && conn->out_sent == 0) {
+        int wait = (conn->respond_at > now) ? (int)(conn->respond_at - now) : 0;
+        if (timeout < 0 || wait < timeout)
+          timeout = wait;
+      }
+    }
+
+    n = epoll_wait(epfd, events, MOCK_MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == lfd)
+        mock_accept(epfd, lfd);
+      else if (conns[fd] != NULL && (events[i].events & EPOLLOUT))
+        mock_respond(epfd, conns[fd]);
+      else if (conns[fd] != NULL)
+        mock_read(epfd, conns[fd]);
+    }
+
+    for (int fd = 0; fd < conns_size; fd++) {
+      if (conns[fd] != NULL && conns[fd]->pending)
+        mock_respond(epfd, conns[fd]);
+    }
+
+    if (opt.interval > 0 && mock_now_ms() >= next_print) {
+      mock_print_counters();
+      next_print += (uint64_t)opt.interval * 1000;
+    }
+  }
+
+  mock_print_counters();
+  for (int fd = 0; fd < conns_size; fd++) {
+    if (conns[fd] != NULL)
+      mock_close(epfd, conns[fd], 0);
+  }
+  free(conns);
+  close(epfd);
+  close(lfd);
+  return 0;
+}